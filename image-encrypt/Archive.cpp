@@ -0,0 +1,267 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Archive payload. The archive command packs several files into one
+* payload: a 16-byte header, the table of contents with one entry per
+* file (offset, size, CRC32 and name) and the content of the files.
+* It is encrypted like any other payload. Since the table of contents
+* is at the start of the text, extract reads it and then only the
+* bytes of the requested file (BMP::read_text_range), and checks them
+* with the checksum of their entry instead of the checksum of the image.
+*
+**********************************************************************/
+
+// Number of bytes copied or checksummed at once when the archive is written
+#define ARCHIVE_COPY_SIZE (1024 * 1024)
+
+/// <summary>
+/// Adds a file, or all files in a directory and its subdirectories, to the archive. The files are read by write.
+/// </summary>
+/// <param name="input">: The path of the file or directory, which becomes the name in the archive</param>
+void Archive::add(std::string input)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<fs::path> files;
+    if (fs::is_directory(input))
+    {
+        for (const auto& entry : fs::recursive_directory_iterator(input, fs::directory_options::skip_permission_denied))
+        {
+            if (entry.is_regular_file())
+            {
+                files.push_back(entry.path());
+            }
+        }
+
+        // Directory order is not defined, so the files are sorted to keep archives of the same files the same
+        std::sort(files.begin(), files.end());
+    }
+    else
+    {
+        files.push_back(input);
+    }
+
+    for (const auto& file : files)
+    {
+        // Names are relative with forward slashes, so they extract below the output directory on every system
+        ArchiveMember member;
+        member.name = file.lexically_normal().relative_path().generic_string();
+
+        if (member.name.empty() || member.name.size() > UINT16_MAX)
+        {
+            error("Invalid name for the archive: " + file.string());
+        }
+
+        ArchiveMember known;
+        if (find(member.name, known))
+        {
+            error(member.name + " was added to the archive twice.");
+        }
+
+        members.push_back(member);
+        sources.push_back(file.string());
+    }
+}
+
+/// <summary>
+/// Writes the archive with the added files. The files are read twice: first for their sizes and checksums, which
+/// go into the table of contents in front of them, then to copy them.
+/// </summary>
+/// <param name="fname">: The name of the archive file</param>
+void Archive::write(std::string fname)
+{
+    std::vector<uint8_t> chunk(ARCHIVE_COPY_SIZE);
+
+    ArchiveHeader header;
+    header.entry_count = (uint32_t)members.size();
+
+    uint64_t toc_size = 0;
+    for (const auto& member : members)
+    {
+        toc_size += sizeof(ArchiveEntry) + member.name.size();
+    }
+
+    if (toc_size > UINT32_MAX)
+    {
+        error("The table of contents of the archive is too large.");
+    }
+
+    header.toc_size = (uint32_t)toc_size;
+    uint64_t offset = sizeof(header) + toc_size;
+
+    for (size_t i = 0; i < members.size(); i++)
+    {
+        std::ifstream file(sources[i], std::ios_base::binary);
+        if (!file)
+        {
+            error("Unable to open the input file " + sources[i] + ".");
+        }
+
+        members[i].offset = offset;
+        members[i].size = 0;
+        members[i].crc = 0;
+
+        // The checksums of the chunks are combined like those of the row ranges of an image
+        while (file.read((char*)chunk.data(), chunk.size()) || file.gcount() > 0)
+        {
+            size_t count = (size_t)file.gcount();
+            members[i].crc = members[i].size == 0 ? calculate_crc32(chunk.data(), count)
+                : crc32_combine(members[i].crc, calculate_crc32(chunk.data(), count), count);
+            members[i].size += count;
+        }
+
+        offset += members[i].size;
+    }
+
+    std::ofstream out(fname, std::ios_base::binary);
+    if (!out)
+    {
+        error("Unable to open the output file " + fname + ".");
+    }
+
+    out.write((const char*)&header, sizeof(header));
+
+    for (const auto& member : members)
+    {
+        ArchiveEntry entry;
+        entry.offset = member.offset;
+        entry.size = member.size;
+        entry.crc = member.crc;
+        entry.name_size = (uint16_t)member.name.size();
+
+        out.write((const char*)&entry, sizeof(entry));
+        out.write(member.name.data(), member.name.size());
+    }
+
+    for (size_t i = 0; i < members.size(); i++)
+    {
+        std::ifstream file(sources[i], std::ios_base::binary);
+        uint64_t copied = 0;
+
+        while (copied < members[i].size && file.read((char*)chunk.data(), std::min<uint64_t>(chunk.size(), members[i].size - copied)))
+        {
+            out.write((const char*)chunk.data(), file.gcount());
+            copied += file.gcount();
+        }
+
+        if (copied != members[i].size)
+        {
+            error(sources[i] + " changed while the archive was written.");
+        }
+    }
+
+    if (!out)
+    {
+        error("Unable to write the output file " + fname + ".");
+    }
+}
+
+/// <summary>
+/// Reads the table of contents from the text of an image opened with BMP::open_text
+/// </summary>
+/// <param name="bmp">: The opened image</param>
+/// <returns>False if the text is no archive</returns>
+bool Archive::read(BMP& bmp)
+{
+    members.clear();
+    sources.clear();
+
+    uint64_t text_size = bmp.plain_text_size();
+
+    ArchiveHeader header;
+    if (text_size < sizeof(header))
+    {
+        return false;
+    }
+
+    bmp.read_text_range(0, sizeof(header));
+    memcpy(&header, bmp.get_text().data(), sizeof(header));
+
+    if (memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        return false;
+    }
+
+    if (header.version != ARCHIVE_VERSION || header.entry_size != sizeof(ArchiveEntry) || header.toc_size > text_size - sizeof(header))
+    {
+        error("The archive was written by an unsupported version of the program or is damaged.");
+    }
+
+    bmp.read_text_range(sizeof(header), header.toc_size);
+    const std::vector<uint8_t>& toc = bmp.get_text();
+
+    size_t position = 0;
+    for (uint32_t i = 0; i < header.entry_count; i++)
+    {
+        ArchiveEntry entry;
+        if (toc.size() - position < sizeof(entry))
+        {
+            error("The table of contents of the archive is damaged.");
+        }
+
+        memcpy(&entry, toc.data() + position, sizeof(entry));
+        position += sizeof(entry);
+
+        if (toc.size() - position < entry.name_size || entry.offset > text_size || entry.size > text_size - entry.offset)
+        {
+            error("The table of contents of the archive is damaged.");
+        }
+
+        ArchiveMember member;
+        member.name.assign((const char*)toc.data() + position, entry.name_size);
+        member.offset = entry.offset;
+        member.size = entry.size;
+        member.crc = entry.crc;
+        members.push_back(member);
+
+        position += entry.name_size;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Looks up a file of the archive by its name
+/// </summary>
+/// <param name="name">: The name in the archive</param>
+/// <param name="member">: Receives the file</param>
+/// <returns>False if the archive has no file with this name</returns>
+bool Archive::find(const std::string& name, ArchiveMember& member)
+{
+    for (const auto& known : members)
+    {
+        if (known.name == name)
+        {
+            member = known;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// <summary>
+/// Decrypts one file of the archive from the image and writes it
+/// </summary>
+/// <param name="bmp">: The image the table of contents was read from</param>
+/// <param name="member">: The file</param>
+/// <param name="out_fname">: The name of the output file</param>
+void Archive::extract(BMP& bmp, const ArchiveMember& member, std::string out_fname)
+{
+    bmp.read_text_range(member.offset, member.size);
+
+    const std::vector<uint8_t>& data = bmp.get_text();
+    if (calculate_crc32(data.data(), data.size()) != member.crc)
+    {
+        error("The data of " + member.name + " is corrupted or was manipulated");
+    }
+
+    bmp.write_text_out(out_fname);
+}
@@ -54,20 +54,128 @@ static const uint32_t crc32_table[256] = {
 };
 
 // Function to calculate CRC32 checksum
-uint32_t calculate_crc32(const std::vector<uint8_t>& data)
+uint32_t calculate_crc32(const uint8_t* data, size_t size)
 {
     uint32_t crc = 0xFFFFFFFF; // Initialize CRC with all bits set to 1
 
-    for (uint8_t byte : data)
+    for (size_t i = 0; i < size; i++)
     {
-        crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ byte];
+        crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ data[i]];
     }
 
     return crc ^ 0xFFFFFFFF; // Final XOR operation
 }
 
+// Multiplies a 32x32 matrix over GF(2) with a vector
+static uint32_t gf2_matrix_times(const uint32_t* matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    for (int i = 0; vector != 0; i++, vector >>= 1)
+    {
+        if (vector & 1)
+        {
+            sum ^= matrix[i];
+        }
+    }
+
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* matrix)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        square[i] = gf2_matrix_times(matrix, matrix[i]);
+    }
+}
+
+// Combines the CRC32 checksums of two consecutive blocks into the checksum of both blocks,
+// given the checksum of the first block, the checksum of the second block and the size of the second block.
+// The checksum of the first block is advanced by size2 zero bytes with the squared shift matrix (as in zlib).
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t size2)
+{
+    if (size2 == 0)
+    {
+        return crc1;
+    }
+
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    // Operator for one zero bit
+    odd[0] = 0xEDB88320;
+    for (int i = 1; i < 32; i++)
+    {
+        odd[i] = 1u << (i - 1);
+    }
+
+    // Operators for two and four zero bits
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    // Apply the operators for one, two, four, ... zero bytes for every bit set in size2
+    do
+    {
+        gf2_matrix_square(even, odd);
+        if (size2 & 1)
+        {
+            crc1 = gf2_matrix_times(even, crc1);
+        }
+        size2 >>= 1;
+
+        if (size2 == 0)
+        {
+            break;
+        }
+
+        gf2_matrix_square(odd, even);
+        if (size2 & 1)
+        {
+            crc1 = gf2_matrix_times(odd, crc1);
+        }
+        size2 >>= 1;
+    } while (size2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+// Images with more data than this are split into row ranges which are processed in parallel
+#define PARALLEL_MIN_SIZE (4 * 1024 * 1024)
+
+// Approximate size of one row range
+#define PARALLEL_RANGE_SIZE (1024 * 1024)
+
+// Smallest image data that can hold the embedded header and the checksum, one bit in every byte
+#define EMBED_MIN_DATA_SIZE (sizeof(EmbedHeader) * 8 + 32)
+
+// In the interactive menu the user has to confirm an error before the program exits. The command line mode turns this off.
+bool wait_on_error = true;
+
+// Threads that must not end the process turn this on, so error() throws std::runtime_error instead. The library
+// never ends the process of the service it is linked into, and the daemon only fails the request.
+#ifdef IMAGE_ENCRYPT_LIBRARY
+thread_local bool throw_on_error = true;
+#else
+thread_local bool throw_on_error = false;
+#endif
+
 void error(const std::string& message) 
 {
+    if (throw_on_error)
+    {
+        throw std::runtime_error(message);
+    }
+
+    // Only the first thread that fails reports its error and exits, the others wait here until the process ends
+    static std::mutex error_mutex;
+    error_mutex.lock();
+
+    if (!wait_on_error)
+    {
+        std::cerr << "error: " << message << "\n";
+        exit(1);
+    }
+
     std::cout << message << "\a\n" << "Press enter to exit ...";
 
     char ch;
@@ -85,6 +193,14 @@ void error(const std::string& message)
     exit(1);
 }
 
+/// <summary>
+/// Constructor for the BMP struct. Creates an empty image, which gets its content from load.
+/// </summary>
+BMP::BMP()
+{
+    key = 0;
+}
+
 /// <summary>
 /// Constructor for the BMP struct. Reads the BMP file and the headers from the file.
 /// </summary>
@@ -97,9 +213,164 @@ BMP::BMP(std::string fname)
         error("Unable to open the input image file.");
     }
 
-    // Read the file and the info headers
-    file.read((char*)&file_header, sizeof(file_header));
-    file.read((char*)&info_header, sizeof(info_header));
+    file.seekg(0, file.end);
+    AlignedBuffer file_data((size_t)file.tellg());
+    file.seekg(0, file.beg);
+    file.read((char*)file_data.data(), file_data.size());
+
+    file.close();
+
+    load(std::move(file_data));
+}
+
+/// <summary>
+/// Constructor for the BMP struct. Reads the headers and the pixel data from a BMP file that is already in memory.
+/// </summary>
+/// <param name="file_data">: The content of the BMP file. The BMP takes it over, so its pixel data does not have to be copied.</param>
+BMP::BMP(AlignedBuffer&& file_data)
+{
+    load(std::move(file_data));
+}
+
+/// <summary>
+/// Constructor for the BMP struct. Uses pixel data in memory without a file. The pixels stay owned by the caller
+/// and are changed in place.
+/// </summary>
+/// <param name="pixels">: The rows of the image without padding, in the order of a BMP file (bottom row first)</param>
+/// <param name="width">: The width of the image in pixels</param>
+/// <param name="height">: The height of the image in pixels</param>
+/// <param name="byte_count">: The number of bytes per pixel, 3 or 4</param>
+BMP::BMP(uint8_t* pixels, uint32_t width, uint32_t height, uint32_t byte_count)
+{
+    size_t data_size = (size_t)width * height * byte_count;
+
+    info_header.size = sizeof(info_header);
+    info_header.width = width;
+    info_header.height = height;
+    info_header.bit_count = byte_count * 8;
+    file_header.offset_data = sizeof(file_header) + sizeof(info_header);
+    padding = (uint8_t)(-((size_t)width * byte_count) & 3);
+
+    img_data = { pixels, data_size };
+    key = 0;
+}
+
+/// <summary>
+/// Constructor for the BMP struct. Uses a BMP file in memory that stays owned by the caller, like a shared mapping.
+/// If its rows have no padding, the pixel data is changed in place, otherwise save writes it back.
+/// </summary>
+/// <param name="file_data">: The content of the BMP file</param>
+BMP::BMP(ByteSpan file_data)
+{
+    size_t data_size = read_headers(file_data.data(), file_data.size());
+
+    if (padding == 0 && file_data.size() >= file_header.offset_data + data_size)
+    {
+        img_data = { file_data.data() + file_header.offset_data, data_size };
+    }
+    else
+    {
+        copy_rows(file_data.data(), file_data.size());
+    }
+
+    key = 0;
+}
+
+/// <summary>
+/// Reads the headers and the pixel data from the content of a BMP file. An image that was used before is reset
+/// first, so one object can be loaded with one image after another. The keystore, the password, the envelope and
+/// the pools stay set, and the buffers of the last image are reused.
+/// </summary>
+/// <param name="file_data">: The content of the BMP file</param>
+void BMP::load(AlignedBuffer&& file_data)
+{
+    reset();
+
+    size_t data_size = read_headers(file_data.data(), file_data.size());
+
+    // Without padding the rows follow each other in the file as they do in the image data, so the pixel data
+    // is used where it is and the buffer of the file is kept
+    if (padding == 0 && file_data.size() >= file_header.offset_data + data_size)
+    {
+        recycle(buffer);
+        buffer = std::move(file_data);
+        img_data = { buffer.data() + file_header.offset_data, data_size };
+    }
+    else
+    {
+        copy_rows(file_data.data(), file_data.size());
+        recycle(file_data);
+    }
+
+    // We initialize the key, so that we can check if it was generated later.
+    key = 0;
+}
+
+/// <summary>
+/// Empties the image and erases its keys. The text and the scratch buffers keep their memory for the next image;
+/// the buffer of the file goes back to the buffer pool if there is one.
+/// </summary>
+void BMP::reset()
+{
+    file_header = BMPFileHeader();
+    info_header = BMPInfoHeader();
+    padding = 0;
+    img_data = {};
+
+    if (buffer_pool)
+    {
+        recycle(buffer);
+    }
+    else
+    {
+        buffer.clear();
+    }
+
+    text.clear();
+    embed_header = EmbedHeader();
+    cipher = 0;
+
+    if (text_file.is_open())
+    {
+        text_file.close();
+    }
+
+    text_start = 0;
+    cipher_start = 0;
+    plain_size = 0;
+    secure_zero(aes_key.data(), aes_key.size());
+    aes_key.clear();
+    secure_zero(&key, sizeof(key));
+}
+
+/// <summary>
+/// Hands a buffer that is no longer needed to the buffer pool. Without a pool it is freed.
+/// </summary>
+/// <param name="buffer">: The buffer, which is empty afterwards</param>
+void BMP::recycle(AlignedBuffer& buffer)
+{
+    if (buffer_pool)
+    {
+        buffer_pool->give(std::move(buffer));
+    }
+
+    buffer = AlignedBuffer();
+}
+
+/// <summary>
+/// Reads and checks the file and the info headers and calculates the padding
+/// </summary>
+/// <param name="file_data">: The content of the BMP file</param>
+/// <param name="size">: The size of the content</param>
+/// <returns>The size of the image data</returns>
+size_t BMP::read_headers(const uint8_t* file_data, size_t size)
+{
+    // Read the file and the info headers. Parts missing in a short file keep their default values.
+    memcpy(&file_header, file_data, std::min(size, sizeof(file_header)));
+    if (size > sizeof(file_header))
+    {
+        memcpy(&info_header, file_data + sizeof(file_header), std::min(size - sizeof(file_header), sizeof(info_header)));
+    }
 
     if (info_header.bit_count != 24 && info_header.bit_count != 32)
     {
@@ -122,472 +393,1738 @@ BMP::BMP(std::string fname)
         error("The program can read only BMP files with header size of 54 bytes");
     }
 
-    int width = info_header.width;
-    int height = info_header.height;
-    int byte_count = info_header.bit_count / 8;
+    size_t row_size = (size_t)info_header.width * (info_header.bit_count / 8);
 
     // Calculate the padding for each row in the image. There are zeroes at the end of each row for line break. 
     // The padding is necessary to ensure that the data of each row starts at a multiple of 4 bytes.
-    padding = ((-width & byte_count));
+    padding = (uint8_t)(-row_size & 3);
+
+    // The image data holds the rows without the padding
+    return row_size * info_header.height;
+}
 
-    // For each row of pixels, there is a width and the number of zeroes at the end of the row. 
-    int data_size = (width * height * byte_count) + (padding * height);
+/// <summary>
+/// Copies the rows of the file without their padding into the buffer, which becomes the image data
+/// </summary>
+/// <param name="file_data">: The content of the BMP file</param>
+/// <param name="size">: The size of the content</param>
+void BMP::copy_rows(const uint8_t* file_data, size_t size)
+{
+    size_t height = info_header.height;
+    size_t row_size = (size_t)info_header.width * (info_header.bit_count / 8);
+    size_t data_size = row_size * height;
 
-    img_data.resize(data_size);
+    if (buffer_pool && buffer.capacity() < data_size)
+    {
+        recycle(buffer);
+        buffer = buffer_pool->take(data_size);
+    }
 
-    file.seekg(file_header.offset_data, file.beg);
+    // Every byte is copied from the file, so the buffer is not zeroed first
+    buffer.resize(data_size);
+    img_data = { buffer.data(), data_size };
 
-    for (int i = 0; i < height; i++)
+    size_t copied = 0;
+    for (size_t i = 0; i < height; i++)
     {
-        // Read the data row by row
-        file.read((char*)(img_data.data() + (width * byte_count + padding) * i), width * byte_count);
+        // Copy the data row by row and skip the padding
+        size_t position = file_header.offset_data + (row_size + padding) * i;
+        if (position >= size)
+        {
+            break;
+        }
 
-        // Skip the padding. Cur means that the seekg should happen relative to the current position in the file.
-        file.seekg(padding, std::ios_base::cur);
+        size_t count = std::min(row_size, size - position);
+        memcpy(img_data.data() + row_size * i, file_data + position, count);
+        copied = row_size * i + count;
     }
 
-    file.close();
+    // Rows missing in a short file are zero
+    memset(img_data.data() + copied, 0, data_size - copied);
+}
 
-    // We initialize the key, so that we can check if it was generated later.
-    key = 0;
+/// <summary>
+/// Estimates the most memory a job needs for an image from its headers, without loading the pixel data.
+/// It counts the image data, the file buffer and three copies of the text: the text, the ciphertext and the text with the
+/// header in front while the ciphertext is still allocated.
+/// </summary>
+/// <param name="fname">: The name of the BMP file</param>
+/// <param name="text_size">: The size of the text. It is limited to the capacity of the image, so UINT64_MAX can be used when decrypting.</param>
+/// <returns>The estimate in bytes, or 0 if the headers can not be read</returns>
+uint64_t BMP::estimate_memory(std::string fname, uint64_t text_size)
+{
+    BMPFileHeader file_header;
+    BMPInfoHeader info_header;
+
+    std::ifstream file(fname, std::ios_base::binary);
+    if (!file.read((char*)&file_header, sizeof(file_header)) || !file.read((char*)&info_header, sizeof(info_header)))
+    {
+        return 0;
+    }
+
+    int64_t width = std::max(0, info_header.width);
+    int64_t height = std::max(0, info_header.height);
+    int64_t byte_count = info_header.bit_count / 8;
+
+    // Same size as the image data of the constructor
+    uint64_t data_size = width * height * byte_count;
+
+    // The file is read into a buffer and written from a buffer. Images without row padding use the same buffer
+    // for both, but images with padding copy their pixel data out of it.
+    return sizeof(BMP) + 2 * data_size + 3 * (std::min(text_size, capacity(data_size)) + EVP_MAX_BLOCK_LENGTH);
 }
 
 /// <summary>
-/// Encrypts the text from the file and writes it to the image
+/// Reads bytes from the lowest bits of image data, eight bytes of image data for every byte
 /// </summary>
-/// <param name="fname">: The name of the BMP-File to encrypt</param>
-/// <param name="encryption_type">: The type of encryption to use</param>
-void BMP::encrypt(std::string fname, int encryption_type)
+/// <param name="data">: The image data with the lowest bit of the first byte</param>
+/// <param name="bytes">: Receives the bytes</param>
+/// <param name="count">: The number of bytes to read</param>
+static void read_bits(const uint8_t* data, uint8_t* bytes, size_t count)
 {
-    read_text_from_file(fname);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t byte = 0;
+        for (uint32_t j = 0; j < 8; j++)
+        {
+            byte |= ((data[i * 8 + j] & 1) << j);
+        }
+        bytes[i] = byte;
+    }
+}
 
-    switch (encryption_type)
+#pragma pack(push, 1)
+
+// Embedded header of version 2, which had only the size of the text
+struct EmbedHeaderV2
+{
+    uint32_t magic;
+    uint8_t version;
+    uint64_t text_size;
+};
+
+#pragma pack(pop)
+
+/// <summary>
+/// Reads the embedded header from the first bytes of the image data and checks if the text fits between the header
+/// and the checksum. Images of versions 1 and 2 are read into a header with only the version and the size of the text.
+/// Random image data rarely passes: it lacks the magic number, and as version 1 its size is mostly beyond the capacity.
+/// </summary>
+/// <param name="data">: The first bytes of the image data</param>
+/// <param name="available">: The number of bytes in data, up to sizeof(EmbedHeader) * 8 are used</param>
+/// <param name="data_size">: The size of all image data</param>
+/// <param name="header">: Receives the header</param>
+/// <param name="text_start">: Receives the byte of the image data at which the text starts</param>
+/// <returns>False if the image data can not hold an embedded text</returns>
+static bool read_embed_header(const uint8_t* data, size_t available, uint64_t data_size, EmbedHeader& header, size_t& text_start)
+{
+    header = EmbedHeader();
+
+    uint32_t magic = 0;
+    uint8_t version = 0;
+    if (available >= 40)
     {
-    case 1:
-        generate_aes_key();
-        aes_encrypt();
-        break;
-    case 2:
-        generate_key();
-        encrypt_decrypt_data();
-        break;
-    case 3:
-		break;
-    default:
-        error("Invalid encryption type");
+        read_bits(data, (uint8_t*)&magic, sizeof(magic));
+        read_bits(data + 32, &version, sizeof(version));
     }
 
-    write_text_to_img_data();
-    write_image_out("encrypted.bmp");
+    if (magic == EMBED_MAGIC && version == EMBED_VERSION && available >= sizeof(EmbedHeader) * 8)
+    {
+        read_bits(data, (uint8_t*)&header, sizeof(header));
+        text_start = sizeof(EmbedHeader) * 8;
+
+        // A header that does not match its checksum, or that uses flags or bits this version does not know, was
+        // not written by this program
+        if (header.header_crc != calculate_crc32((const uint8_t*)&header, offsetof(EmbedHeader, header_crc))
+            || header.flags != 0 || header.bits_per_channel != EMBED_BITS_PER_CHANNEL)
+        {
+            return false;
+        }
+    }
+    else if (magic == EMBED_MAGIC && version == 2 && available >= sizeof(EmbedHeaderV2) * 8)
+    {
+        EmbedHeaderV2 header_v2;
+        read_bits(data, (uint8_t*)&header_v2, sizeof(header_v2));
+
+        header.version = 2;
+        header.text_size = header_v2.text_size;
+        text_start = sizeof(EmbedHeaderV2) * 8;
+    }
+    else if (available >= 32)
+    {
+        uint32_t legacy_size = 0;
+        read_bits(data, (uint8_t*)&legacy_size, sizeof(legacy_size));
+
+        header.version = 1;
+        header.text_size = legacy_size;
+        text_start = 32;
+    }
+    else
+    {
+        return false;
+    }
+
+    // The text has to fit between the start and the checksum, which also rules out sizes that would overflow
+    return data_size >= text_start + 32 && header.text_size <= (data_size - text_start - 32) / 8;
 }
 
 /// <summary>
-/// Decrypts the text from the image and writes it to a file
+/// Reads the file and the info header of a BMP file and checks them like read_headers, without reading the pixel data
 /// </summary>
-/// <param name="fname">: The Name of the BMP-File to be decrypted</param>
-/// <param name="encryption_type">: The type of encryption to use</param>
-void BMP::decrypt(std::string fname, int encryption_type)
+/// <returns>False if the headers can not be read or describe an image the program can not read</returns>
+static bool read_file_headers(std::ifstream& file, BMPFileHeader& file_header, BMPInfoHeader& info_header)
 {
-    read_text_from_img_data();
+    if (!file.read((char*)&file_header, sizeof(file_header)) || !file.read((char*)&info_header, sizeof(info_header)))
+    {
+        return false;
+    }
+
+    return (info_header.bit_count == 24 || info_header.bit_count == 32) && info_header.colors_used == 0
+        && info_header.width > 0 && info_header.height > 0 && file_header.offset_data == 54;
+}
+
+/// <summary>
+/// Returns how many bytes of text fit into the image of a BMP file, from its two headers only
+/// </summary>
+/// <param name="fname">: The name of the BMP file</param>
+/// <param name="capacity">: Receives the capacity</param>
+/// <returns>False if the file can not be read or is no BMP file the program can read</returns>
+bool BMP::file_capacity(std::string fname, uint64_t& capacity)
+{
+    BMPFileHeader file_header;
+    BMPInfoHeader info_header;
+
+    std::ifstream file(fname, std::ios_base::binary);
+    if (!read_file_headers(file, file_header, info_header))
+    {
+        return false;
+    }
+
+    capacity = BMP::capacity((uint64_t)info_header.width * info_header.height * (info_header.bit_count / 8));
+    return true;
+}
+
+/// <summary>
+/// Returns the largest size a text can have after encryption, to choose a carrier before the text is encrypted
+/// </summary>
+/// <param name="encryption_type">: The type of encryption</param>
+/// <param name="text_size">: The size of the text</param>
+/// <param name="recipient_count">: The number of recipients for encryption type 5</param>
+uint64_t BMP::encrypted_size(int encryption_type, uint64_t text_size, size_t recipient_count)
+{
+    // AES pads the text to whole blocks, a text of whole blocks gets one more
+    uint64_t aes_size = (text_size / 16 + 1) * 16;
 
     switch (encryption_type)
     {
     case 1:
-        read_aes_key();
-        aes_decrypt();
-        break;
-    case 2:
-        read_key();
-        encrypt_decrypt_data();
-        break;
-    case 3:
-        break;
+        return aes_size;
+    case 4:
+        return sizeof(PasswordHeader) + aes_size;
+    case 5:
+        return sizeof(EnvelopeHeader) + recipient_count * sizeof(EnvelopeRecipient) + aes_size;
     default:
-        error("Invalid encryption type");
+        return text_size;
     }
-
-    write_text_out(fname);
 }
 
 /// <summary>
-/// Read text from file and store it in the text variable
+/// Checks from the headers and the first row of a BMP file whether it holds an embedded text, without reading the
+/// rest of the file. It rejects images that were never encrypted at the cost of opening them.
 /// </summary>
-/// <param name="fname">The text file from which the text is to be read</param>
-void BMP::read_text_from_file(std::string fname)
+/// <param name="fname">: The name of the BMP file</param>
+/// <param name="header">: Receives the embedded header, which is not checked by the checksum yet. The key ID is taken
+/// from the BMP file header if the embedded header has none.</param>
+/// <param name="capacity">: Receives how many bytes of text fit into the image, 0 if the file can not be read</param>
+/// <returns>False if the file can not be read or can not hold an embedded text</returns>
+bool BMP::probe(std::string fname, EmbedHeader& header, uint64_t& capacity)
 {
+    BMPFileHeader file_header;
+    BMPInfoHeader info_header;
+
+    capacity = 0;
+
     std::ifstream file(fname, std::ios_base::binary);
-    if (!file)
+    if (!read_file_headers(file, file_header, info_header))
+    {
+        return false;
+    }
+
+    size_t row_size = (size_t)info_header.width * (info_header.bit_count / 8);
+    size_t stride = (row_size + 3) & ~(size_t)3;
+    uint64_t data_size = (uint64_t)row_size * info_header.height;
+    capacity = BMP::capacity(data_size);
+
+    // The header is in the first row, only narrow images need the rows after it
+    uint8_t data[sizeof(EmbedHeader) * 8];
+    size_t available = 0;
+
+    for (size_t row = 0; available < sizeof(data) && row < (size_t)info_header.height; row++)
+    {
+        size_t count = std::min(row_size, sizeof(data) - available);
+
+        file.seekg(file_header.offset_data + stride * row);
+        if (!file.read((char*)data + available, count))
+        {
+            break;
+        }
+
+        available += count;
+    }
+
+    size_t text_start;
+    if (!read_embed_header(data, available, data_size, header, text_start))
+    {
+        return false;
+    }
+
+    if (header.key_id == 0)
+    {
+        header.key_id = file_header.reserved1 | ((uint32_t)file_header.reserved2 << 16);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Sets the keystore in which new keys are stored and in which keys are looked up by the key ID of the image
+/// </summary>
+/// <param name="keystore">: The keystore or nullptr to use the key and aes_key files</param>
+void BMP::set_keystore(Keystore* keystore)
+{
+    this->keystore = keystore;
+}
+
+/// <summary>
+/// Sets the password from which the AES keys are derived when using encryption type 4
+/// </summary>
+/// <param name="password_key">: The password key</param>
+void BMP::set_password_key(PasswordKey* password_key)
+{
+    this->password_key = password_key;
+}
+
+/// <summary>
+/// Sets the recipients (when encrypting) or the own private key (when decrypting) for encryption type 5
+/// </summary>
+/// <param name="envelope">: The envelope</param>
+void BMP::set_envelope(Envelope* envelope)
+{
+    this->envelope = envelope;
+}
+
+/// <summary>
+/// Sets the thread pool on which the row ranges of large images are processed
+/// </summary>
+/// <param name="thread_pool">: The thread pool or nullptr to process everything on the calling thread</param>
+void BMP::set_thread_pool(ThreadPool* thread_pool)
+{
+    this->thread_pool = thread_pool;
+}
+
+/// <summary>
+/// Sets the pool the buffers of the file and of the rows are taken from and returned to
+/// </summary>
+/// <param name="buffer_pool">: The buffer pool, or nullptr to allocate and free the buffers</param>
+void BMP::set_buffer_pool(BufferPool* buffer_pool)
+{
+    this->buffer_pool = buffer_pool;
+}
+
+/// <summary>
+/// Sets the key for encryption types 1 (32 bytes) and 2 (8 bytes). It is used instead of a generated key and is not
+/// stored anywhere, so the caller has to keep it to decrypt the image.
+/// </summary>
+/// <param name="key">: The key</param>
+/// <param name="size">: The number of bytes in key</param>
+void BMP::set_key(const uint8_t* key, size_t size)
+{
+    caller_key.assign(key, key + size);
+}
+
+/// <summary>
+/// Runs body(0) to body(count - 1) on the thread pool, or one after another if there is no thread pool
+/// </summary>
+void BMP::for_each_range(size_t count, const std::function<void(size_t)>& body)
+{
+    if (thread_pool && count > 1)
+    {
+        thread_pool->parallel_for(count, body);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        body(i);
+    }
+}
+
+/// <summary>
+/// Splits the image data into ranges of whole rows. Small images, or images without thread pool, are one range.
+/// </summary>
+/// <param name="ranges">: Receives the begin and end of every range in the image data</param>
+/// <returns>The number of ranges</returns>
+size_t BMP::row_ranges(std::vector<std::pair<size_t, size_t>>& ranges)
+{
+    size_t data_size = img_data.size();
+    size_t row_size = info_header.height > 0 ? data_size / info_header.height : data_size;
+
+    ranges.clear();
+
+    if (!thread_pool || thread_pool->size() < 2 || data_size < PARALLEL_MIN_SIZE || row_size == 0)
+    {
+        ranges.push_back({ 0, data_size });
+        return 1;
+    }
+
+    size_t rows_per_range = std::max<size_t>(1, PARALLEL_RANGE_SIZE / row_size);
+    for (size_t begin = 0; begin < data_size; begin += rows_per_range * row_size)
+    {
+        ranges.push_back({ begin, std::min(data_size, begin + rows_per_range * row_size) });
+    }
+
+    return ranges.size();
+}
+
+/// <summary>
+/// Calculates the CRC32 checksum of the image data without the last 32 bytes, which hold the checksum itself.
+/// The row ranges are checksummed in parallel and the partial checksums are combined.
+/// </summary>
+/// <returns>The checksum</returns>
+uint32_t BMP::checksum()
+{
+    if (img_data.size() < 32)
+    {
+        error("The image is too small for a checksum");
+    }
+
+    size_t crc_size = img_data.size() - 32;
+
+    row_ranges(ranges);
+    range_crcs.resize(ranges.size());
+
+    for_each_range(ranges.size(), [this, crc_size](size_t r) {
+        size_t begin = std::min(ranges[r].first, crc_size);
+        size_t end = std::min(ranges[r].second, crc_size);
+        range_crcs[r] = calculate_crc32(img_data.data() + begin, end - begin);
+    });
+
+    uint32_t crc = range_crcs[0];
+    for (size_t r = 1; r < ranges.size(); r++)
+    {
+        size_t begin = std::min(ranges[r].first, crc_size);
+        size_t end = std::min(ranges[r].second, crc_size);
+        crc = crc32_combine(crc, range_crcs[r], end - begin);
+    }
+
+    return crc;
+}
+
+/// <summary>
+/// Returns the ID of the key the image was encrypted with. It is stored in the reserved fields of the file header.
+/// </summary>
+/// <returns>The key ID or 0 if the key is stored in the key or aes_key file</returns>
+uint32_t BMP::get_key_id()
+{
+    return file_header.reserved1 | ((uint32_t)file_header.reserved2 << 16);
+}
+
+/// <summary>
+/// Stores the ID of the key in the reserved fields of the file header
+/// </summary>
+/// <param name="key_id">: The key ID or 0 if the key is not stored in a keystore</param>
+void BMP::set_key_id(uint32_t key_id)
+{
+    file_header.reserved1 = key_id & 0xFFFF;
+    file_header.reserved2 = key_id >> 16;
+}
+
+/// <summary>
+/// Encrypts the text from the file and writes it to the image
+/// </summary>
+/// <param name="fname">: The name of the BMP-File to encrypt</param>
+/// <param name="encryption_type">: The type of encryption to use</param>
+/// <param name="out_fname">: The name of the encrypted BMP file</param>
+void BMP::encrypt(std::string fname, int encryption_type, std::string out_fname)
+{
+    read_text_from_file(fname);
+    encrypt_text(encryption_type);
+    write_image_out(out_fname);
+}
+
+/// <summary>
+/// Decrypts the text from the image and writes it to a file
+/// </summary>
+/// <param name="fname">: The Name of the BMP-File to be decrypted</param>
+/// <param name="encryption_type">: The type of encryption to use</param>
+void BMP::decrypt(std::string fname, int encryption_type)
+{
+    decrypt_text(encryption_type);
+    write_text_out(fname);
+}
+
+/// <summary>
+/// Encrypts the text variable and writes it to the image data
+/// </summary>
+/// <param name="encryption_type">: The type of encryption to use</param>
+void BMP::encrypt_text(int encryption_type)
+{
+    apply_encryption(encryption_type);
+    write_text_to_img_data();
+}
+
+/// <summary>
+/// Reads the text from the image data and decrypts it into the text variable
+/// </summary>
+/// <param name="encryption_type">: The type of encryption to use</param>
+void BMP::decrypt_text(int encryption_type)
+{
+    read_text_from_img_data();
+    apply_decryption(encryption_type);
+}
+
+/// <summary>
+/// Encrypts the text variable in place, without writing it to the image data
+/// </summary>
+/// <param name="encryption_type">: The type of encryption to use</param>
+void BMP::apply_encryption(int encryption_type)
+{
+    set_key_id(0);
+    cipher = (uint8_t)encryption_type;
+
+    // The nonce is chosen here and not by embed_text, since counter mode encrypts with it
+    RNG::bytes(embed_header.nonce, sizeof(embed_header.nonce));
+
+    switch (encryption_type)
+    {
+    case 1:
+        generate_aes_key();
+        aes_encrypt();
+        break;
+    case 2:
+        generate_key();
+        encrypt_decrypt_data();
+        break;
+    case 3:
+		break;
+    case 4:
+        password_encrypt();
+        break;
+    case 5:
+        envelope_encrypt();
+        break;
+    case 6:
+        generate_aes_key();
+        ctr_crypt();
+        break;
+    default:
+        error("Invalid encryption type");
+    }
+}
+
+/// <summary>
+/// Decrypts the text variable in place, after it was read from the image data
+/// </summary>
+/// <param name="encryption_type">: The type of encryption to use, 0 for the type in the embedded header (or AES for
+/// images without one)</param>
+void BMP::apply_decryption(int encryption_type)
+{
+    if (encryption_type == 0)
+    {
+        encryption_type = cipher != 0 ? cipher : 1;
+    }
+    else if (cipher != 0 && cipher != encryption_type)
+    {
+        error("The text was encrypted with encryption type " + std::to_string(cipher) + ", not " + std::to_string(encryption_type) + ".");
+    }
+
+    switch (encryption_type)
+    {
+    case 1:
+        read_aes_key();
+        aes_decrypt();
+        break;
+    case 2:
+        read_key();
+        encrypt_decrypt_data();
+        break;
+    case 3:
+        break;
+    case 4:
+        password_decrypt();
+        break;
+    case 5:
+        envelope_decrypt();
+        break;
+    case 6:
+        read_aes_key();
+        ctr_crypt();
+        break;
+    default:
+        error("Invalid encryption type");
+    }
+}
+
+/// <summary>
+/// Sets the text that is encrypted into the image
+/// </summary>
+/// <param name="text">: The text</param>
+void BMP::set_text(const std::vector<uint8_t>& text)
+{
+    this->text = text;
+}
+
+/// <summary>
+/// Returns the text, which is the decrypted text after decrypt_text
+/// </summary>
+const std::vector<uint8_t>& BMP::get_text()
+{
+    return text;
+}
+
+/// <summary>
+/// Checks the CRC32 checksum at the end of the image data without reading the text
+/// </summary>
+/// <returns>True if the image data was not changed since the text was written into it</returns>
+bool BMP::verify()
+{
+    size_t data_size = img_data.size();
+    if (data_size < 64)
+    {
+        return false;
+    }
+
+    // Images without a valid header are rejected after the first row, before the whole image data is checksummed
+    EmbedHeader header;
+    size_t text_start;
+    if (!read_embed_header(img_data.data(), data_size, data_size, header, text_start))
+    {
+        return false;
+    }
+
+    uint32_t crc_read = checksum();
+    uint32_t crc_expected = 0;
+
+    // Read the last 32 bits from the image data to get the CRC32 checksum
+    for (size_t i = data_size - 32; i < data_size; i++)
+    {
+        crc_expected |= (uint32_t)(img_data[i] & 1) << (i - data_size + 32);
+    }
+
+    return crc_read == crc_expected;
+}
+
+/// <summary>
+/// Returns how many bytes of text fit into the image
+/// </summary>
+uint64_t BMP::capacity()
+{
+    return capacity(img_data.size());
+}
+
+/// <summary>
+/// Returns how many bytes of text fit into image data of a size, after the embedded header and before the checksum
+/// </summary>
+/// <param name="data_size">: The size of the image data</param>
+uint64_t BMP::capacity(uint64_t data_size)
+{
+    return data_size < EMBED_MIN_DATA_SIZE ? 0 : (data_size - EMBED_MIN_DATA_SIZE) / 8;
+}
+
+/// <summary>
+/// Read text from file and store it in the text variable
+/// </summary>
+/// <param name="fname">The text file from which the text is to be read</param>
+void BMP::read_text_from_file(std::string fname)
+{
+    std::ifstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the input file.");
+    }
+
+    file.seekg(0, file.end);
+    size_t length = (size_t)file.tellg();
+    file.seekg(0, file.beg);
+
+    text.resize(length);
+    file.read((char*)text.data(), text.size());
+
+    file.close();
+}
+
+/// <summary>
+/// Write the text to a file
+/// </summary>
+/// <param name="fname">The name of the file to write the text to</param>
+void BMP::write_text_out(std::string fname)
+{
+    std::ofstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the output file.");
+    }
+
+    file.write((const char*)text.data(), text.size());
+
+    file.close();
+}
+
+/// <summary>
+/// Write the text to the image data bitwise
+/// </summary>
+void BMP::write_text_to_img_data()
+{
+    embed_text();
+    write_checksum();
+}
+
+/// <summary>
+/// Writes the size of the text, the text and the random fill to the image data, range by range
+/// </summary>
+void BMP::embed_text()
+{
+    // An empty text fits into a capacity of 0, which images too small for the header have as well
+    if (img_data.size() < EMBED_MIN_DATA_SIZE)
+    {
+        error("The image is too small for the embedded header and the checksum");
+    }
+
+    if (text.size() > capacity())
+    {
+        error("The text is to large for the image");
+    }
+
+    // The new header keeps the nonce of apply_encryption
+    EmbedHeader header;
+    memcpy(header.nonce, embed_header.nonce, sizeof(header.nonce));
+
+    embed_header = header;
+    embed_header.cipher = cipher;
+    embed_header.key_id = get_key_id();
+    embed_header.text_size = text.size();
+    embed_header.header_crc = calculate_crc32((const uint8_t*)&embed_header, offsetof(EmbedHeader, header_crc));
+
+    row_ranges(ranges);
+
+    for_each_range(ranges.size(), [this](size_t r) {
+        embed_range(ranges[r].first, ranges[r].second);
+    });
+}
+
+/// <summary>
+/// Calculates the CRC32 checksum of the image data and writes it to the last 32 bytes
+/// </summary>
+void BMP::write_checksum()
+{
+    size_t data_size = img_data.size();
+
+    if (data_size < EMBED_MIN_DATA_SIZE)
+    {
+        error("The image is too small for the embedded header and the checksum");
+    }
+
+    // Calculate the CRC32 checksum of the image data until data_size - 32
+    uint32_t crc = checksum();
+
+    // Write the CRC32 checksum to the last 32 bits of the image data
+    for (size_t i = data_size - 32; i < data_size; i++)
+    {
+        uint8_t bit = (crc >> (i - data_size + 32)) & 1;
+
+        img_data[i] &= ~1;
+        img_data[i] |= bit;
+    }
+}
+
+/// <summary>
+/// Writes the part of the header, the text and the random fill that falls into a range of the image data
+/// </summary>
+/// <param name="begin">: The first byte of the range</param>
+/// <param name="end">: The byte after the range</param>
+void BMP::embed_range(size_t begin, size_t end)
+{
+    const uint8_t* header = (const uint8_t*)&embed_header;
+    size_t text_start = sizeof(EmbedHeader) * 8;
+    size_t text_end = text_start + text.size() * 8;
+    size_t fill_end = img_data.size() - 32;
+
+    // We write the header with the size of the text in the first bytes of the image data
+    for (size_t i = begin; i < std::min(end, text_start); i++)
+    {
+        uint8_t bit = (header[i / 8] >> (i % 8)) & 1;
+
+        img_data[i] &= ~1;
+        img_data[i] |= bit;
+    }
+
+    // Every bit of the text is written in the image data
+    for (size_t i = std::max(begin, text_start); i < std::min(end, text_end); i++)
+    {
+        uint8_t bit = (text[(i - text_start) / 8] >> ((i - text_start) % 8)) & 1;
+
+        img_data[i] &= ~1;
+        img_data[i] |= bit;
+    }
+
+    // Fill the rest of the image data with random data
+    // The lowest bit is replaced with a random bit, so the unused bytes look the same as the ones carrying the text
+    for (size_t i = std::max(begin, text_end); i < std::min(end, fill_end); i += 64)
+    {
+        uint64_t bits = RNG::next_u64();
+        size_t count = std::min<size_t>(64, std::min(end, fill_end) - i);
+
+        for (size_t j = 0; j < count; j++)
+        {
+            img_data[i + j] &= ~1;
+            img_data[i + j] |= (bits >> j) & 1;
+        }
+    }
+}
+
+/// <summary>
+/// Read the text from the image data bitwise
+/// </summary>
+void BMP::read_text_from_img_data()
+{
+    if (!verify())
+    {
+        error("The data in the image is corrupted or was manipulated");
+    }
+
+    extract_text();
+}
+
+/// <summary>
+/// Reads the text from the image data bitwise without checking the checksum
+/// </summary>
+void BMP::extract_text()
+{
+    size_t text_start;
+    if (!read_embed_header(img_data.data(), img_data.size(), img_data.size(), embed_header, text_start))
+    {
+        error("The length of the text in the image is larger than the image");
+    }
+
+    // The header tells how the text was encrypted and with which key, even if the BMP file header was rewritten
+    cipher = embed_header.cipher;
+    if (embed_header.key_id != 0)
+    {
+        set_key_id(embed_header.key_id);
+    }
+
+    size_t text_size = embed_header.text_size;
+
+    text.resize(text_size);
+
+    // Large texts are read in parallel, every range of the image data holds PARALLEL_RANGE_SIZE / 8 bytes of text
+    size_t bytes_per_range = PARALLEL_RANGE_SIZE / 8;
+    size_t range_count = (text_size * 8 >= PARALLEL_MIN_SIZE) ? (text_size + bytes_per_range - 1) / bytes_per_range : 1;
+
+    for_each_range(range_count, [&](size_t r) {
+        size_t begin = r * bytes_per_range;
+        size_t end = range_count == 1 ? text_size : std::min<size_t>(text_size, (r + 1) * bytes_per_range);
+
+        read_bits(img_data.data() + text_start + begin * 8, text.data() + begin, end - begin);
+    });
+}
+
+/// <summary>
+/// Write the image data to a file
+/// </summary>
+/// <param name="fname">The name of the file to write the image data to</param>
+void BMP::write_image_out(std::string fname)
+{
+    std::ofstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the output image file.");
+    }
+
+    AlignedBuffer file_data;
+    save(file_data);
+    file.write((const char*)file_data.data(), file_data.size());
+
+    file.close();
+}
+
+/// <summary>
+/// Builds the content of the BMP file from the headers and the image data
+/// </summary>
+/// <param name="file_data">: Receives the content of the BMP file</param>
+void BMP::save(AlignedBuffer& file_data)
+{
+    size_t row_size = (size_t)info_header.width * (info_header.bit_count / 8);
+    size_t stride = row_size + padding;
+    size_t height = info_header.height;
+    size_t size = sizeof(file_header) + sizeof(info_header) + stride * height;
+
+    // Room for a direct write, which has to write whole blocks
+    size_t capacity = (size + IO_BLOCK_SIZE - 1) / IO_BLOCK_SIZE * IO_BLOCK_SIZE;
+    if (buffer_pool && file_data.capacity() < capacity)
+    {
+        recycle(file_data);
+        file_data = buffer_pool->take(capacity);
+    }
+
+    // Every byte is written below, so the buffer is not zeroed first
+    file_data.clear();
+    file_data.reserve(capacity);
+    file_data.resize(size);
+
+    memcpy(file_data.data(), &file_header, sizeof(file_header));
+    memcpy(file_data.data() + sizeof(file_header), &info_header, sizeof(info_header));
+
+    for (size_t i = 0; i < height; i++)
+    {
+        uint8_t* row = file_data.data() + sizeof(file_header) + sizeof(info_header) + stride * i;
+        memcpy(row, img_data.data() + row_size * i, row_size);
+        memset(row + row_size, 0, padding);
+    }
+}
+
+/// <summary>
+/// Writes the headers and the image data back into the BMP file it was read from, which is owned by the caller.
+/// Rows whose pixel data is used in place are not copied.
+/// </summary>
+/// <param name="file_data">: The content of the BMP file, at least as large as the headers and the rows</param>
+void BMP::save(ByteSpan file_data)
+{
+    size_t row_size = (size_t)info_header.width * (info_header.bit_count / 8);
+    size_t stride = row_size + padding;
+    size_t height = info_header.height;
+    size_t offset = sizeof(file_header) + sizeof(info_header);
+
+    if (file_data.size() < offset + stride * height)
+    {
+        error("The BMP file is too small for its image data.");
+    }
+
+    memcpy(file_data.data(), &file_header, sizeof(file_header));
+    memcpy(file_data.data() + sizeof(file_header), &info_header, sizeof(info_header));
+
+    if (img_data.data() == file_data.data() + offset)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < height; i++)
+    {
+        memcpy(file_data.data() + offset + stride * i, img_data.data() + row_size * i, row_size);
+    }
+}
+
+/// <summary>
+/// Hands over the content of the BMP file like save, but without copying the pixel data if it is still in the buffer
+/// of the file. The image is empty afterwards.
+/// </summary>
+/// <param name="file_data">: Receives the content of the BMP file</param>
+void BMP::release_file_data(AlignedBuffer& file_data)
+{
+    size_t offset = sizeof(file_header) + sizeof(info_header);
+
+    if (!buffer.empty() && img_data.data() == buffer.data() + offset)
+    {
+        memcpy(buffer.data(), &file_header, sizeof(file_header));
+        memcpy(buffer.data() + sizeof(file_header), &info_header, sizeof(info_header));
+        buffer.resize(offset + img_data.size());
+        recycle(file_data);
+        file_data = std::move(buffer);
+    }
+    else
+    {
+        save(file_data);
+    }
+
+    recycle(buffer);
+    img_data = {};
+}
+
+/**********************************************************************
+*
+* Functions for generating/reading keys and encrypting/decrypting
+* vector<uint8_t> using encryption with XOR
+*
+**********************************************************************/
+
+/// <summary>
+/// Generates a random 64-bit key and writes it to the keystore (or to the key file if there is no keystore)
+/// </summary>
+void BMP::generate_key()
+{
+    if (!caller_key.empty())
+    {
+        read_key();
+        return;
+    }
+
+    uint8_t bytes[8];
+    RNG::bytes(bytes, sizeof(bytes));
+
+    for (int i = 0; i < 8; i++)
+    {
+        key = (key << 8) | bytes[i];
+    }
+
+    if (keystore)
+    {
+        set_key_id(keystore->add(2, bytes, sizeof(bytes)));
+        return;
+    }
+
+    std::ofstream file("key", std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the output text file.");
+    }
+
+    file.write((const char*)bytes, sizeof(bytes));
+    file.close();
+}
+
+/// <summary>
+/// Reads the 64-bit key with the key ID of the image from the keystore (or from the key file if the image has no key ID) 
+/// and stores it in the key variable
+/// </summary>
+void BMP::read_key()
+{
+    if (!caller_key.empty())
+    {
+        if (caller_key.size() != 8)
+        {
+            error("The XOR key must be 8 bytes long.");
+        }
+
+        for (int i = 0; i < 8; i++)
+        {
+            key = (key << 8) | caller_key[i];
+        }
+        return;
+    }
+
+    uint32_t key_id = get_key_id();
+    if (key_id != 0)
+    {
+        KeystoreRecord record;
+        if (!keystore || !keystore->find(key_id, record))
+        {
+            error("The key of the image is not in the keystore.");
+        }
+
+        if (record.type != 2 || record.length != 8)
+        {
+            error("The key of the image is not a XOR key.");
+        }
+
+        for (int i = 0; i < 8; i++)
+        {
+            key = (key << 8) | record.key[i];
+        }
+
+        secure_zero(record.key, sizeof(record.key));
+        return;
+    }
+
+    std::ifstream file("key", std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the key file.");
+    }
+
+    for (int i = 0; i < 64; i += 8)
+    {
+        uint8_t byte;
+        file.read((char*)&byte, sizeof(byte));
+        key = (key << 8) | byte;
+    }
+
+    file.close();
+}
+
+/// <summary>
+/// XORs the data with the repeating 8-byte pattern of the key. Byte i of the data is linked with byte (i % 8) of the key, 
+/// starting at the lowest byte. The data is processed byte by byte until it is aligned, then in 512/256-bit vectors 
+/// (if the compiler targets AVX-512/AVX2) and 64-bit words, and the remaining bytes at the end again byte by byte.
+/// </summary>
+/// <param name="data">: The data to encrypt/decrypt</param>
+/// <param name="size">: The number of bytes in data</param>
+/// <param name="key">: The 64-bit key</param>
+static void xor_key_stream(uint8_t* data, size_t size, uint64_t key)
+{
+    uint8_t pattern[8];
+    for (int i = 0; i < 8; i++)
+    {
+        pattern[i] = (key >> (i * 8)) & 0xFF;
+    }
+
+    // Head: link single bytes until the data is aligned to 64 bytes
+    size_t i = 0;
+    while (i < size && ((uintptr_t)(data + i) & 63) != 0)
+    {
+        data[i] ^= pattern[i & 7];
+        i++;
+    }
+
+    // The key pattern rotated so that it starts at byte i, repeated for a whole 512-bit vector
+    alignas(64) uint8_t rotated[64];
+    for (int j = 0; j < 64; j++)
+    {
+        rotated[j] = pattern[(i + j) & 7];
+    }
+
+#if defined(__AVX512F__)
+    __m512i key_512 = _mm512_load_si512((const void*)rotated);
+    for (; i + 64 <= size; i += 64)
+    {
+        __m512i block = _mm512_load_si512((const void*)(data + i));
+        _mm512_store_si512((void*)(data + i), _mm512_xor_si512(block, key_512));
+    }
+#endif
+
+#if defined(__AVX2__)
+    __m256i key_256 = _mm256_load_si256((const __m256i*)rotated);
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i block = _mm256_load_si256((const __m256i*)(data + i));
+        _mm256_store_si256((__m256i*)(data + i), _mm256_xor_si256(block, key_256));
+    }
+#endif
+
+    // 64-bit words. memcpy keeps this free of alignment and aliasing issues and is compiled to plain loads/stores.
+    uint64_t key_word;
+    memcpy(&key_word, rotated, sizeof(key_word));
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word ^= key_word;
+        memcpy(data + i, &word, sizeof(word));
+    }
+
+    // Tail: the remaining bytes
+    for (; i < size; i++)
+    {
+        data[i] ^= pattern[i & 7];
+    }
+}
+
+/// <summary>
+/// Encrypts/decrypts the text using the key variable using XOR
+/// </summary>
+void BMP::encrypt_decrypt_data()
+{
+    xor_key_stream(text.data(), text.size(), key);
+
+    // The key ends up rotated by one byte for every byte of the text, like when it is applied byte by byte
+    uint32_t shift = (text.size() % 8) * 8;
+    if (shift != 0)
+    {
+        key = (key >> shift) | (key << (64 - shift));
+    }
+}
+
+/**********************************************************************
+*
+* Functions for generating/reading keys and encrypting/decrypting
+* vector<uint8_t> using encryption with AES algorithm
+*
+**********************************************************************/
+
+// Largest number of bytes passed to OpenSSL at once, a multiple of the AES block size that fits into an int
+#define CIPHER_CHUNK_SIZE ((size_t)1 << 30)
+
+/// <summary>
+/// Generates a random 256-bit AES key and writes it to the keystore (or to the aes_key file if there is no keystore)
+/// </summary>
+void BMP::generate_aes_key()
+{
+    if (!caller_key.empty())
+    {
+        aes_key = caller_key;
+        return;
+    }
+
+    aes_key.resize(AES_KEY_SIZE);
+    RNG::bytes(aes_key.data(), AES_KEY_SIZE);
+
+    if (keystore)
+    {
+        set_key_id(keystore->add(1, aes_key.data(), aes_key.size()));
+        return;
+    }
+
+    // Write the generated key to a file
+    std::ofstream file("aes_key", std::ios_base::binary);
+    if (!file)
+    {
+        error("Failed to open file for writing AES key");
+    }
+    file.write((const char*)aes_key.data(), aes_key.size());
+    file.close();
+}
+
+/// <summary>
+/// Reads the 256-bit AES key with the key ID of the image from the keystore (or from the aes_key file if the image has no 
+/// key ID) and stores it in the aes_key variable
+/// </summary>
+void BMP::read_aes_key()
+{
+    if (!caller_key.empty())
+    {
+        aes_key = caller_key;
+        return;
+    }
+
+    uint32_t key_id = get_key_id();
+    if (key_id != 0)
+    {
+        KeystoreRecord record;
+        if (!keystore || !keystore->find(key_id, record))
+        {
+            error("The key of the image is not in the keystore.");
+        }
+
+        if (record.type != 1)
+        {
+            error("The key of the image is not an AES key.");
+        }
+
+        aes_key.assign(record.key, record.key + record.length);
+        secure_zero(record.key, sizeof(record.key));
+        return;
+    }
+
+    std::ifstream file("aes_key", std::ios_base::binary);
+    if (!file)
+    {
+        error("Failed to open file for reading AES key");
+    }
+
+    aes_key.resize(AES_KEY_SIZE);
+    file.read((char*)aes_key.data(), aes_key.size());
+    file.close();
+}
+
+/// <summary>
+/// Encrypts the text using the AES key stored in the aes_key variable using AES-256 encryption
+/// </summary>
+void BMP::aes_encrypt()
+{
+    // Check if the key length is appropriate
+    if (aes_key.size() != 16 && aes_key.size() != 24 && aes_key.size() != 32)
+    {
+        error("Key length must be 16, 24, or 32 bytes.");
+    }
+
+    // The cipher context of the thread is reused for every text
+    const EVP_CIPHER* cipher = crypto().aes_256_ecb;
+    EVP_CIPHER_CTX* ctx = cipher_context();
+
+    // Initialize AES-256 encryption
+    if (EVP_EncryptInit_ex(ctx, cipher, NULL, aes_key.data(), NULL) != 1)
     {
-        error("Unable to open the input file.");
+        error("Error initializing AES encryption.");
     }
 
-    file.seekg(0, file.end);
-    int length = file.tellg();
-    file.seekg(0, file.beg);
+    // Prepare output buffer. The scratch buffer keeps its memory, so the next text does not allocate it again.
+    std::vector<uint8_t>& ciphertext = scratch;
+    ciphertext.resize(text.size() + EVP_MAX_BLOCK_LENGTH);
 
-    text.resize(length);
-    file.read((char*)text.data(), text.size());
+    // Encrypt plaintext. OpenSSL takes the size as int, so texts over 2 GB are passed in chunks.
+    int len;
+    size_t ciphertext_len = 0;
+    for (size_t offset = 0; offset < text.size(); offset += CIPHER_CHUNK_SIZE)
+    {
+        size_t count = std::min(CIPHER_CHUNK_SIZE, text.size() - offset);
+        if (EVP_EncryptUpdate(ctx, ciphertext.data() + ciphertext_len, &len, text.data() + offset, (int)count) != 1)
+        {
+            error("Error performing AES encryption.");
+        }
 
-    file.close();
-}
+        ciphertext_len += len;
+    }
 
-/// <summary>
-/// Write the text to a file
-/// </summary>
-/// <param name="fname">The name of the file to write the text to</param>
-void BMP::write_text_out(std::string fname)
-{
-    std::ofstream file(fname, std::ios_base::binary);
-    if (!file)
+    // Finalize encryption
+    if (EVP_EncryptFinal_ex(ctx, ciphertext.data() + ciphertext_len, &len) != 1)
     {
-        error("Unable to open the output file.");
+        error("Error finalizing AES encryption.");
     }
 
-    file.write((const char*)text.data(), text.size());
+    ciphertext_len += len;
 
-    file.close();
+    // Resize the output buffer to actual ciphertext size
+    ciphertext.resize(ciphertext_len);
+
+    text.swap(ciphertext);
 }
 
 /// <summary>
-/// Write the text to the image data bitwise
+/// Decrypts the text using the AES key stored in the aes_key variable using AES-256 decryption
 /// </summary>
-void BMP::write_text_to_img_data()
+void BMP::aes_decrypt()
 {
-    uint32_t text_size = text.size();
-    uint32_t data_size = img_data.size();
-    uint32_t max_text_size = (data_size - 64) / 8;
-
-    // We write the size of the text in the first 32 bytes of the image data
-    for (uint32_t i = 0; i < 32; i++)
+    // Check if the key length is appropriate
+    if (aes_key.size() != 16 && aes_key.size() != 24 && aes_key.size() != 32)
     {
-        uint8_t bit = (text_size >> i) & 1;
-
-        img_data[i] &= ~1;
-        img_data[i] |= bit;
+        error("Key length must be 16, 24, or 32 bytes.");
     }
 
-    if (text_size > max_text_size)
+    // The cipher context of the thread is reused for every text
+    const EVP_CIPHER* cipher = crypto().aes_256_ecb;
+    EVP_CIPHER_CTX* ctx = cipher_context();
+
+    // Initialize AES-256 decryption
+    if (EVP_DecryptInit_ex(ctx, cipher, NULL, aes_key.data(), NULL) != 1)
     {
-        error("The text is to large for the image");
+        error("Error initializing AES decryption.");
     }
 
-    // Every bit of the text is written in the image data
-    for (uint32_t i = 0; i < text_size; i++)
+    // Prepare output buffer
+    std::vector<uint8_t>& plaintext = scratch;
+    plaintext.resize(text.size() + EVP_MAX_BLOCK_LENGTH);
+
+    // Decrypt ciphertext, in chunks like when encrypting
+    int len;
+    size_t plaintext_len = 0;
+    for (size_t offset = 0; offset < text.size(); offset += CIPHER_CHUNK_SIZE)
     {
-        uint8_t byte = text[i];
-        for (uint32_t j = 0; j < 8; j++)
+        size_t count = std::min(CIPHER_CHUNK_SIZE, text.size() - offset);
+        if (EVP_DecryptUpdate(ctx, plaintext.data() + plaintext_len, &len, text.data() + offset, (int)count) != 1)
         {
-            uint8_t bit = byte & 1;
-            byte = byte >> 1;
-
-            img_data[i * 8 + j + 32] &= ~1;
-            img_data[i * 8 + j + 32] |= bit;
+            error("Error performing AES decryption.");
         }
+
+        // Get the length of the plaintext produced by the update operation
+        plaintext_len += len;
     }
 
-    // Fill the rest of the image data with random data
-    // Always change the lowest bit to ensure that the image data is different from the original image
-    for (uint32_t i = text_size * 8 + 32; i < data_size - 32; i++)
+    // Finalize decryption
+    if (EVP_DecryptFinal_ex(ctx, plaintext.data() + plaintext_len, &len) != 1)
     {
-        img_data[i] |= (rand() & 1);
+        error("Error finalizing AES decryption.");
     }
 
-    // Calculate the CRC32 checksum of the image data until data_size - 32
-    uint32_t crc = calculate_crc32(std::vector<uint8_t>(img_data.begin(), img_data.begin() + data_size - 32));
+    // Update the total plaintext length
+    plaintext_len += len;
 
-    // Write the CRC32 checksum to the last 32 bits of the image data
-    for (uint32_t i = data_size - 32; i < data_size; i++)
-    {
-        uint8_t bit = (crc >> (i - data_size + 32)) & 1;
+    // Resize the output buffer to actual plaintext size
+    plaintext.resize(plaintext_len);
 
-        img_data[i] &= ~1;
-        img_data[i] |= bit;
-    }
+    text.swap(plaintext);
 }
 
 /// <summary>
-/// Read the text from the image data bitwise
+/// Encrypts/decrypts the text with the AES key stored in the aes_key variable using AES-256 in counter mode. The
+/// first counter block is the nonce of the embedded header. Large texts are processed in ranges in parallel, since
+/// every range can compute its own counter.
 /// </summary>
-void BMP::read_text_from_img_data()
+void BMP::ctr_crypt()
 {
-    uint32_t text_size = 0;
-    uint32_t data_size = img_data.size();
+    size_t text_size = text.size();
+    size_t bytes_per_range = PARALLEL_RANGE_SIZE;
+    size_t range_count = (text_size >= PARALLEL_MIN_SIZE) ? (text_size + bytes_per_range - 1) / bytes_per_range : 1;
 
-    // Read the first 32 bits from the image data to determin how long the stored data in the image is.
-    for (uint32_t i = 0; i < 32; i++)
+    for_each_range(range_count, [&](size_t r) {
+        size_t begin = r * bytes_per_range;
+        size_t end = range_count == 1 ? text_size : std::min(text_size, (r + 1) * bytes_per_range);
+
+        ctr_crypt_range(begin, text.data() + begin, end - begin);
+    });
+}
+
+/// <summary>
+/// Encrypts/decrypts a part of the text in place using AES-256 in counter mode
+/// </summary>
+/// <param name="offset">: The position of the part in the text, which selects the counter</param>
+/// <param name="data">: The part of the text</param>
+/// <param name="size">: The number of bytes in data</param>
+void BMP::ctr_crypt_range(uint64_t offset, uint8_t* data, size_t size)
+{
+    if (aes_key.size() != AES_KEY_SIZE)
     {
-        text_size |= ((img_data[i] & 1) << i);
+        error("The AES key must be 32 bytes long.");
     }
 
-    uint32_t crc_read = calculate_crc32(std::vector<uint8_t>(img_data.begin(), img_data.begin() + data_size - 32));
-    uint32_t crc_expected = 0;
-
-    // Read the last 32 bits from the image data to get the CRC32 checksum
-    for (uint32_t i = data_size - 32; i < data_size; i++)
+    // The counter of the block the part starts in is the nonce plus the number of the block, as 128-bit big-endian
+    // number like OpenSSL increments it
+    uint8_t counter[16];
+    uint64_t block = offset / 16;
+    uint32_t carry = 0;
+    for (int i = 15; i >= 0; i--)
     {
-        crc_expected |= ((img_data[i] & 1) << (i - data_size + 32));
+        uint32_t sum = embed_header.nonce[i] + (uint32_t)(block & 0xFF) + carry;
+        counter[i] = sum & 0xFF;
+        carry = sum >> 8;
+        block >>= 8;
     }
 
-    if (crc_read != crc_expected)
+    EVP_CIPHER_CTX* ctx = cipher_context();
+    if (EVP_EncryptInit_ex(ctx, crypto().aes_256_ctr, NULL, aes_key.data(), counter) != 1)
     {
-        error("The data in the image is corrupted or was manipulated");
+        error("Error initializing AES-CTR.");
     }
 
-    text.resize(text_size);
+    // The key stream of the block in front of the part is skipped
+    uint8_t skipped[16] = { 0 };
+    int len;
+    if (offset % 16 != 0 && EVP_EncryptUpdate(ctx, skipped, &len, skipped, (int)(offset % 16)) != 1)
+    {
+        error("Error performing AES-CTR.");
+    }
 
-    for (uint32_t i = 0; i < text_size; i++)
+    for (size_t position = 0; position < size; position += CIPHER_CHUNK_SIZE)
     {
-        uint8_t byte = 0;
-        for (uint32_t j = 0; j < 8; j++)
+        size_t count = std::min(CIPHER_CHUNK_SIZE, size - position);
+        if (EVP_EncryptUpdate(ctx, data + position, &len, data + position, (int)count) != 1)
         {
-            byte |= ((img_data[i * 8 + j + 32] & 1) << j);
+            error("Error performing AES-CTR.");
         }
-        text[i] = byte;
     }
 }
 
 /// <summary>
-/// Write the image data to a file
+/// Encrypts the text with an AES key derived from the password and puts the password header in front of the ciphertext
 /// </summary>
-/// <param name="fname">The name of the file to write the image data to</param>
-void BMP::write_image_out(std::string fname)
+void BMP::password_encrypt()
 {
-    std::ofstream file(fname, std::ios_base::binary);
-    if (!file)
+    if (!password_key)
     {
-        error("Unable to open the output image file.");
+        error("No password was given.");
     }
 
-    file.write((const char*)&file_header, sizeof(file_header));
-    file.write((const char*)&info_header, sizeof(info_header));
-
-    for (int i = 0; i < info_header.height; i++)
-    {
-        file.write((const char*)(img_data.data() + (info_header.width * 3 + padding) * i), info_header.width * 3);
-        file.seekp(padding, std::ios_base::cur);
-    }
+    PasswordHeader header;
+    password_key->new_file_key(header, aes_key);
+    aes_encrypt();
 
-    file.close();
+    text.insert(text.begin(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
 }
 
-/**********************************************************************
-*
-* Functions for generating/reading keys and encrypting/decrypting
-* vector<uint8_t> using encryption with XOR
-*
-**********************************************************************/
-
 /// <summary>
-/// Generates a random 64-bit key and writes it to a file
+/// Removes the password header from the text and decrypts the text with the AES key derived from the password
 /// </summary>
-void BMP::generate_key()
+void BMP::password_decrypt()
 {
-    srand(time(0));
-    std::ofstream file("key", std::ios_base::binary);
-    if (!file)
+    if (!password_key)
     {
-        error("Unable to open the output text file.");
+        error("No password was given.");
     }
 
-    uint8_t mask = 0xFF;
-    for (int i = 0; i < 64; i += 8)
+    if (text.size() < sizeof(PasswordHeader))
     {
-        uint16_t current = rand();
-        uint8_t byte = (current >> 8) & mask;
-        key = (key << 8) | byte;
-        file.write((const char*)&byte, sizeof(byte));
+        error("The image does not contain a password header.");
     }
 
-    file.close();
+    PasswordHeader header;
+    memcpy(&header, text.data(), sizeof(header));
+    text.erase(text.begin(), text.begin() + sizeof(header));
+
+    password_key->file_key(header, aes_key);
+    aes_decrypt();
 }
 
 /// <summary>
-/// Reads a 64-bit key from a file and stores it in the key variable
+/// Encrypts the text once with a random AES data key and puts the recipient table with the wrapped data key in front of the ciphertext
 /// </summary>
-void BMP::read_key()
+void BMP::envelope_encrypt()
 {
-    std::ifstream file("key", std::ios_base::binary);
-    if (!file)
+    if (!envelope)
     {
-        error("Unable to open the key file.");
+        error("No recipients were given.");
     }
 
-    uint8_t mask = 0xFF;
-    for (int i = 0; i < 64; i += 8)
-    {
-        uint8_t byte;
-        file.read((char*)&byte, sizeof(byte));
-        key = (key << 8) | byte;
-    }
+    aes_key.resize(AES_KEY_SIZE);
+    RNG::bytes(aes_key.data(), AES_KEY_SIZE);
+    aes_encrypt();
 
-    file.close();
+    std::vector<uint8_t>& table = scratch;
+    envelope->wrap(aes_key, table);
+
+    text.insert(text.begin(), table.begin(), table.end());
 }
 
 /// <summary>
-/// Encrypts/decrypts the text using the key variable using XOR
+/// Unwraps the data key from the recipient table, removes the table from the text and decrypts the text
 /// </summary>
-void BMP::encrypt_decrypt_data()
+void BMP::envelope_decrypt()
 {
-    for (int i = 0; i < text.size(); i++)
+    if (!envelope)
     {
-        text[i] = text[i] ^ (key & 0xFF);
-        key = (key >> 8) | (key << 56);
+        error("No private key was given.");
     }
+
+    size_t table_size = envelope->unwrap(text.data(), text.size(), aes_key);
+    text.erase(text.begin(), text.begin() + table_size);
+
+    aes_decrypt();
 }
 
 /**********************************************************************
 *
-* Functions for generating/reading keys and encrypting/decrypting
-* vector<uint8_t> using encryption with AES algorithm
+* Random access to the embedded text of a BMP file. open_text reads
+* only the headers, the first row and the key, read_text_range then
+* reads the rows that hold the requested bytes and decrypts only them.
+* AES (ECB) decrypts every block on its own, XOR every byte and AES-CTR
+* starts its key stream at the counter of the first byte, so a range
+* starts at the block or byte it needs. The checksum of the whole image
+* is not checked; callers check the bytes they read.
 *
 **********************************************************************/
 
 /// <summary>
-/// Generates a random 256-bit AES key and writes it to a file
+/// Opens the BMP file and prepares reading parts of its text with read_text_range, without loading the pixel data
 /// </summary>
-void BMP::generate_aes_key()
+/// <param name="fname">: The name of the BMP file</param>
+/// <param name="encryption_type">: The type of encryption to use, 0 for the type in the embedded header (or AES for
+/// images without one)</param>
+void BMP::open_text(std::string fname, int encryption_type)
 {
-    aes_key.resize(AES_KEY_SIZE);
-    if (RAND_bytes(aes_key.data(), AES_KEY_SIZE) != 1)
+    reset();
+
+    text_file.open(fname, std::ios_base::binary);
+    if (!read_file_headers(text_file, file_header, info_header))
     {
-        error("Failed to generate random key using OpenSSL RAND_bytes");
+        error("Unable to read " + fname + " as 24 or 32 bits per pixel BMP file.");
     }
 
-    // Write the generated key to a file
-    std::ofstream file("aes_key", std::ios_base::binary);
-    if (!file)
+    size_t row_size = (size_t)info_header.width * (info_header.bit_count / 8);
+    uint64_t data_size = (uint64_t)row_size * info_header.height;
+    padding = (uint8_t)(-row_size & 3);
+
+    uint8_t data[sizeof(EmbedHeader) * 8];
+    size_t available = (size_t)std::min<uint64_t>(sizeof(data), data_size);
+    read_image_data(0, data, available);
+
+    size_t start;
+    if (!read_embed_header(data, available, data_size, embed_header, start))
     {
-        error("Failed to open file for writing AES key");
+        error(fname + " holds no encrypted text");
     }
-    file.write((const char*)aes_key.data(), aes_key.size());
-    file.close();
-}
 
-/// <summary>
-/// Reads a 256-bit AES key from a file and stores it in the aes_key variable
-/// </summary>
-void BMP::read_aes_key()
-{
-    std::ifstream file("aes_key", std::ios_base::binary);
-    if (!file)
+    text_start = start;
+    cipher = embed_header.cipher;
+    if (embed_header.key_id != 0)
     {
-        error("Failed to open file for reading AES key");
+        set_key_id(embed_header.key_id);
     }
 
-    aes_key.resize(AES_KEY_SIZE);
-    file.read((char*)aes_key.data(), aes_key.size());
-    file.close();
-}
-
-/// <summary>
-/// Encrypts the text using the AES key stored in the aes_key variable using AES-256 encryption
-/// </summary>
-void BMP::aes_encrypt()
-{
-    // Check if the key length is appropriate
-    if (aes_key.size() != 16 && aes_key.size() != 24 && aes_key.size() != 32)
+    if (encryption_type == 0)
     {
-        error("Key length must be 16, 24, or 32 bytes.");
+        encryption_type = cipher != 0 ? cipher : 1;
     }
-
-    // Initialize OpenSSL cipher context
-    EVP_CIPHER_CTX* ctx;
-    if (!(ctx = EVP_CIPHER_CTX_new()))
+    else if (cipher != 0 && cipher != encryption_type)
     {
-        error("Error creating EVP cipher context.");
+        error("The text was encrypted with encryption type " + std::to_string(cipher) + ", not " + std::to_string(encryption_type) + ".");
     }
 
-    // Initialize AES-256 encryption
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_ecb(), NULL, aes_key.data(), NULL) != 1)
+    cipher = (uint8_t)encryption_type;
+    uint64_t text_size = embed_header.text_size;
+
+    switch (encryption_type)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        error("Error initializing AES encryption.");
-    }
+    case 1:
+        read_aes_key();
+        break;
+    case 2:
+        read_key();
+        break;
+    case 3:
+        break;
+    case 4:
+    {
+        if (!password_key)
+        {
+            error("No password was given.");
+        }
 
-    // Prepare output buffer
-    std::vector<uint8_t> ciphertext(text.size() + EVP_MAX_BLOCK_LENGTH);
+        if (text_size < sizeof(PasswordHeader))
+        {
+            error("The image does not contain a password header.");
+        }
 
-    // Encrypt plaintext
-    int len;
-    if (EVP_EncryptUpdate(ctx, ciphertext.data(), &len, text.data(), text.size()) != 1)
+        PasswordHeader header;
+        read_cipher_text(0, (uint8_t*)&header, sizeof(header));
+        password_key->file_key(header, aes_key);
+        cipher_start = sizeof(header);
+        break;
+    }
+    case 5:
     {
-        EVP_CIPHER_CTX_free(ctx);
-        error("Error performing AES encryption.");
+        if (!envelope)
+        {
+            error("No private key was given.");
+        }
+
+        // The recipient table is read with the size from its header, limited to the text
+        EnvelopeHeader header;
+        read_cipher_text(0, (uint8_t*)&header, (size_t)std::min<uint64_t>(sizeof(header), text_size));
+
+        size_t table_size = (size_t)std::min<uint64_t>(sizeof(header) + header.recipient_count * sizeof(EnvelopeRecipient), text_size);
+        std::vector<uint8_t>& table = scratch;
+        table.resize(table_size);
+        read_cipher_text(0, table.data(), table.size());
+
+        cipher_start = envelope->unwrap(table.data(), table.size(), aes_key);
+        break;
+    }
+    case 6:
+        read_aes_key();
+        break;
+    default:
+        error("Invalid encryption type");
     }
 
-    // Finalize encryption
-    int ciphertext_len = len;
-    if (EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len) != 1)
+    plain_size = text_size - cipher_start;
+
+    // The size of an AES text is known after the padding in its last block was decrypted
+    if (encryption_type == 1 || encryption_type == 4 || encryption_type == 5)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        error("Error finalizing AES encryption.");
-    }
+        if (plain_size == 0 || plain_size % 16 != 0)
+        {
+            error("The length of the ciphertext is not a multiple of the AES block size.");
+        }
 
-    ciphertext_len += len;
+        read_text_range(plain_size - 16, 16);
 
-    // Resize the output buffer to actual ciphertext size
-    ciphertext.resize(ciphertext_len);
+        // Every padding byte holds the length of the padding, as EVP checks it when the whole text is decrypted
+        uint8_t pad = text[15];
+        bool valid = pad != 0 && pad <= 16;
+        for (size_t i = 16 - (valid ? pad : 0); i < 16; i++)
+        {
+            valid = valid && text[i] == pad;
+        }
+
+        if (!valid)
+        {
+            error("Error finalizing AES decryption.");
+        }
 
-    // Clean up
-    EVP_CIPHER_CTX_free(ctx);
+        plain_size -= pad;
+        text.clear();
+    }
+}
 
-    text = ciphertext;
+/// <summary>
+/// Returns the size of the decrypted text of the image opened by open_text
+/// </summary>
+uint64_t BMP::plain_text_size()
+{
+    return plain_size;
 }
 
 /// <summary>
-/// Decrypts the text using the AES key stored in the aes_key variable using AES-256 decryption
+/// Reads a part of the decrypted text of the image opened by open_text into the text variable. Only the image data
+/// that holds this part is read from the file and only the AES blocks that cover it are decrypted.
 /// </summary>
-void BMP::aes_decrypt()
+/// <param name="offset">: The first byte of the decrypted text to read</param>
+/// <param name="size">: The number of bytes to read</param>
+void BMP::read_text_range(uint64_t offset, uint64_t size)
 {
-    // Check if the key length is appropriate
-    if (aes_key.size() != 16 && aes_key.size() != 24 && aes_key.size() != 32)
+    if (offset > plain_size || size > plain_size - offset)
     {
-        error("Key length must be 16, 24, or 32 bytes.");
+        error("The range is outside of the text in the image.");
+    }
+
+    if (cipher != 1 && cipher != 4 && cipher != 5)
+    {
+        text.resize((size_t)size);
+        read_cipher_text(cipher_start + offset, text.data(), text.size());
+
+        // The key pattern is rotated to the byte the range starts at, like encrypt_decrypt_data does after a text
+        if (cipher == 2)
+        {
+            uint32_t shift = (offset % 8) * 8;
+            xor_key_stream(text.data(), text.size(), shift != 0 ? (key >> shift) | (key << (64 - shift)) : key);
+        }
+        else if (cipher == 6)
+        {
+            ctr_crypt_range(offset, text.data(), text.size());
+        }
+
+        return;
     }
 
-    // Initialize OpenSSL cipher context
-    EVP_CIPHER_CTX* ctx;
-    if (!(ctx = EVP_CIPHER_CTX_new()))
+    // Whole blocks around the range, without padding, since only the last block of the text has it
+    uint64_t first_block = offset / 16;
+    uint64_t end_block = (offset + size + 15) / 16;
+
+    std::vector<uint8_t>& ciphertext = scratch;
+    ciphertext.resize((size_t)((end_block - first_block) * 16));
+    read_cipher_text(cipher_start + first_block * 16, ciphertext.data(), ciphertext.size());
+
+    if (aes_key.size() != 16 && aes_key.size() != 24 && aes_key.size() != 32)
     {
-        error("Error creating EVP cipher context.");
+        error("Key length must be 16, 24, or 32 bytes.");
     }
 
-    // Initialize AES-256 decryption
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_ecb(), NULL, aes_key.data(), NULL) != 1)
+    EVP_CIPHER_CTX* ctx = cipher_context();
+    if (EVP_DecryptInit_ex(ctx, crypto().aes_256_ecb, NULL, aes_key.data(), NULL) != 1 || EVP_CIPHER_CTX_set_padding(ctx, 0) != 1)
     {
-        EVP_CIPHER_CTX_free(ctx);
         error("Error initializing AES decryption.");
     }
 
-    // Prepare output buffer
-    std::vector<uint8_t> plaintext(text.size() + EVP_MAX_BLOCK_LENGTH);
+    text.resize(ciphertext.size());
 
-    // Decrypt ciphertext
     int len;
-    if (EVP_DecryptUpdate(ctx, plaintext.data(), &len, text.data(), text.size()) != 1)
+    for (size_t position = 0; position < ciphertext.size(); position += CIPHER_CHUNK_SIZE)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        error("Error performing AES decryption.");
+        size_t count = std::min(CIPHER_CHUNK_SIZE, ciphertext.size() - position);
+        if (EVP_DecryptUpdate(ctx, text.data() + position, &len, ciphertext.data() + position, (int)count) != 1)
+        {
+            error("Error performing AES decryption.");
+        }
     }
 
-    // Get the length of the plaintext produced by the update operation
-    int plaintext_len = len;
+    // Cut the range out of the blocks
+    size_t skip = (size_t)(offset - first_block * 16);
+    text.erase(text.begin(), text.begin() + skip);
+    text.resize((size_t)size);
+}
 
-    // Finalize decryption
-    if (EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len) != 1)
+/// <summary>
+/// Reads bytes of the text (before decryption) from the lowest bits of the image data of the file opened by open_text
+/// </summary>
+/// <param name="offset">: The first byte of the text</param>
+/// <param name="bytes">: Receives the bytes</param>
+/// <param name="count">: The number of bytes to read</param>
+void BMP::read_cipher_text(uint64_t offset, uint8_t* bytes, size_t count)
+{
+    // Every byte of the text is spread over eight bytes of image data
+    size_t chunk = PARALLEL_RANGE_SIZE / 8;
+    std::vector<uint8_t> data(std::min(count, chunk) * 8);
+
+    for (size_t done = 0; done < count; done += chunk)
     {
-        EVP_CIPHER_CTX_free(ctx);
-        error("Error finalizing AES decryption.");
+        size_t n = std::min(chunk, count - done);
+        read_image_data(text_start + (offset + done) * 8, data.data(), n * 8);
+        read_bits(data.data(), bytes + done, n);
     }
+}
 
-    // Update the total plaintext length
-    plaintext_len += len;
+/// <summary>
+/// Reads image data (the rows without padding) from the file opened by open_text
+/// </summary>
+/// <param name="position">: The first byte of the image data</param>
+/// <param name="data">: Receives the image data</param>
+/// <param name="count">: The number of bytes to read</param>
+void BMP::read_image_data(uint64_t position, uint8_t* data, size_t count)
+{
+    uint64_t row_size = (uint64_t)info_header.width * (info_header.bit_count / 8);
 
-    // Resize the output buffer to actual plaintext size
-    plaintext.resize(plaintext_len);
+    // Without padding the image data is one piece of the file, otherwise it is read row by row
+    while (count > 0)
+    {
+        uint64_t row = position / row_size;
+        uint64_t column = position % row_size;
+        size_t n = padding == 0 ? count : (size_t)std::min<uint64_t>(count, row_size - column);
 
-    // Clean up
-    EVP_CIPHER_CTX_free(ctx);
+        text_file.seekg(file_header.offset_data + row * (row_size + padding) + column);
+        if (!text_file.read((char*)data, n))
+        {
+            error("Unable to read the image data of the input image file.");
+        }
 
-    text = plaintext;
-}
\ No newline at end of file
+        position += n;
+        data += n;
+        count -= n;
+    }
+}
@@ -0,0 +1,522 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Startup benchmark. For every encryption type the program is started
+* again as a probe that encrypts a small payload into a small image, so
+* each measurement includes loading and initializing libcrypto (if the
+* type needs it). Type 0 only starts the process and exits.
+*
+* Daemon benchmark. Several connections send encrypt requests with a
+* small payload to a daemon as fast as it answers them, and the time
+* of every request is measured. The image is either sent through the
+* socket or passed as a memfd.
+*
+* Huge page benchmark. A large synthetic image is embedded, checksummed
+* and verified once with 4 KiB pages and once with 2 MiB pages, and the
+* throughput and the data TLB misses of both are compared.
+*
+**********************************************************************/
+
+#define BENCH_DIR "image-encrypt-bench"
+#define BENCH_RUNS 20
+
+/// <summary>
+/// Builds a 24-bit BMP file with random pixels in memory
+/// </summary>
+/// <param name="width">: The width in pixels (multiple of 4, so the rows have no padding)</param>
+/// <param name="height">: The height in pixels</param>
+/// <param name="file_data">: Receives the content of the BMP file</param>
+void make_bench_image(int width, int height, std::vector<uint8_t>& file_data)
+{
+    BMPFileHeader file_header;
+    BMPInfoHeader info_header;
+
+    size_t data_size = (size_t)width * height * 3;
+
+    info_header.size = sizeof(info_header);
+    info_header.width = width;
+    info_header.height = height;
+    info_header.bit_count = 24;
+    file_header.offset_data = sizeof(file_header) + sizeof(info_header);
+    file_header.file_size = (uint32_t)std::min<uint64_t>(file_header.offset_data + data_size, UINT32_MAX);
+
+    file_data.resize(file_header.offset_data + data_size);
+    memcpy(file_data.data(), &file_header, sizeof(file_header));
+    memcpy(file_data.data() + sizeof(file_header), &info_header, sizeof(info_header));
+    RNG::bytes(file_data.data() + file_header.offset_data, data_size);
+}
+
+/// <summary>
+/// Writes a 24-bit BMP file with random pixels
+/// </summary>
+/// <param name="fname">: The name of the BMP file</param>
+/// <param name="width">: The width in pixels (multiple of 4, so the rows have no padding)</param>
+/// <param name="height">: The height in pixels</param>
+void write_bench_image(std::string fname, int width, int height)
+{
+    std::vector<uint8_t> file_data;
+    make_bench_image(width, height, file_data);
+
+    std::ofstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the benchmark image file.");
+    }
+
+    file.write((const char*)file_data.data(), file_data.size());
+}
+
+/// <summary>
+/// Encrypts the benchmark payload into the benchmark image with the given encryption type
+/// </summary>
+/// <param name="encryption_type">: The encryption type, 0 to exit right away</param>
+/// <returns>The exit code of the probe</returns>
+int startup_probe(int encryption_type)
+{
+    if (encryption_type == 0)
+    {
+        return 0;
+    }
+
+    std::filesystem::current_path(BENCH_DIR);
+
+    Keystore keystore("keystore");
+    PasswordKey password_key("image-encrypt");
+    Envelope envelope;
+    if (encryption_type == 5)
+    {
+        envelope.add_recipient("recipient.pub");
+    }
+
+    BMP bmp("carrier.bmp");
+    bmp.set_keystore(&keystore);
+    bmp.set_password_key(&password_key);
+    bmp.set_envelope(&envelope);
+    bmp.encrypt("payload.txt", encryption_type);
+
+    return 0;
+}
+
+#ifndef _WIN32
+extern char** environ;
+#endif
+
+/// <summary>
+/// Starts the program as a startup probe and waits until it exits. It is started directly and not through a
+/// shell, so only the start of the program itself is measured.
+/// </summary>
+/// <param name="program">: The path of this program</param>
+/// <param name="encryption_type">: The encryption type of the probe</param>
+/// <returns>The exit code of the probe, -1 if it could not be started</returns>
+static int run_probe(const std::string& program, int encryption_type)
+{
+    std::string type = std::to_string(encryption_type);
+
+#ifdef _WIN32
+    std::string command_line = "\"" + program + "\" bench startup-probe " + type;
+
+    STARTUPINFOA startup_info = {};
+    startup_info.cb = sizeof(startup_info);
+    PROCESS_INFORMATION process_info = {};
+
+    if (!CreateProcessA(program.c_str(), &command_line[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup_info, &process_info))
+    {
+        return -1;
+    }
+
+    WaitForSingleObject(process_info.hProcess, INFINITE);
+
+    DWORD exit_code = 1;
+    GetExitCodeProcess(process_info.hProcess, &exit_code);
+    CloseHandle(process_info.hThread);
+    CloseHandle(process_info.hProcess);
+    return (int)exit_code;
+#else
+    char bench[] = "bench";
+    char probe[] = "startup-probe";
+    char* argv[] = { (char*)program.c_str(), bench, probe, &type[0], nullptr };
+
+    // Like the shell, a program name without a slash is looked up in PATH
+    pid_t pid;
+    if (posix_spawnp(&pid, program.c_str(), nullptr, nullptr, argv, environ) != 0)
+    {
+        return -1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+/// <summary>
+/// Starts the probe for every encryption type several times and prints the average and minimum time until it exited
+/// </summary>
+/// <param name="program">: The path of this program</param>
+void bench_startup(std::string program)
+{
+    std::filesystem::create_directory(BENCH_DIR);
+    write_bench_image(std::string(BENCH_DIR) + "/carrier.bmp", 256, 256);
+
+    std::vector<uint8_t> payload(1024);
+    RNG::bytes(payload.data(), payload.size());
+    std::ofstream(std::string(BENCH_DIR) + "/payload.txt", std::ios_base::binary).write((const char*)payload.data(), payload.size());
+
+    // Left over if an earlier run was interrupted, and key pairs are never overwritten
+    std::filesystem::remove(std::string(BENCH_DIR) + "/recipient.key");
+    Envelope::generate_key_pair(std::string(BENCH_DIR) + "/recipient");
+
+    const char* names[] = { "Process start only", "AES", "XOR", "None", "AES with password", "AES for several recipients", "AES in counter mode" };
+
+    std::cout << "Startup time per encryption type (" << BENCH_RUNS << " runs each)" << "\n";
+
+    for (int encryption_type = 0; encryption_type <= 6; encryption_type++)
+    {
+        double total = 0;
+        double minimum = 0;
+
+        for (int run = 0; run < BENCH_RUNS; run++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (run_probe(program, encryption_type) != 0)
+            {
+                error("The startup probe failed.");
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            total += ms;
+            minimum = (run == 0 || ms < minimum) ? ms : minimum;
+        }
+
+        std::cout << encryption_type << ": " << names[encryption_type] << ": average " << total / BENCH_RUNS << " ms, minimum " << minimum << " ms" << "\n";
+    }
+
+    std::filesystem::remove_all(BENCH_DIR);
+}
+
+/// <summary>
+/// Sends encrypt requests with a 1 KiB payload to a daemon over several connections and prints the throughput and
+/// the latency percentiles. Without a socket path, a daemon is started in this process.
+/// </summary>
+/// <param name="socket_path">: The socket of a running daemon, or empty to start one</param>
+/// <param name="encryption_type">: The encryption type of the requests</param>
+/// <param name="request_count">: The number of requests of all connections together</param>
+/// <param name="connection_count">: The number of connections that send requests at the same time</param>
+/// <param name="image_side">: The width and height of the image in pixels (rounded up to a multiple of 4)</param>
+/// <param name="shared">: Pass the image as a memfd instead of sending it through the socket</param>
+void bench_daemon(std::string socket_path, int encryption_type, size_t request_count, unsigned connection_count, int image_side, bool shared)
+{
+    connection_count = std::max(1u, connection_count);
+
+    std::unique_ptr<Keystore> keystore;
+    std::unique_ptr<PasswordKey> password_key;
+    std::unique_ptr<Envelope> envelope;
+    std::unique_ptr<Daemon> daemon;
+    std::thread daemon_thread;
+    std::promise<void> listening;
+
+    if (socket_path.empty())
+    {
+        std::filesystem::create_directory(BENCH_DIR);
+        socket_path = std::string(BENCH_DIR) + "/daemon.sock";
+        std::filesystem::remove(socket_path);
+        std::filesystem::remove(std::string(BENCH_DIR) + "/recipient.key");
+
+        keystore = std::make_unique<Keystore>(std::string(BENCH_DIR) + "/keystore");
+        password_key = std::make_unique<PasswordKey>("image-encrypt");
+        envelope = std::make_unique<Envelope>();
+
+        Envelope::generate_key_pair(std::string(BENCH_DIR) + "/recipient");
+        envelope->add_recipient(std::string(BENCH_DIR) + "/recipient.pub");
+        envelope->set_identity(std::string(BENCH_DIR) + "/recipient.key");
+
+        daemon = std::make_unique<Daemon>(socket_path, keystore.get(), password_key.get(), envelope.get());
+
+        // The daemon derives the password master key before it listens. The socket file exists already between
+        // bind and listen, when connections are still refused, so the benchmark waits for listen itself.
+        daemon_thread = std::thread([&daemon, &listening] { daemon->run([&listening] { listening.set_value(); }); });
+        listening.get_future().wait();
+    }
+
+    image_side = std::max(4, (image_side + 3) / 4 * 4);
+
+    std::vector<uint8_t> image;
+    make_bench_image(image_side, image_side, image);
+
+    std::vector<uint8_t> payload(1024);
+    RNG::bytes(payload.data(), payload.size());
+
+    // Every connection encrypts into its own memfd, which keeps the image of its last request
+    std::vector<int> image_fds(connection_count, -1);
+#ifndef _WIN32
+    for (unsigned c = 0; shared && c < connection_count; c++)
+    {
+        uint8_t* mapping;
+        image_fds[c] = DaemonClient::create_shared_image(image.size(), mapping);
+        memcpy(mapping, image.data(), image.size());
+        munmap(mapping, image.size());
+    }
+#endif
+
+    // One round trip checks that the daemon returns the payload it encrypted
+    {
+        DaemonClient client(socket_path);
+        std::vector<uint8_t> encrypted;
+        std::vector<uint8_t> decrypted;
+
+        uint32_t status = shared
+            ? client.call_shared(DAEMON_ENCRYPT, encryption_type, image_fds[0], image.size(), payload.data(), payload.size(), encrypted)
+            : client.call(DAEMON_ENCRYPT, encryption_type, image.data(), image.size(), payload.data(), payload.size(), encrypted);
+        if (status != DAEMON_OK)
+        {
+            error("The daemon failed to encrypt: " + std::string(encrypted.begin(), encrypted.end()));
+        }
+
+        status = shared
+            ? client.call_shared(DAEMON_DECRYPT, encryption_type, image_fds[0], image.size(), nullptr, 0, decrypted)
+            : client.call(DAEMON_DECRYPT, encryption_type, encrypted.data(), encrypted.size(), nullptr, 0, decrypted);
+        if (status != DAEMON_OK || decrypted != payload)
+        {
+            error("The daemon did not return the payload it encrypted.");
+        }
+    }
+
+    std::vector<std::vector<double>> latencies(connection_count);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned c = 0; c < connection_count; c++)
+    {
+        threads.emplace_back([&, c] {
+            DaemonClient client(socket_path);
+            std::vector<uint8_t> encrypted;
+
+            for (size_t i = c; i < request_count; i += connection_count)
+            {
+                auto request_start = std::chrono::steady_clock::now();
+                uint32_t status = shared
+                    ? client.call_shared(DAEMON_ENCRYPT, encryption_type, image_fds[c], image.size(), payload.data(), payload.size(), encrypted)
+                    : client.call(DAEMON_ENCRYPT, encryption_type, image.data(), image.size(), payload.data(), payload.size(), encrypted);
+                if (status != DAEMON_OK)
+                {
+                    error("The daemon failed to encrypt: " + std::string(encrypted.begin(), encrypted.end()));
+                }
+                latencies[c].push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - request_start).count());
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+#ifndef _WIN32
+    for (int image_fd : image_fds)
+    {
+        if (image_fd >= 0)
+        {
+            close(image_fd);
+        }
+    }
+#endif
+
+    std::vector<double> all;
+    for (const auto& connection : latencies)
+    {
+        all.insert(all.end(), connection.begin(), connection.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    auto percentile = [&all](double p) {
+        return all.empty() ? 0.0 : all[std::min(all.size() - 1, (size_t)(p / 100 * all.size()))];
+    };
+
+    std::cout << request_count << " encrypt requests (type " << encryption_type << ", 1 KiB payload, " << image_side << "x" << image_side
+        << " image " << (shared ? "in a memfd" : "through the socket") << ") over " << connection_count << " connections" << "\n";
+    std::cout << "Throughput: " << (seconds > 0 ? all.size() / seconds : 0) << " requests/s" << "\n";
+    std::cout << "Latency: p50 " << percentile(50) << " ms, p90 " << percentile(90) << " ms, p99 " << percentile(99)
+        << " ms, max " << (all.empty() ? 0.0 : all.back()) << " ms" << "\n";
+
+    if (daemon)
+    {
+        Daemon::stop();
+        daemon_thread.join();
+        std::filesystem::remove_all(BENCH_DIR);
+    }
+}
+
+// Data TLB read misses of the calling thread, counted with perf_event_open where the kernel allows it
+struct TlbMissCounter
+{
+    int fd{ -1 };
+
+    TlbMissCounter()
+    {
+#ifdef __linux__
+        perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HW_CACHE;
+        attributes.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        fd = (int)syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+#endif
+    }
+
+    ~TlbMissCounter()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+#endif
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Returns the misses since start, or -1 if they can not be counted
+    int64_t stop()
+    {
+#ifdef __linux__
+        uint64_t count;
+        if (fd >= 0 && ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) == 0 && read(fd, &count, sizeof(count)) == sizeof(count))
+        {
+            return (int64_t)count;
+        }
+#endif
+        return -1;
+    }
+};
+
+/// <summary>
+/// Returns how many bytes of the process are backed by huge pages, transparent or reserved, or 0 if it is not known
+/// </summary>
+static uint64_t huge_page_bytes()
+{
+    std::ifstream file("/proc/self/smaps_rollup");
+    std::string name;
+    uint64_t total = 0;
+    while (file >> name)
+    {
+        uint64_t kilobytes;
+        if ((name == "AnonHugePages:" || name == "Private_Hugetlb:") && file >> kilobytes)
+        {
+            total += kilobytes * 1024;
+        }
+    }
+
+    return total;
+}
+
+/// <summary>
+/// Embeds a payload into a large synthetic image, writes and verifies the checksum, once with 4 KiB pages and once
+/// with huge pages, and prints the throughput and the data TLB misses of both
+/// </summary>
+/// <param name="image_size">: The size of the image data in bytes</param>
+/// <param name="runs">: The number of measured runs per page size, the fastest counts</param>
+void bench_huge_pages(size_t image_size, int runs)
+{
+    const int width = 4096;
+    int height = (int)std::max<size_t>(1, image_size / (width * 3));
+    size_t data_size = (size_t)width * height * 3;
+
+    std::vector<uint8_t> payload(1024 * 1024);
+    RNG::bytes(payload.data(), payload.size());
+
+    bool enabled = use_huge_pages;
+    double seconds_by_mode[2] = { 0, 0 };
+    int64_t misses_by_mode[2] = { -1, -1 };
+
+    std::cout << "Image of " << width << "x" << height << " pixels (" << (data_size >> 20) << " MiB), " << runs << " runs of embed, checksum and verify" << "\n";
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        use_huge_pages = mode == 1;
+        uint64_t huge_before = huge_page_bytes();
+
+        // The pixels are written once before the measurement, so the page faults are not measured
+        std::vector<uint8_t> file_data;
+        make_bench_image(width, height, file_data);
+        AlignedBuffer buffer(file_data.begin(), file_data.end());
+        std::vector<uint8_t>().swap(file_data);
+
+        uint64_t huge_after = huge_page_bytes();
+        uint64_t huge = huge_after > huge_before ? huge_after - huge_before : 0;
+
+        BMP bmp(std::move(buffer));
+        bmp.set_key(payload.data(), 8);
+        TlbMissCounter counter;
+
+        for (int run = 0; run < runs; run++)
+        {
+            bmp.set_text(payload);
+            bmp.apply_encryption(2);
+
+            counter.start();
+            auto start = std::chrono::steady_clock::now();
+            bmp.embed_text();
+            bmp.write_checksum();
+            if (!bmp.verify())
+            {
+                error("The checksum of the benchmark image does not match.");
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            int64_t misses = counter.stop();
+
+            if (run == 0 || seconds < seconds_by_mode[mode])
+            {
+                seconds_by_mode[mode] = seconds;
+                misses_by_mode[mode] = misses;
+            }
+        }
+
+        std::cout << (mode == 1 ? "2 MiB pages: " : "4 KiB pages: ") << (data_size / seconds_by_mode[mode] / (1 << 20)) << " MiB/s, dTLB misses ";
+        if (misses_by_mode[mode] >= 0)
+        {
+            std::cout << misses_by_mode[mode];
+        }
+        else
+        {
+            std::cout << "not available";
+        }
+        std::cout << ", " << (huge >> 20) << " MiB in huge pages" << "\n";
+    }
+
+    use_huge_pages = enabled;
+
+    std::cout << "Speedup with huge pages: " << (seconds_by_mode[0] / seconds_by_mode[1]) << "x";
+    if (misses_by_mode[0] > 0 && misses_by_mode[1] >= 0)
+    {
+        std::cout << ", dTLB misses " << (100.0 * misses_by_mode[1] / misses_by_mode[0]) << " %";
+    }
+    std::cout << "\n";
+}
@@ -0,0 +1,1528 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Non-interactive command line. One process handles any number of
+* images, given as files, directories, wildcard patterns or a manifest,
+* and writes the results to paths built from an output template. The
+* keystore, the password master key and OpenSSL are set up only once.
+*
+**********************************************************************/
+
+static void print_usage()
+{
+    std::cout <<
+        "Usage: image-encrypt <command> [options] <images...>\n"
+        "\n"
+        "Commands:\n"
+        "  encrypt     Encrypt the payload into every image\n"
+        "  decrypt     Decrypt the payload from every image\n"
+        "  verify      Check the checksum of every image\n"
+        "  capacity    Print how many bytes fit into every image\n"
+        "  scan        List the images that hold a payload, from their headers and first row only, and\n"
+        "              keep the results in an index so unchanged images are not read again\n"
+        "  archive     Pack files and directories into one archive payload (-o, default archive.iea)\n"
+        "  extract     List the files of the archive in every image, or write the files given with --file,\n"
+        "              decrypting only the table of contents and those files\n"
+        "  keygen NAME Create the recipient key pair NAME.key / NAME.pub\n"
+        "  daemon      Answer encrypt, decrypt, verify and capacity requests on a Unix domain socket,\n"
+        "              with the keystore, the password master key and OpenSSL kept loaded\n"
+        "  bench startup\n"
+        "              Measure the startup time for every encryption type\n"
+        "  bench daemon [--socket PATH] [-t TYPE] [-n REQUESTS] [-c CONNECTIONS] [--image SIDE] [--shared]\n"
+        "              Measure the latency of encrypt requests to a daemon (started in the process\n"
+        "              without --socket), with the image sent through the socket or passed as memfd\n"
+        "  bench hugepages [--size MB] [-n RUNS]\n"
+        "              Compare embedding into a large image with 4 KiB and with 2 MiB pages\n"
+        "\n"
+        "Images can be files, directories (all .bmp files in it) or patterns with * and ?.\n"
+        "\n"
+        "Options:\n"
+        "  -t, --type TYPE         aes, xor, none, password, envelope or ctr (AES in counter mode) (or 1-6), default\n"
+        "                          aes; decrypt and extract take the type from the embedded header by default\n"
+        "  -p, --payload FILE      File to encrypt into the images\n"
+        "  -m, --manifest FILE     File with one image per line, optionally followed by a tab and its payload\n"
+        "  -o, --output TEMPLATE   Output path, default {dir}/{stem}.enc.bmp (encrypt), {dir}/{stem}.{payload}.enc.bmp\n"
+        "                          (encrypt --carrier-pool) or {dir}/{stem}.out (decrypt)\n"
+        "                          {dir}, {name}, {stem}, {ext} refer to the image, {payload} to the payload name\n"
+        "                          without extension, {index} to the position of the image and {file} to the\n"
+        "                          archive file (extract, default {file})\n"
+        "  -k, --keystore FILE     Keystore file, default keystore\n"
+        "      --password-file F   File with the password (otherwise IMAGE_ENCRYPT_PASSWORD is used)\n"
+        "  -r, --recipient FILE    Public key of a recipient (can be repeated)\n"
+        "  -i, --identity FILE     Own private key to decrypt envelope images\n"
+        "  -j, --jobs N            Number of threads of every computing stage, default one per logical processor\n"
+        "      --io-threads N      Number of threads that read and write files, default 2\n"
+        "      --queue-depth N     Number of images that can wait in front of every stage, default 16\n"
+        "      --trace FILE        Write the time of every stage and the queue depths as Chrome trace\n"
+        "      --no-io-uring       Read and write files with synchronous calls instead of io_uring (Linux)\n"
+        "      --memory-budget N   Memory for the images processed at the same time, with suffix K, M or G,\n"
+        "                          default half of the physical memory\n"
+        "      --direct-io-min N   Read and write images of at least this size with O_DIRECT, bypassing the\n"
+        "                          page cache (Linux, with io_uring), default 512M\n"
+        "      --no-direct-io      Never use O_DIRECT\n"
+        "      --no-huge-pages     Keep large image buffers on 4 KiB pages instead of 2 MiB pages (Linux)\n"
+        "      --numa              Run the stages of every NUMA node on its own processors with node-local buffers\n"
+        "                          (Linux), --jobs and --io-threads then count per node\n"
+        "      --socket PATH       Socket of the daemon, default image-encrypt.sock\n"
+        "      --index FILE        Scan index, default scan.index\n"
+        "      --file NAME         Extract: file of the archive to write (can be repeated)\n"
+        "      --range OFF:LEN     Extract: write only LEN bytes from OFF of the payload (or of every --file), with\n"
+        "                          suffix K, M or G; only these bytes are read and decrypted\n"
+        "      --carrier-pool DIR  Encrypt: the inputs are payloads, every payload goes into the smallest image\n"
+        "                          without payload in DIR (and its subdirectories) that fits it (can be repeated)\n"
+        "  -q, --quiet             Only print errors\n";
+}
+
+/// <summary>
+/// Converts the name or number of an encryption type to its number
+/// </summary>
+static int parse_encryption_type(std::string name)
+{
+    const char* names[] = { "aes", "xor", "none", "password", "envelope", "ctr" };
+    for (int i = 0; i < 6; i++)
+    {
+        if (name == names[i] || name == std::to_string(i + 1))
+        {
+            return i + 1;
+        }
+    }
+
+    error("Unknown encryption type " + name);
+    return 0;
+}
+
+/// <summary>
+/// Converts a size with an optional suffix K, M or G (powers of 1024) to bytes
+/// </summary>
+/// <param name="allow_zero">: True to accept 0, e.g. for an offset</param>
+static uint64_t parse_size(std::string size, bool allow_zero = false)
+{
+    char* end;
+    double value = strtod(size.c_str(), &end);
+    std::string suffix = end;
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+
+    const char* suffixes[] = { "", "K", "M", "G" };
+    for (int i = 0; i < 4; i++)
+    {
+        if ((value > 0 || (allow_zero && value == 0 && end != size.c_str())) && (suffix == suffixes[i] || suffix == std::string(suffixes[i]) + "B"))
+        {
+            return (uint64_t)(value * (double)((uint64_t)1 << (10 * i)));
+        }
+    }
+
+    error("Invalid size " + size);
+    return 0;
+}
+
+/// <summary>
+/// Matches a file name against a pattern with the wildcards * (any number of characters) and ? (one character)
+/// </summary>
+static bool wildcard_match(const char* pattern, const char* name)
+{
+    if (*pattern == '\0')
+    {
+        return *name == '\0';
+    }
+
+    if (*pattern == '*')
+    {
+        return wildcard_match(pattern + 1, name) || (*name != '\0' && wildcard_match(pattern, name + 1));
+    }
+
+    if (*name != '\0' && (*pattern == '?' || *pattern == *name))
+    {
+        return wildcard_match(pattern + 1, name + 1);
+    }
+
+    return false;
+}
+
+/// <summary>
+/// Expands an input argument to image paths. Directories are expanded to all .bmp files in them and
+/// wildcards in the file name to all matching files. The shell does not expand wildcards on Windows.
+/// </summary>
+/// <param name="recursive">: True to include the .bmp files in all subdirectories of a directory</param>
+static void expand_input(std::string input, std::vector<std::string>& images, bool recursive = false)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::string> found;
+
+    auto add_image = [&](const fs::directory_entry& entry) {
+        std::string ext = entry.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+        if (entry.is_regular_file() && ext == ".bmp")
+        {
+            found.push_back(entry.path().string());
+        }
+    };
+
+    if (fs::is_directory(input) && recursive)
+    {
+        for (const auto& entry : fs::recursive_directory_iterator(input, fs::directory_options::skip_permission_denied))
+        {
+            add_image(entry);
+        }
+    }
+    else if (fs::is_directory(input))
+    {
+        for (const auto& entry : fs::directory_iterator(input))
+        {
+            add_image(entry);
+        }
+    }
+    else if (input.find_first_of("*?") != std::string::npos)
+    {
+        fs::path pattern(input);
+        fs::path dir = pattern.has_parent_path() ? pattern.parent_path() : fs::path(".");
+        std::string name_pattern = pattern.filename().string();
+
+        if (fs::is_directory(dir))
+        {
+            for (const auto& entry : fs::directory_iterator(dir))
+            {
+                if (entry.is_regular_file() && wildcard_match(name_pattern.c_str(), entry.path().filename().string().c_str()))
+                {
+                    found.push_back(pattern.has_parent_path() ? entry.path().string() : entry.path().filename().string());
+                }
+            }
+        }
+    }
+    else
+    {
+        images.push_back(input);
+        return;
+    }
+
+    // Directory order is not defined, so the results are sorted to keep {index} stable
+    std::sort(found.begin(), found.end());
+    images.insert(images.end(), found.begin(), found.end());
+}
+
+/// <summary>
+/// Builds an output path from the template
+/// </summary>
+/// <param name="output">: The template</param>
+/// <param name="image">: The path of the image</param>
+/// <param name="payload">: The path of the payload (may be empty)</param>
+/// <param name="index">: The position of the image</param>
+/// <param name="file">: The name of the archive file (may be empty)</param>
+static std::string expand_template(std::string output, const std::string& image, const std::string& payload, size_t index, const std::string& file = "")
+{
+    std::filesystem::path path(image);
+    std::string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+
+    std::pair<std::string, std::string> fields[] = {
+        { "{dir}", dir },
+        { "{name}", path.filename().string() },
+        { "{stem}", path.stem().string() },
+        { "{ext}", path.extension().string() },
+        { "{payload}", std::filesystem::path(payload).stem().string() },
+        { "{index}", std::to_string(index) },
+        { "{file}", file }
+    };
+
+    for (const auto& field : fields)
+    {
+        size_t pos;
+        while ((pos = output.find(field.first)) != std::string::npos)
+        {
+            output.replace(pos, field.first.size(), field.second);
+        }
+    }
+
+    return output;
+}
+
+/// <summary>
+/// Reads a whole file
+/// </summary>
+static void read_file(std::string fname, std::vector<uint8_t>& data)
+{
+    std::ifstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the input file " + fname + ".");
+    }
+
+    file.seekg(0, file.end);
+    data.resize((size_t)file.tellg());
+    file.seekg(0, file.beg);
+    file.read((char*)data.data(), data.size());
+}
+
+/// <summary>
+/// Reads the password from the password file or the IMAGE_ENCRYPT_PASSWORD environment variable.
+/// It is never taken from the arguments, which other users can see in the process list.
+/// </summary>
+static std::string read_password(std::string password_file)
+{
+    if (!password_file.empty())
+    {
+        std::ifstream file(password_file, std::ios_base::binary);
+        std::string password;
+        if (!file || !std::getline(file, password))
+        {
+            error("Unable to read the password file.");
+        }
+
+        // The line break is not part of the password
+        if (!password.empty() && password.back() == '\r')
+        {
+            password.pop_back();
+        }
+
+        return password;
+    }
+
+    const char* password = std::getenv("IMAGE_ENCRYPT_PASSWORD");
+    if (!password)
+    {
+        error("The password type needs --password-file or the IMAGE_ENCRYPT_PASSWORD environment variable.");
+    }
+
+    return password;
+}
+// Options of the command line, parsed once and shared by all commands
+struct CliOptions
+{
+    std::string command;
+
+    // 0 until --type is given: encrypt then uses AES, decrypt the type in the embedded header of every image
+    int encryption_type{ 0 };
+    std::string payload;
+    std::string manifest;
+    std::string output;
+    std::string keystore_name{ "keystore" };
+    std::string password_file;
+    std::vector<std::string> recipients;
+    std::string identity;
+    bool quiet{ false };
+    unsigned thread_count{ 0 };
+    uint64_t memory_budget{ 0 };
+    unsigned io_threads{ 2 };
+    size_t queue_depth{ 16 };
+    std::string trace_fname;
+    bool use_io_uring{ true };
+    uint64_t direct_io_min{ (uint64_t)512 << 20 };
+    bool use_numa{ false };
+    std::string socket_path{ "image-encrypt.sock" };
+    std::string index_fname{ "scan.index" };
+    std::vector<std::string> carrier_inputs;
+    std::vector<std::string> file_names;
+    bool has_range{ false };
+    uint64_t range_offset{ 0 };
+    uint64_t range_size{ 0 };
+    std::vector<std::string> inputs;
+};
+
+// Keys of the commands that encrypt or decrypt, loaded once for all images
+struct CliKeys
+{
+    CliKeys(const CliOptions& options, bool load_password);
+
+    Keystore keystore;
+    std::unique_ptr<PasswordKey> password_key;
+    Envelope envelope;
+};
+
+/// <summary>
+/// Opens the keystore, reads the password and the recipient keys
+/// </summary>
+/// <param name="options">: The options with the key files</param>
+/// <param name="load_password">: True to read the password, which fails if none was given</param>
+CliKeys::CliKeys(const CliOptions& options, bool load_password) : keystore(options.keystore_name)
+{
+    // Without a password the images get no password key, so they report that it is missing
+    if (load_password)
+    {
+        password_key = std::make_unique<PasswordKey>(read_password(options.password_file));
+    }
+
+    for (const auto& recipient : options.recipients)
+    {
+        envelope.add_recipient(recipient);
+    }
+
+    if (!options.identity.empty())
+    {
+        envelope.set_identity(options.identity);
+    }
+}
+
+/// <summary>
+/// Returns whether a password was given in a file or in the environment
+/// </summary>
+static bool has_password(const CliOptions& options)
+{
+    return !options.password_file.empty() || std::getenv("IMAGE_ENCRYPT_PASSWORD");
+}
+
+/// <summary>
+/// Returns whether the images of the command need the password. Without a type, decrypt and extract read the
+/// password if there is one, since any image may need it.
+/// </summary>
+static bool needs_password(const CliOptions& options)
+{
+    return options.encryption_type == 4 || (options.encryption_type == 0 && has_password(options));
+}
+
+// Workers of one NUMA node. With --numa every node has its own pipeline and thread pool on its processors, and
+// its images and buffers are only reused by the node, so their pages stay on the node that first touched them.
+// Without --numa there is one of them that runs anywhere.
+struct NodeWorkers
+{
+    const NumaNode* node{ nullptr };
+    std::unique_ptr<ThreadPool> thread_pool;
+    std::unique_ptr<BufferPool> buffer_pool;
+    std::unique_ptr<Pipeline> pipeline;
+    std::vector<std::unique_ptr<BMP>> idle_images;
+    std::mutex idle_mutex;
+
+    // Estimated memory of the jobs pushed to the node that have not finished, new jobs go to the least loaded node
+    std::atomic<uint64_t> pending{ 0 };
+
+    // Throughput counters, reported per node with --numa
+    std::atomic<uint64_t> image_count{ 0 };
+    std::atomic<uint64_t> byte_count{ 0 };
+};
+/// <summary>
+/// Runs the bench command, which has its own options
+/// </summary>
+/// <returns>The exit code of the program</returns>
+static int run_bench(int argc, char* argv[])
+{
+    std::string what = argc >= 3 ? argv[2] : "";
+    if (what == "startup")
+    {
+        bench_startup(argv[0]);
+        return 0;
+    }
+
+    if (what == "startup-probe" && argc >= 4)
+    {
+        return startup_probe(atoi(argv[3]));
+    }
+
+    if (what == "daemon")
+    {
+        std::string socket_path;
+        int encryption_type = 1;
+        size_t request_count = 10000;
+        unsigned connection_count = 4;
+        int image_side = 256;
+        bool shared = false;
+
+        for (int i = 3; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+
+            if (arg == "--socket" && has_value)
+            {
+                socket_path = argv[++i];
+            }
+            else if ((arg == "-t" || arg == "--type") && has_value)
+            {
+                encryption_type = parse_encryption_type(argv[++i]);
+            }
+            else if (arg == "-n" && has_value)
+            {
+                request_count = (size_t)std::max(1, atoi(argv[++i]));
+            }
+            else if (arg == "-c" && has_value)
+            {
+                connection_count = (unsigned)std::max(1, atoi(argv[++i]));
+            }
+            else if (arg == "--image" && has_value)
+            {
+                image_side = std::max(4, atoi(argv[++i]));
+            }
+            else if (arg == "--shared")
+            {
+                shared = true;
+            }
+            else
+            {
+                print_usage();
+                return 2;
+            }
+        }
+
+        bench_daemon(socket_path, encryption_type, request_count, connection_count, image_side, shared);
+        return 0;
+    }
+
+    if (what == "hugepages")
+    {
+        size_t image_size = (size_t)512 << 20;
+        int runs = 5;
+
+        for (int i = 3; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+
+            if (arg == "--size" && has_value)
+            {
+                image_size = (size_t)std::max(1, atoi(argv[++i])) << 20;
+            }
+            else if (arg == "-n" && has_value)
+            {
+                runs = std::max(1, atoi(argv[++i]));
+            }
+            else
+            {
+                print_usage();
+                return 2;
+            }
+        }
+
+        bench_huge_pages(image_size, runs);
+        return 0;
+    }
+
+    print_usage();
+    return 2;
+}
+
+/// <summary>
+/// Parses the options of a command and fills in the defaults that depend on the command
+/// </summary>
+/// <param name="options">: Receives the options, the command is already set</param>
+/// <returns>False if an option is unknown, the usage was then printed</returns>
+static bool parse_options(int argc, char* argv[], CliOptions& options)
+{
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if ((arg == "-t" || arg == "--type") && has_value)
+        {
+            options.encryption_type = parse_encryption_type(argv[++i]);
+        }
+        else if ((arg == "-p" || arg == "--payload") && has_value)
+        {
+            options.payload = argv[++i];
+        }
+        else if ((arg == "-m" || arg == "--manifest") && has_value)
+        {
+            options.manifest = argv[++i];
+        }
+        else if ((arg == "-o" || arg == "--output") && has_value)
+        {
+            options.output = argv[++i];
+        }
+        else if ((arg == "-k" || arg == "--keystore") && has_value)
+        {
+            options.keystore_name = argv[++i];
+        }
+        else if (arg == "--password-file" && has_value)
+        {
+            options.password_file = argv[++i];
+        }
+        else if ((arg == "-r" || arg == "--recipient") && has_value)
+        {
+            options.recipients.push_back(argv[++i]);
+        }
+        else if ((arg == "-i" || arg == "--identity") && has_value)
+        {
+            options.identity = argv[++i];
+        }
+        else if ((arg == "-j" || arg == "--jobs") && has_value)
+        {
+            options.thread_count = (unsigned)std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--io-threads" && has_value)
+        {
+            options.io_threads = (unsigned)std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--queue-depth" && has_value)
+        {
+            options.queue_depth = (size_t)std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--no-io-uring")
+        {
+            options.use_io_uring = false;
+        }
+        else if (arg == "--trace" && has_value)
+        {
+            options.trace_fname = argv[++i];
+        }
+        else if (arg == "--memory-budget" && has_value)
+        {
+            options.memory_budget = parse_size(argv[++i]);
+        }
+        else if (arg == "--direct-io-min" && has_value)
+        {
+            options.direct_io_min = parse_size(argv[++i]);
+        }
+        else if (arg == "--no-direct-io")
+        {
+            options.direct_io_min = UINT64_MAX;
+        }
+        else if (arg == "--no-huge-pages")
+        {
+            use_huge_pages = false;
+        }
+        else if (arg == "--numa")
+        {
+            options.use_numa = true;
+        }
+        else if (arg == "--socket" && has_value)
+        {
+            options.socket_path = argv[++i];
+        }
+        else if (arg == "--index" && has_value)
+        {
+            options.index_fname = argv[++i];
+        }
+        else if (arg == "--file" && has_value)
+        {
+            options.file_names.push_back(argv[++i]);
+        }
+        else if (arg == "--range" && has_value)
+        {
+            std::string range = argv[++i];
+            size_t colon = range.find(':');
+            if (colon == std::string::npos)
+            {
+                error("Invalid range " + range + ", expected OFFSET:LENGTH");
+            }
+
+            options.range_offset = parse_size(range.substr(0, colon), true);
+            options.range_size = parse_size(range.substr(colon + 1), true);
+            options.has_range = true;
+        }
+        else if (arg == "--carrier-pool" && has_value)
+        {
+            options.carrier_inputs.push_back(argv[++i]);
+        }
+        else if (arg == "-q" || arg == "--quiet")
+        {
+            options.quiet = true;
+        }
+        else if (!arg.empty() && arg[0] == '-')
+        {
+            std::cerr << "error: unknown or incomplete option " << arg << "\n";
+            print_usage();
+            return false;
+        }
+        else
+        {
+            options.inputs.push_back(arg);
+        }
+    }
+
+    if (options.output.empty())
+    {
+        if (options.command == "encrypt" && !options.carrier_inputs.empty())
+        {
+            // Every carrier is chosen by the program, so the name of the output tells which payload it holds
+            options.output = "{dir}/{stem}.{payload}.enc.bmp";
+        }
+        else if (options.command == "encrypt")
+        {
+            options.output = "{dir}/{stem}.enc.bmp";
+        }
+        else if (options.command == "archive")
+        {
+            options.output = "archive.iea";
+        }
+        else if (options.command == "extract" && !options.file_names.empty())
+        {
+            options.output = "{file}";
+        }
+        else
+        {
+            options.output = "{dir}/{stem}.out";
+        }
+    }
+
+    if (options.encryption_type == 0 && options.command != "decrypt" && options.command != "extract")
+    {
+        options.encryption_type = 1;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Runs the daemon until it is stopped
+/// </summary>
+/// <returns>The exit code of the program</returns>
+static int run_daemon(const CliOptions& options)
+{
+    // The daemon serves every encryption type, so the password is only required for type 4 requests
+    CliKeys keys(options, has_password(options));
+
+    return Daemon(options.socket_path, &keys.keystore, keys.password_key.get(), &keys.envelope).run([&] {
+        if (!options.quiet)
+        {
+            std::cout << "Listening on " << options.socket_path << std::endl;
+        }
+    });
+}
+
+/// <summary>
+/// Lists the images that hold a payload and updates the scan index
+/// </summary>
+/// <returns>The exit code of the program</returns>
+static int run_scan(const CliOptions& options)
+{
+    // Directories are scanned with all their subdirectories
+    std::vector<std::string> images;
+    for (const auto& input : options.inputs)
+    {
+        expand_input(input, images, true);
+    }
+
+    if (images.empty())
+    {
+        std::cerr << "error: no images given" << "\n";
+        return 2;
+    }
+
+    ScanIndex scan_index(options.index_fname);
+    ThreadPool thread_pool(options.thread_count);
+    size_t probed = scan_index.scan(images, thread_pool);
+    scan_index.save();
+
+    size_t carrier_count = 0;
+    for (const auto& image : images)
+    {
+        ScanRecord record;
+        if (!scan_index.find(image, record) || !record.has_payload)
+        {
+            continue;
+        }
+
+        carrier_count++;
+
+        char key_id[16] = "none";
+        if (record.key_id != 0)
+        {
+            snprintf(key_id, sizeof(key_id), "%08x", record.key_id);
+        }
+
+        std::cout << image << ": " << record.text_size << " bytes, version " << (int)record.version
+            << ", type " << (record.cipher != 0 ? std::to_string(record.cipher) : "unknown") << ", key " << key_id << "\n";
+    }
+
+    if (!options.quiet)
+    {
+        std::cout << images.size() << " images, " << carrier_count << " with payload, " << probed << " probed" << "\n";
+    }
+
+    return 0;
+}
+
+/// <summary>
+/// Packs the input files and directories into an archive payload
+/// </summary>
+/// <returns>The exit code of the program</returns>
+static int run_archive(const CliOptions& options)
+{
+    if (options.inputs.empty())
+    {
+        std::cerr << "error: no files given" << "\n";
+        return 2;
+    }
+
+    Archive archive;
+    for (const auto& input : options.inputs)
+    {
+        archive.add(input);
+    }
+
+    archive.write(options.output);
+
+    if (!options.quiet)
+    {
+        std::cout << archive.members.size() << " files -> " << options.output << "\n";
+    }
+
+    return 0;
+}
+
+/// <summary>
+/// Builds the jobs of the image commands from the inputs, the carrier pool and the manifest
+/// </summary>
+/// <param name="jobs">: Receives every image with the payload that goes into it</param>
+static void collect_jobs(const CliOptions& options, std::vector<std::pair<std::string, std::string>>& jobs)
+{
+    if (!options.carrier_inputs.empty())
+    {
+        if (options.command != "encrypt")
+        {
+            error("--carrier-pool can only be used with encrypt.");
+        }
+
+        // The carriers are probed like by scan, so only images that changed since the last scan are read
+        std::vector<std::string> carriers;
+        for (const auto& input : options.carrier_inputs)
+        {
+            expand_input(input, carriers, true);
+        }
+
+        ScanIndex scan_index(options.index_fname);
+        {
+            ThreadPool probe_pool(options.thread_count);
+            scan_index.scan(carriers, probe_pool);
+        }
+        scan_index.save();
+
+        CarrierPool carrier_pool(scan_index, carriers);
+
+        // The largest payloads choose first, so small ones do not take the carriers only large ones fit into
+        std::vector<std::pair<uint64_t, std::string>> payload_sizes;
+        for (const auto& input : options.inputs)
+        {
+            std::error_code ec;
+            uint64_t size = std::filesystem::file_size(input, ec);
+            if (ec)
+            {
+                error("Unable to open the payload file " + input + ".");
+            }
+
+            payload_sizes.push_back({ size, input });
+        }
+
+        std::stable_sort(payload_sizes.begin(), payload_sizes.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+
+        for (const auto& payload_size : payload_sizes)
+        {
+            std::string carrier;
+            if (!carrier_pool.take(BMP::encrypted_size(options.encryption_type, payload_size.first, options.recipients.size()), carrier))
+            {
+                error("No image without payload in the carrier pool is large enough for " + payload_size.second + ".");
+            }
+
+            jobs.push_back({ carrier, payload_size.second });
+        }
+    }
+    else
+    {
+        for (const auto& input : options.inputs)
+        {
+            std::vector<std::string> images;
+            expand_input(input, images);
+
+            for (const auto& image : images)
+            {
+                jobs.push_back({ image, options.payload });
+            }
+        }
+    }
+
+    if (!options.manifest.empty())
+    {
+        std::ifstream file(options.manifest);
+        if (!file)
+        {
+            error("Unable to open the manifest file.");
+        }
+
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+
+            if (line.empty() || line[0] == '#')
+            {
+                continue;
+            }
+
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos)
+            {
+                jobs.push_back({ line, options.payload });
+            }
+            else
+            {
+                jobs.push_back({ line.substr(0, tab), line.substr(tab + 1) });
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Prints how many bytes fit into every image. Only the headers of the images are read.
+/// </summary>
+/// <returns>The exit code of the program</returns>
+static int run_capacity(const std::vector<std::pair<std::string, std::string>>& jobs)
+{
+    for (const auto& job : jobs)
+    {
+        uint64_t capacity;
+        if (!BMP::file_capacity(job.first, capacity))
+        {
+            error("Unable to read " + job.first + " as 24 or 32 bits per pixel BMP file.");
+        }
+
+        std::cout << job.first << ": " << capacity << " bytes" << "\n";
+    }
+
+    return 0;
+}
+
+/// <summary>
+/// Lists the files of the archive in every image or writes the requested files or range. Only the table of
+/// contents and the requested files are read from the images, one image after another.
+/// </summary>
+/// <returns>The exit code of the program</returns>
+static int run_extract(const CliOptions& options, const std::vector<std::pair<std::string, std::string>>& jobs)
+{
+    CliKeys keys(options, needs_password(options));
+
+    BMP bmp;
+    bmp.set_keystore(&keys.keystore);
+    bmp.set_password_key(keys.password_key.get());
+    bmp.set_envelope(&keys.envelope);
+
+    for (size_t index = 0; index < jobs.size(); index++)
+    {
+        const std::string& image = jobs[index].first;
+
+        bmp.open_text(image, options.encryption_type);
+
+        // A range of the whole payload does not need a table of contents
+        if (options.has_range && options.file_names.empty())
+        {
+            if (options.range_offset > bmp.plain_text_size() || options.range_size > bmp.plain_text_size() - options.range_offset)
+            {
+                error("The range is outside of the " + std::to_string(bmp.plain_text_size()) + " bytes of the payload in " + image + ".");
+            }
+
+            std::string out_fname = expand_template(options.output, image, "", index);
+            std::filesystem::path out_dir = std::filesystem::path(out_fname).parent_path();
+            if (!out_dir.empty())
+            {
+                std::filesystem::create_directories(out_dir);
+            }
+
+            bmp.read_text_range(options.range_offset, options.range_size);
+            bmp.write_text_out(out_fname);
+
+            if (!options.quiet)
+            {
+                std::cout << image << " -> " << out_fname << "\n";
+            }
+
+            continue;
+        }
+
+        Archive archive;
+        if (!archive.read(bmp))
+        {
+            error(image + " holds no archive");
+        }
+
+        if (options.file_names.empty())
+        {
+            for (const auto& member : archive.members)
+            {
+                std::cout << image << ": " << member.name << ", " << member.size << " bytes" << "\n";
+            }
+        }
+
+        for (const auto& name : options.file_names)
+        {
+            ArchiveMember member;
+            if (!archive.find(name, member))
+            {
+                error(image + " holds no file " + name);
+            }
+
+            // Names are relative, but a manipulated archive must not write outside of the output path either
+            std::filesystem::path member_path(member.name);
+            if (member_path.is_absolute() || std::find(member_path.begin(), member_path.end(), "..") != member_path.end())
+            {
+                error("The name " + member.name + " in " + image + " leaves the output directory.");
+            }
+
+            std::string out_fname = expand_template(options.output, image, "", index, member.name);
+            std::filesystem::path out_dir = std::filesystem::path(out_fname).parent_path();
+            if (!out_dir.empty())
+            {
+                std::filesystem::create_directories(out_dir);
+            }
+
+            // A range of a file can not be checked with the checksum of the whole file
+            if (options.has_range)
+            {
+                if (options.range_offset > member.size || options.range_size > member.size - options.range_offset)
+                {
+                    error("The range is outside of the " + std::to_string(member.size) + " bytes of " + member.name + ".");
+                }
+
+                bmp.read_text_range(member.offset + options.range_offset, options.range_size);
+                bmp.write_text_out(out_fname);
+            }
+            else
+            {
+                archive.extract(bmp, member, out_fname);
+            }
+
+            if (!options.quiet)
+            {
+                std::cout << image << ": " << member.name << " -> " << out_fname << "\n";
+            }
+        }
+    }
+
+    return 0;
+}
+
+/// <summary>
+/// Encrypts, decrypts or verifies the images in the pipeline
+/// </summary>
+/// <returns>The exit code of the program</returns>
+static int run_batch(const CliOptions& options, const std::vector<std::pair<std::string, std::string>>& jobs)
+{
+    CliKeys keys(options, needs_password(options));
+
+    // Payloads are read only once, even if they go into many images, and all output directories are
+    // created before the jobs start
+    std::map<std::string, std::vector<uint8_t>> payloads;
+    std::vector<std::string> out_fnames(jobs.size());
+
+    for (size_t index = 0; index < jobs.size() && (options.command == "encrypt" || options.command == "decrypt"); index++)
+    {
+        const std::string& image = jobs[index].first;
+        const std::string& job_payload = jobs[index].second;
+
+        if (options.command == "encrypt")
+        {
+            if (job_payload.empty())
+            {
+                error("No payload for " + image + ". Use --payload or a manifest with payloads.");
+            }
+
+            if (payloads.find(job_payload) == payloads.end())
+            {
+                read_file(job_payload, payloads[job_payload]);
+            }
+        }
+
+        out_fnames[index] = expand_template(options.output, image, job_payload, index);
+        std::filesystem::path out_dir = std::filesystem::path(out_fnames[index]).parent_path();
+        if (!out_dir.empty())
+        {
+            std::filesystem::create_directories(out_dir);
+        }
+    }
+
+    // The peak memory of every job is estimated from the image headers before the image is loaded.
+    // The payloads are shared by all jobs and are counted once.
+    uint64_t memory_budget = options.memory_budget;
+    if (memory_budget == 0)
+    {
+        uint64_t physical_memory = MemoryBudget::physical_memory();
+        memory_budget = physical_memory != 0 ? physical_memory / 2 : (uint64_t)4 << 30;
+    }
+
+    MemoryBudget budget(memory_budget);
+    std::vector<uint64_t> estimates(jobs.size());
+
+    // Images that are large enough bypass the page cache, so streaming them does not evict the files other programs work with
+    std::vector<bool> direct(jobs.size());
+    std::vector<uint64_t> file_sizes(jobs.size());
+
+    // The output of every job is printed in the order of the jobs after all have finished
+    std::vector<std::string> messages(jobs.size());
+    std::atomic<int> failed{ 0 };
+
+    // Images that hold no text are recognized from their first row and are neither loaded nor checksummed
+    std::vector<bool> skipped(jobs.size(), false);
+
+    // A job that fails is reported and skips its remaining stages, the other jobs go on. Its entry is only touched
+    // by the stage that holds the job, so it needs no lock (and is no vector<bool>, which packs entries into shared words).
+    std::vector<char> job_failed(jobs.size(), 0);
+
+    auto fail_job = [&](size_t index, const std::string& reason) {
+        job_failed[index] = 1;
+        messages[index] = jobs[index].first + ": FAILED (" + reason + ")";
+        failed++;
+    };
+
+    // Runs a step of a job on a stage thread. Errors throw there, since ending the process would take the jobs of
+    // all other threads with it. The step is no std::function, which would allocate for every step.
+    auto run_job = [&](size_t index, const auto& step) {
+        if (job_failed[index])
+        {
+            return;
+        }
+
+        throw_on_error = true;
+
+        try
+        {
+            step();
+        }
+        catch (const std::exception& e)
+        {
+            fail_job(index, e.what());
+        }
+    };
+
+    for (const auto& payload_data : payloads)
+    {
+        budget.reserve(payload_data.second.size());
+    }
+
+    for (size_t index = 0; index < jobs.size(); index++)
+    {
+        uint64_t text_size = 0;
+        EmbedHeader header;
+        uint64_t capacity;
+
+        if (options.command == "encrypt")
+        {
+            text_size = payloads.at(jobs[index].second).size();
+        }
+        else if ((options.command == "decrypt" || options.command == "verify") && !BMP::probe(jobs[index].first, header, capacity))
+        {
+            // Like a failed job, the image is reported and the other images are still decrypted
+            messages[index] = jobs[index].first + (options.command == "decrypt" ? ": FAILED (holds no encrypted text)" : ": FAILED");
+            failed++;
+            skipped[index] = true;
+            continue;
+        }
+        else if (options.command == "decrypt")
+        {
+            text_size = header.text_size;
+        }
+
+        estimates[index] = BMP::estimate_memory(jobs[index].first, text_size);
+
+        std::error_code ec;
+        uint64_t file_size = std::filesystem::file_size(jobs[index].first, ec);
+        file_sizes[index] = ec ? 0 : file_size;
+        direct[index] = !ec && file_size >= options.direct_io_min;
+    }
+
+    // The largest jobs are started first. Otherwise a large image that comes last keeps one
+    // thread busy while all others are already idle.
+    std::vector<size_t> order;
+    for (size_t index = 0; index < jobs.size(); index++)
+    {
+        if (!skipped[index])
+        {
+            order.push_back(index);
+        }
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return estimates[a] > estimates[b]; });
+
+    std::vector<std::unique_ptr<BMP>> images(jobs.size());
+
+    std::vector<std::string> job_names(jobs.size());
+    for (size_t index = 0; index < jobs.size(); index++)
+    {
+        job_names[index] = jobs[index].first;
+    }
+
+    // Without --numa one set of workers runs on all processors
+    std::vector<NumaNode> numa = options.use_numa ? numa_nodes() : std::vector<NumaNode>(1);
+    std::vector<std::unique_ptr<NodeWorkers>> nodes;
+
+    for (const NumaNode& numa_node : numa)
+    {
+        nodes.push_back(std::make_unique<NodeWorkers>());
+        NodeWorkers& workers = *nodes.back();
+        workers.node = options.use_numa ? &numa_node : nullptr;
+
+        // The pool splits large images into row ranges. The jobs themselves run in the pipeline.
+        workers.thread_pool = std::make_unique<ThreadPool>(options.thread_count, workers.node);
+
+        // Finished images and their buffers are reused for the next jobs, so after the first images no job allocates
+        // its image or its buffers. The kept buffers are limited to a quarter of the budget and charged to it.
+        workers.buffer_pool = std::make_unique<BufferPool>(memory_budget / 4 / numa.size(), &budget);
+
+        workers.pipeline = std::make_unique<Pipeline>(job_names, options.queue_depth, workers.node);
+        Pipeline& pipeline = *workers.pipeline;
+
+        if (!options.trace_fname.empty())
+        {
+            pipeline.enable_trace();
+        }
+
+        // The compute stages share the processors of the pool instead of each having as many threads as there are
+        // processors. Their threads only hand the row ranges of large images to the pool and sleep while it works.
+        unsigned compute_stages = options.command == "verify" ? 1 : 3;
+        unsigned cpu_threads = std::max(1u, workers.thread_pool->size() / compute_stages);
+
+        // The read and write stages take all waiting images at once and hand them to the kernel in one batch
+        pipeline.add_batch_stage("read", options.io_threads, options.queue_depth, [&](const std::vector<size_t>& batch) {
+            // Every thread has its own ring and its own requests, which are reused for every batch
+            thread_local FileIO file_io(options.use_io_uring);
+            thread_local std::vector<FileRequest> requests;
+            thread_local std::vector<FileRequest*> request_pointers;
+
+            requests.resize(batch.size());
+            request_pointers.clear();
+
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                requests[i].fname = jobs[batch[i]].first.c_str();
+                requests[i].direct = direct[batch[i]];
+                requests[i].error = 0;
+
+                // Room for a direct read, which reads whole blocks
+                requests[i].data = workers.buffer_pool->take(file_sizes[batch[i]] + IO_BLOCK_SIZE);
+                request_pointers.push_back(&requests[i]);
+            }
+
+            file_io.read_files(request_pointers);
+
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                size_t index = batch[i];
+                if (requests[i].error != 0)
+                {
+                    fail_job(index, std::string("unable to read the file: ") + strerror(requests[i].error));
+                    workers.buffer_pool->give(std::move(requests[i].data));
+                    continue;
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(workers.idle_mutex);
+                    if (!workers.idle_images.empty())
+                    {
+                        images[index] = std::move(workers.idle_images.back());
+                        workers.idle_images.pop_back();
+                    }
+                }
+
+                if (!images[index])
+                {
+                    images[index] = std::make_unique<BMP>();
+                    images[index]->set_keystore(&keys.keystore);
+                    images[index]->set_password_key(keys.password_key.get());
+                    images[index]->set_envelope(&keys.envelope);
+                    images[index]->set_thread_pool(workers.thread_pool.get());
+                    images[index]->set_buffer_pool(workers.buffer_pool.get());
+                }
+
+                run_job(index, [&] { images[index]->load(std::move(requests[i].data)); });
+
+                // A file that is no valid image leaves its buffer in the request
+                workers.buffer_pool->give(std::move(requests[i].data));
+            }
+        });
+
+        if (options.command == "encrypt")
+        {
+            pipeline.add_stage("crypt", cpu_threads, [&](size_t index) {
+                run_job(index, [&] {
+                    images[index]->set_text(payloads.at(jobs[index].second));
+                    images[index]->apply_encryption(options.encryption_type);
+                });
+            });
+            pipeline.add_stage("embed", cpu_threads, [&](size_t index) {
+                run_job(index, [&] { images[index]->embed_text(); });
+            });
+            pipeline.add_stage("checksum", cpu_threads, [&](size_t index) {
+                run_job(index, [&] { images[index]->write_checksum(); });
+            });
+        }
+        else if (options.command == "decrypt")
+        {
+            pipeline.add_stage("checksum", cpu_threads, [&](size_t index) {
+                run_job(index, [&] {
+                    if (!images[index]->verify())
+                    {
+                        error("the data is corrupted or was manipulated");
+                    }
+                });
+            });
+            pipeline.add_stage("extract", cpu_threads, [&](size_t index) {
+                run_job(index, [&] { images[index]->extract_text(); });
+            });
+            pipeline.add_stage("crypt", cpu_threads, [&](size_t index) {
+                run_job(index, [&] { images[index]->apply_decryption(options.encryption_type); });
+            });
+        }
+        else if (options.command == "verify")
+        {
+            pipeline.add_stage("checksum", cpu_threads, [&](size_t index) {
+                run_job(index, [&] {
+                    bool ok = images[index]->verify();
+                    failed += ok ? 0 : 1;
+
+                    if (!options.quiet || !ok)
+                    {
+                        messages[index] = jobs[index].first + ": " + (ok ? "ok" : "FAILED");
+                    }
+                });
+            });
+        }
+
+        // The last stage writes the results, frees the images and returns their memory to the budget. Failed jobs
+        // pass it as well, so their memory is returned, but nothing is written for them.
+        pipeline.add_batch_stage("write", options.io_threads, options.queue_depth, [&](const std::vector<size_t>& batch) {
+            thread_local FileIO file_io(options.use_io_uring);
+            thread_local std::vector<FileRequest> requests;
+            thread_local std::vector<FileRequest*> request_pointers;
+
+            requests.resize(batch.size());
+            request_pointers.clear();
+
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                size_t index = batch[i];
+                requests[i].direct = false;
+                requests[i].error = 0;
+
+                if ((options.command == "encrypt" || options.command == "decrypt") && !job_failed[index])
+                {
+                    run_job(index, [&] {
+                        requests[i].fname = out_fnames[index].c_str();
+                        if (options.command == "encrypt")
+                        {
+                            // The encrypted image is about as large as the carrier
+                            requests[i].direct = direct[index];
+                            images[index]->release_file_data(requests[i].data);
+                        }
+                        else
+                        {
+                            const std::vector<uint8_t>& text = images[index]->get_text();
+                            requests[i].data = workers.buffer_pool->take(text.size() + IO_BLOCK_SIZE);
+                            requests[i].data.assign(text.begin(), text.end());
+                        }
+
+                        request_pointers.push_back(&requests[i]);
+                    });
+                }
+
+                if (images[index])
+                {
+                    images[index]->reset();
+                    std::lock_guard<std::mutex> lock(workers.idle_mutex);
+                    workers.idle_images.push_back(std::move(images[index]));
+                }
+            }
+
+            file_io.write_files(request_pointers);
+
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                if (requests[i].error != 0)
+                {
+                    fail_job(batch[i], "unable to write " + out_fnames[batch[i]] + ": " + strerror(requests[i].error));
+                }
+
+                workers.buffer_pool->give(std::move(requests[i].data));
+                budget.release(estimates[batch[i]]);
+                workers.pending -= estimates[batch[i]];
+                workers.image_count++;
+                workers.byte_count += file_sizes[batch[i]];
+            }
+        });
+
+        pipeline.start();
+    }
+
+    // A job that only fits without the kept buffers frees them, starting with the pools of the first nodes
+    budget.set_reclaim([&](uint64_t size) {
+        uint64_t freed = 0;
+        for (const auto& workers : nodes)
+        {
+            if (freed < size)
+            {
+                freed += workers->buffer_pool->trim(size - freed);
+            }
+        }
+
+        return freed;
+    });
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Jobs enter the pipeline as soon as their memory fits into the budget
+    std::vector<size_t> waiting = order;
+    std::vector<uint64_t> waiting_estimates(waiting.size());
+    for (size_t i = 0; i < waiting.size(); i++)
+    {
+        waiting_estimates[i] = estimates[waiting[i]];
+    }
+
+    while (!waiting.empty())
+    {
+        size_t position = budget.admit(waiting_estimates);
+        size_t index = waiting[position];
+        waiting.erase(waiting.begin() + position);
+        waiting_estimates.erase(waiting_estimates.begin() + position);
+
+        // The job goes to the node with the least memory of unfinished jobs
+        NodeWorkers* target = nodes[0].get();
+        for (const auto& workers : nodes)
+        {
+            if (workers->pending < target->pending)
+            {
+                target = workers.get();
+            }
+        }
+
+        target->pending += estimates[index];
+        target->pipeline->push(index);
+    }
+
+    for (const auto& workers : nodes)
+    {
+        workers->pipeline->close();
+    }
+
+    for (const auto& workers : nodes)
+    {
+        workers->pipeline->wait();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    if (!options.trace_fname.empty())
+    {
+        // With several nodes every node writes its own trace, e.g. trace.node1.json
+        for (const auto& workers : nodes)
+        {
+            std::string fname = options.trace_fname;
+            if (nodes.size() > 1)
+            {
+                std::filesystem::path path(options.trace_fname);
+                fname = (path.parent_path() / (path.stem().string() + ".node" + std::to_string(workers->node->id) + path.extension().string())).string();
+            }
+
+            workers->pipeline->write_trace(fname);
+        }
+    }
+
+    // The lines of the written files are only built here, so the stages do not allocate them
+    for (size_t index = 0; index < jobs.size(); index++)
+    {
+        if (!messages[index].empty())
+        {
+            std::cout << messages[index] << "\n";
+        }
+        else if (!options.quiet && !job_failed[index] && !options.carrier_inputs.empty())
+        {
+            std::cout << jobs[index].second << " -> " << jobs[index].first << " -> " << out_fnames[index] << "\n";
+        }
+        else if (!options.quiet && !job_failed[index] && (options.command == "encrypt" || options.command == "decrypt"))
+        {
+            std::cout << jobs[index].first << " -> " << out_fnames[index] << "\n";
+        }
+    }
+
+    if (options.use_numa && !options.quiet)
+    {
+        for (const auto& workers : nodes)
+        {
+            const NumaNode& node = *workers->node;
+            double mib = workers->byte_count / 1048576.0;
+
+            printf("node %d (%zu cpus, %u threads): %llu images, %.1f MiB, %.1f MiB/s\n", node.id, node.cpus.size(), workers->thread_pool->size(),
+                (unsigned long long)workers->image_count.load(), mib, seconds > 0 ? mib / seconds : 0.0);
+        }
+    }
+
+    return failed == 0 ? 0 : 1;
+}
+
+/// <summary>
+/// Runs the command line mode
+/// </summary>
+/// <returns>The exit code of the program</returns>
+int run_cli(int argc, char* argv[])
+{
+    wait_on_error = false;
+
+    std::string command = argv[1];
+    if (command == "-h" || command == "--help" || command == "help")
+    {
+        print_usage();
+        return 0;
+    }
+
+    if (command == "bench")
+    {
+        return run_bench(argc, argv);
+    }
+
+    if (command == "keygen")
+    {
+        if (argc < 3)
+        {
+            print_usage();
+            return 2;
+        }
+
+        Envelope::generate_key_pair(argv[2]);
+        return 0;
+    }
+
+    if (command != "encrypt" && command != "decrypt" && command != "verify" && command != "capacity" && command != "daemon" && command != "scan"
+        && command != "archive" && command != "extract")
+    {
+        std::cerr << "error: unknown command " << command << "\n";
+        print_usage();
+        return 2;
+    }
+
+    CliOptions options;
+    options.command = command;
+    if (!parse_options(argc, argv, options))
+    {
+        return 2;
+    }
+
+    if (command == "daemon")
+    {
+        return run_daemon(options);
+    }
+
+    if (command == "scan")
+    {
+        return run_scan(options);
+    }
+
+    if (command == "archive")
+    {
+        return run_archive(options);
+    }
+
+    // Every job is an image with the payload that goes into it
+    std::vector<std::pair<std::string, std::string>> jobs;
+    collect_jobs(options, jobs);
+
+    if (jobs.empty())
+    {
+        std::cerr << "error: no images given" << "\n";
+        return 2;
+    }
+
+    if (command == "capacity")
+    {
+        return run_capacity(jobs);
+    }
+
+    if (command == "extract")
+    {
+        return run_extract(options, jobs);
+    }
+
+    return run_batch(options, jobs);
+}
@@ -0,0 +1,146 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Lazy OpenSSL initialization. libcrypto is initialized the first time
+* a cipher, digest or KDF is needed, so the XOR and none paths never
+* touch it. Initialization skips the configuration file (and with it
+* any engines), loads only the default provider and fetches all used
+* algorithms once. Every later call reuses the fetched algorithms
+* instead of the implicit fetch inside EVP_*Init_ex.
+*
+**********************************************************************/
+
+static CryptoAlgorithms crypto_algorithms;
+static std::once_flag crypto_once;
+static std::atomic<bool> crypto_initialized{ false };
+
+/// <summary>
+/// Initializes OpenSSL and fetches the algorithms
+/// </summary>
+static void crypto_init()
+{
+    uint64_t options = OPENSSL_INIT_NO_LOAD_CONFIG | OPENSSL_INIT_NO_ADD_ALL_CIPHERS | OPENSSL_INIT_NO_ADD_ALL_DIGESTS | OPENSSL_INIT_NO_LOAD_CRYPTO_STRINGS;
+    if (OPENSSL_init_crypto(options, NULL) != 1)
+    {
+        error("Error initializing OpenSSL.");
+    }
+
+    // Only the default provider is loaded, the legacy provider is never needed
+    if (!OSSL_PROVIDER_load(NULL, "default"))
+    {
+        error("Error loading the OpenSSL default provider.");
+    }
+
+    crypto_algorithms.aes_256_ecb = EVP_CIPHER_fetch(NULL, "AES-256-ECB", NULL);
+    crypto_algorithms.aes_256_ctr = EVP_CIPHER_fetch(NULL, "AES-256-CTR", NULL);
+    crypto_algorithms.aes_256_wrap = EVP_CIPHER_fetch(NULL, "AES-256-WRAP", NULL);
+    crypto_algorithms.sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+    crypto_algorithms.hkdf = EVP_KDF_fetch(NULL, OSSL_KDF_NAME_HKDF, NULL);
+    crypto_algorithms.scrypt = EVP_KDF_fetch(NULL, OSSL_KDF_NAME_SCRYPT, NULL);
+
+    if (!crypto_algorithms.aes_256_ecb || !crypto_algorithms.aes_256_ctr || !crypto_algorithms.aes_256_wrap || !crypto_algorithms.sha256
+        || !crypto_algorithms.hkdf || !crypto_algorithms.scrypt)
+    {
+        error("Error fetching the algorithms from the OpenSSL default provider.");
+    }
+
+    crypto_initialized = true;
+}
+
+/// <summary>
+/// Returns the fetched OpenSSL algorithms. OpenSSL is initialized by the first call.
+/// </summary>
+const CryptoAlgorithms& crypto()
+{
+    std::call_once(crypto_once, crypto_init);
+    return crypto_algorithms;
+}
+
+/// <summary>
+/// Returns whether OpenSSL was initialized by this process
+/// </summary>
+bool crypto_is_initialized()
+{
+    return crypto_initialized;
+}
+
+/// <summary>
+/// Returns the cipher context of the calling thread. It is created by the first call of the thread and only reset
+/// by later calls, so threads that encrypt many texts (the daemon) do not allocate a context for every text.
+/// </summary>
+EVP_CIPHER_CTX* cipher_context()
+{
+    struct Context
+    {
+        EVP_CIPHER_CTX* ctx{ nullptr };
+        ~Context() { EVP_CIPHER_CTX_free(ctx); }
+    };
+    static thread_local Context context;
+
+    if (context.ctx)
+    {
+        EVP_CIPHER_CTX_reset(context.ctx);
+        return context.ctx;
+    }
+
+    context.ctx = EVP_CIPHER_CTX_new();
+    if (!context.ctx)
+    {
+        error("Error creating EVP cipher context.");
+    }
+
+    return context.ctx;
+}
+
+/// <summary>
+/// Fills out with random bytes from the operating system, without using OpenSSL
+/// </summary>
+/// <param name="out">: The buffer to fill</param>
+/// <param name="size">: The number of bytes to write</param>
+void os_random_bytes(uint8_t* out, size_t size)
+{
+#ifdef _WIN32
+    if (BCryptGenRandom(NULL, out, (ULONG)size, BCRYPT_USE_SYSTEM_PREFERRED_RNG) != 0)
+    {
+        error("Failed to get random bytes from the operating system");
+    }
+#else
+    while (size > 0)
+    {
+        ssize_t count = getrandom(out, size, 0);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            error("Failed to get random bytes from the operating system");
+        }
+
+        out += count;
+        size -= count;
+    }
+#endif
+}
+
+/// <summary>
+/// Overwrites secret data with zeroes. The volatile pointer keeps the compiler from removing the writes.
+/// </summary>
+/// <param name="data">: The data to overwrite</param>
+/// <param name="size">: The number of bytes in data</param>
+void secure_zero(void* data, size_t size)
+{
+    volatile uint8_t* bytes = (volatile uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        bytes[i] = 0;
+    }
+}
@@ -0,0 +1,739 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Resident daemon. It loads the keystore, initializes OpenSSL and
+* derives the password master key once at startup and then answers
+* encrypt, decrypt, verify and capacity requests from a Unix domain
+* socket. Every connection has its own thread and can send any number
+* of requests one after another. A request is a DaemonRequest header
+* followed by the BMP file and the payload, a response a DaemonResponse
+* header followed by its data. A request that fails is answered with
+* the error message, the daemon keeps running. SIGINT and SIGTERM stop
+* it. Only one daemon can run in a process.
+*
+* The keys are only served to the user the daemon runs as: the socket
+* is created with mode 0600, and on Linux connections of other users
+* (SO_PEERCRED) are closed right away. A socket path that is in use by
+* a running daemon, or that is no socket, is never replaced.
+*
+* Clients on the same host can pass the BMP file as a memfd with the
+* request header instead of sending its bytes (DAEMON_FLAG_SHARED). The
+* daemon maps it and embeds into the shared pages, so a large carrier
+* is not copied through the socket in either direction. The memfd has
+* to be sealed against shrinking, so the mapping can not lose pages
+* while the daemon works on it.
+*
+**********************************************************************/
+
+// Largest BMP file or payload of a request
+#define DAEMON_MAX_SIZE ((uint64_t)1 << 32)
+
+static std::atomic<bool> daemon_stopped{ false };
+static std::atomic<int> daemon_listen_fd{ -1 };
+
+// Mapping of the memfd of a request, unmapped when the request is done
+struct SharedMapping
+{
+    uint8_t* address{ nullptr };
+    size_t size{ 0 };
+
+    ~SharedMapping()
+    {
+#ifndef _WIN32
+        if (address)
+        {
+            munmap(address, size);
+        }
+#endif
+    }
+};
+
+#ifndef _WIN32
+
+/// <summary>
+/// Receives exactly size bytes from a socket
+/// </summary>
+/// <returns>False if the connection was closed or failed</returns>
+static bool read_exact(int fd, void* data, size_t size)
+{
+    uint8_t* bytes = (uint8_t*)data;
+    while (size > 0)
+    {
+        ssize_t count = recv(fd, bytes, size, 0);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (count <= 0)
+        {
+            return false;
+        }
+
+        bytes += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Receives exactly size bytes from a socket like read_exact and takes a file descriptor sent with them
+/// </summary>
+/// <param name="received_fd">: Receives the file descriptor, -1 if none was sent. Further descriptors are closed.</param>
+/// <returns>False if the connection was closed or failed</returns>
+static bool read_exact_with_fd(int fd, void* data, size_t size, int& received_fd)
+{
+    received_fd = -1;
+
+    uint8_t* bytes = (uint8_t*)data;
+    while (size > 0)
+    {
+        iovec vector = { bytes, size };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)];
+
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); count > 0 && header; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+
+            size_t fd_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < fd_count; i++)
+            {
+                int passed;
+                memcpy(&passed, CMSG_DATA(header) + sizeof(int) * i, sizeof(int));
+                if (received_fd < 0)
+                {
+                    received_fd = passed;
+                }
+                else
+                {
+                    close(passed);
+                }
+            }
+        }
+
+        if (count <= 0)
+        {
+            if (received_fd >= 0)
+            {
+                close(received_fd);
+                received_fd = -1;
+            }
+            return false;
+        }
+
+        bytes += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Sends exactly size bytes to a socket. A closed connection does not raise SIGPIPE.
+/// </summary>
+/// <returns>False if the connection was closed or failed</returns>
+static bool write_exact(int fd, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (size > 0)
+    {
+        ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (count <= 0)
+        {
+            return false;
+        }
+
+        bytes += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Fills in the address of a Unix domain socket
+/// </summary>
+static void socket_address(std::string socket_path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        error("The socket path is too long.");
+    }
+
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+}
+
+static void on_stop_signal(int)
+{
+    Daemon::stop();
+}
+
+/// <summary>
+/// Removes the socket file of a daemon that was killed. Anything else at the path is left alone.
+/// </summary>
+/// <param name="socket_path">: The path of the socket</param>
+/// <param name="address">: The address of the socket</param>
+static void remove_stale_socket(const std::string& socket_path, const sockaddr_un& address)
+{
+    struct stat status;
+    if (lstat(socket_path.c_str(), &status) != 0)
+    {
+        return;
+    }
+
+    if (!S_ISSOCK(status.st_mode))
+    {
+        error(socket_path + " exists and is not a socket.");
+    }
+
+    // Only a socket that nobody listens on anymore refuses the connection
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool stale = probe >= 0 && connect(probe, (const sockaddr*)&address, sizeof(address)) != 0 && errno == ECONNREFUSED;
+
+    if (probe >= 0)
+    {
+        close(probe);
+    }
+
+    if (!stale)
+    {
+        error("Another daemon is running on " + socket_path + ".");
+    }
+
+    unlink(socket_path.c_str());
+}
+
+/// <summary>
+/// Returns whether the other end of a connection runs as the same user as the daemon (or as root)
+/// </summary>
+/// <param name="client">: The socket of the connection</param>
+static bool is_own_user(int client)
+{
+#ifdef __linux__
+    ucred credentials;
+    socklen_t size = sizeof(credentials);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0)
+    {
+        return false;
+    }
+
+    return credentials.uid == geteuid() || credentials.uid == 0;
+#else
+    // Elsewhere the mode of the socket file keeps other users out
+    (void)client;
+    return true;
+#endif
+}
+
+#endif
+
+/// <summary>
+/// Creates the daemon. It does not listen before run is called.
+/// </summary>
+/// <param name="socket_path">: The path of the Unix domain socket</param>
+/// <param name="keystore">: The keystore for new keys and the keys of decrypted images</param>
+/// <param name="password_key">: The password for encryption type 4, nullptr if the daemon has no password</param>
+/// <param name="envelope">: The recipients and the own private key for encryption type 5</param>
+Daemon::Daemon(std::string socket_path, Keystore* keystore, PasswordKey* password_key, Envelope* envelope)
+    : socket_path(socket_path), keystore(keystore), password_key(password_key), envelope(envelope)
+{
+}
+
+/// <summary>
+/// Makes run return. It only sets a flag and shuts the listening socket down, so it can be called from a signal handler.
+/// </summary>
+void Daemon::stop()
+{
+    daemon_stopped = true;
+
+#ifndef _WIN32
+    int fd = daemon_listen_fd;
+    if (fd >= 0)
+    {
+        shutdown(fd, SHUT_RDWR);
+    }
+#endif
+}
+
+/// <summary>
+/// Listens on the socket and serves every connection on its own thread until the daemon is stopped. Open connections
+/// are closed after their current request.
+/// </summary>
+/// <param name="on_listening">: Called once the socket accepts connections, nullptr for none</param>
+/// <returns>The exit code of the program</returns>
+int Daemon::run(std::function<void()> on_listening)
+{
+#ifdef _WIN32
+    error("The daemon needs Unix domain sockets and is not available on Windows.");
+    return 1;
+#else
+    // Everything a request needs is loaded before the first request, so no request pays for it
+    crypto();
+    if (password_key)
+    {
+        PasswordHeader header;
+        std::vector<uint8_t> key;
+        password_key->new_file_key(header, key);
+        secure_zero(key.data(), key.size());
+    }
+
+    sockaddr_un address;
+    socket_address(socket_path, address);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        error("Unable to create the socket.");
+    }
+
+    // A socket file left behind by a daemon that was killed is replaced
+    remove_stale_socket(socket_path, address);
+
+    // The socket is created with mode 0600, so other users can not connect before it could be changed
+    mode_t mask = umask(0177);
+    bool bound = bind(listen_fd, (sockaddr*)&address, sizeof(address)) == 0;
+    umask(mask);
+
+    if (!bound || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        error("Unable to listen on " + socket_path + ": " + strerror(errno));
+    }
+
+    daemon_stopped = false;
+    daemon_listen_fd = listen_fd;
+
+    // Clients that connect from now on wait in the backlog instead of being refused
+    if (on_listening)
+    {
+        on_listening();
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!daemon_stopped)
+    {
+        int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            // Out of file descriptors or memory: the waiting connections are accepted when some are closed again
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            continue;
+        }
+
+        if (!is_own_user(client))
+        {
+            close(client);
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.push_back(client);
+        }
+
+        std::thread(&Daemon::serve, this, client).detach();
+    }
+
+    daemon_listen_fd = -1;
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    // The connection threads use this object, so they have to end first
+    std::unique_lock<std::mutex> lock(mutex);
+    for (int client : clients)
+    {
+        shutdown(client, SHUT_RDWR);
+    }
+    closed.wait(lock, [this] { return clients.empty(); });
+
+    return 0;
+#endif
+}
+
+/// <summary>
+/// Answers the requests of one connection until the client closes it
+/// </summary>
+/// <param name="client">: The socket of the connection</param>
+void Daemon::serve(int client)
+{
+#ifndef _WIN32
+    // A request that fails is answered with the error message instead of ending the daemon
+    throw_on_error = true;
+
+    DaemonRequest request;
+    int image_fd;
+    while (read_exact_with_fd(client, &request, sizeof(request), image_fd))
+    {
+        // A memfd that came with a request without the flag is not used
+        bool shared = (request.flags & DAEMON_FLAG_SHARED) != 0;
+        if (image_fd >= 0 && !shared)
+        {
+            close(image_fd);
+            image_fd = -1;
+        }
+
+        // The following requests can not be found after a broken header, so the connection is closed
+        if (request.magic != DAEMON_REQUEST_MAGIC || request.image_size > DAEMON_MAX_SIZE || request.payload_size > DAEMON_MAX_SIZE)
+        {
+            break;
+        }
+
+        AlignedBuffer image;
+        std::vector<uint8_t> payload;
+        try
+        {
+            image.resize(shared ? 0 : request.image_size);
+            payload.resize(request.payload_size);
+        }
+        catch (const std::bad_alloc&)
+        {
+            break;
+        }
+
+        if (!read_exact(client, image.data(), image.size()) || !read_exact(client, payload.data(), payload.size()))
+        {
+            break;
+        }
+
+        DaemonResponse response;
+        AlignedBuffer data;
+        process(request, image_fd, image, payload, response, data);
+        response.size = data.size();
+
+        if (image_fd >= 0)
+        {
+            close(image_fd);
+            image_fd = -1;
+        }
+
+        if (!write_exact(client, &response, sizeof(response)) || !write_exact(client, data.data(), data.size()))
+        {
+            break;
+        }
+    }
+
+    if (image_fd >= 0)
+    {
+        close(image_fd);
+    }
+
+    close(client);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    clients.erase(std::find(clients.begin(), clients.end(), client));
+    closed.notify_all();
+#endif
+}
+
+/// <summary>
+/// Processes one request
+/// </summary>
+/// <param name="request">: The request header</param>
+/// <param name="image_fd">: The memfd with the BMP file for DAEMON_FLAG_SHARED, otherwise -1</param>
+/// <param name="image">: The BMP file of the request. The image takes it over.</param>
+/// <param name="payload">: The payload to encrypt</param>
+/// <param name="response">: Receives the status</param>
+/// <param name="data">: Receives the data of the response</param>
+void Daemon::process(const DaemonRequest& request, int image_fd, AlignedBuffer& image, std::vector<uint8_t>& payload, DaemonResponse& response, AlignedBuffer& data)
+{
+    try
+    {
+        SharedMapping mapping;
+        std::unique_ptr<BMP> image_bmp;
+
+        if (request.flags & DAEMON_FLAG_SHARED)
+        {
+#ifdef __linux__
+            struct stat status;
+            if (image_fd < 0 || fstat(image_fd, &status) != 0 || (uint64_t)status.st_size < request.image_size || request.image_size == 0)
+            {
+                error("The request has no memfd with the image.");
+            }
+
+            // Pages a client cuts off while they are mapped would end the daemon with SIGBUS
+            int seals = fcntl(image_fd, F_GET_SEALS);
+            if (seals < 0 || !(seals & F_SEAL_SHRINK))
+            {
+                error("The memfd of the image has to be sealed with F_SEAL_SHRINK.");
+            }
+
+            // Only encrypt writes, so the other commands also accept a memfd that is sealed against writing
+            int protection = request.command == DAEMON_ENCRYPT ? PROT_READ | PROT_WRITE : PROT_READ;
+            void* address = mmap(NULL, request.image_size, protection, MAP_SHARED, image_fd, 0);
+            if (address == MAP_FAILED)
+            {
+                error(std::string("Unable to map the memfd of the image: ") + strerror(errno));
+            }
+            mapping.address = (uint8_t*)address;
+            mapping.size = request.image_size;
+
+            image_bmp = std::make_unique<BMP>(ByteSpan{ mapping.address, mapping.size });
+#else
+            error("Shared images need memfd and are only available on Linux.");
+#endif
+        }
+        else
+        {
+            image_bmp = std::make_unique<BMP>(std::move(image));
+        }
+
+        BMP& bmp = *image_bmp;
+        bmp.set_keystore(keystore);
+        bmp.set_password_key(password_key);
+        bmp.set_envelope(envelope);
+
+        switch (request.command)
+        {
+        case DAEMON_ENCRYPT:
+            bmp.set_text(payload);
+            bmp.apply_encryption(request.encryption_type);
+            bmp.embed_text();
+            bmp.write_checksum();
+
+            // The result goes back the way the image came
+            if (mapping.address)
+            {
+                bmp.save(ByteSpan{ mapping.address, mapping.size });
+            }
+            else
+            {
+                bmp.release_file_data(data);
+            }
+            break;
+        case DAEMON_DECRYPT:
+            if (!bmp.verify())
+            {
+                response.status = DAEMON_CHECKSUM_FAILED;
+                break;
+            }
+
+            bmp.extract_text();
+            bmp.apply_decryption(request.encryption_type);
+            data.assign(bmp.get_text().begin(), bmp.get_text().end());
+            break;
+        case DAEMON_VERIFY:
+            response.status = bmp.verify() ? DAEMON_OK : DAEMON_CHECKSUM_FAILED;
+            break;
+        case DAEMON_CAPACITY:
+        {
+            uint64_t capacity = bmp.capacity();
+            data.assign((const uint8_t*)&capacity, (const uint8_t*)&capacity + sizeof(capacity));
+            break;
+        }
+        default:
+            error("Unknown request.");
+        }
+    }
+    catch (const std::exception& e)
+    {
+        response.status = DAEMON_ERROR;
+        data.assign(e.what(), e.what() + strlen(e.what()));
+    }
+}
+
+/// <summary>
+/// Connects to a daemon
+/// </summary>
+/// <param name="socket_path">: The path of the Unix domain socket of the daemon</param>
+DaemonClient::DaemonClient(std::string socket_path)
+{
+#ifdef _WIN32
+    error("The daemon needs Unix domain sockets and is not available on Windows.");
+#else
+    sockaddr_un address;
+    socket_address(socket_path, address);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        error("Unable to connect to the daemon at " + socket_path + ": " + strerror(errno));
+    }
+#endif
+}
+
+DaemonClient::~DaemonClient()
+{
+#ifndef _WIN32
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+}
+
+/// <summary>
+/// Sends a request and waits for the response
+/// </summary>
+/// <param name="command">: DAEMON_ENCRYPT, DAEMON_DECRYPT, DAEMON_VERIFY or DAEMON_CAPACITY</param>
+/// <param name="encryption_type">: The encryption type for encrypt and decrypt</param>
+/// <param name="image">: The BMP file</param>
+/// <param name="image_size">: The size of the BMP file</param>
+/// <param name="payload">: The payload to encrypt, nullptr for the other commands</param>
+/// <param name="payload_size">: The size of the payload</param>
+/// <param name="data">: Receives the data of the response</param>
+/// <returns>The status of the response</returns>
+uint32_t DaemonClient::call(uint8_t command, uint8_t encryption_type, const uint8_t* image, size_t image_size, const uint8_t* payload, size_t payload_size, std::vector<uint8_t>& data)
+{
+    DaemonRequest request;
+    request.command = command;
+    request.encryption_type = encryption_type;
+    request.image_size = image_size;
+    request.payload_size = payload_size;
+
+    return send_request(request, -1, image, payload, data);
+}
+
+/// <summary>
+/// Sends a request with the BMP file in a memfd and waits for the response. Encrypt writes the encrypted image
+/// into the memfd and returns no data.
+/// </summary>
+/// <param name="command">: DAEMON_ENCRYPT, DAEMON_DECRYPT, DAEMON_VERIFY or DAEMON_CAPACITY</param>
+/// <param name="encryption_type">: The encryption type for encrypt and decrypt</param>
+/// <param name="image_fd">: The memfd with the BMP file, sealed against shrinking (see create_shared_image)</param>
+/// <param name="image_size">: The size of the BMP file</param>
+/// <param name="payload">: The payload to encrypt, nullptr for the other commands</param>
+/// <param name="payload_size">: The size of the payload</param>
+/// <param name="data">: Receives the data of the response</param>
+/// <returns>The status of the response</returns>
+uint32_t DaemonClient::call_shared(uint8_t command, uint8_t encryption_type, int image_fd, size_t image_size, const uint8_t* payload, size_t payload_size, std::vector<uint8_t>& data)
+{
+    DaemonRequest request;
+    request.command = command;
+    request.encryption_type = encryption_type;
+    request.flags = DAEMON_FLAG_SHARED;
+    request.image_size = image_size;
+    request.payload_size = payload_size;
+
+    return send_request(request, image_fd, nullptr, payload, data);
+}
+
+/// <summary>
+/// Creates a memfd for a BMP file that can be passed to call_shared. It is sealed against shrinking and growing,
+/// but stays writable, so the same memfd can be filled and sent again for every image.
+/// </summary>
+/// <param name="size">: The size of the BMP file</param>
+/// <param name="mapping">: Receives a shared mapping of the memfd, unmapped with munmap(mapping, size)</param>
+/// <returns>The file descriptor of the memfd</returns>
+int DaemonClient::create_shared_image(size_t size, uint8_t*& mapping)
+{
+#ifdef __linux__
+    int image_fd = memfd_create("image-encrypt", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (image_fd < 0 || ftruncate(image_fd, size) != 0 || fcntl(image_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0)
+    {
+        error(std::string("Unable to create the memfd for the image: ") + strerror(errno));
+    }
+
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+    if (address == MAP_FAILED)
+    {
+        error(std::string("Unable to map the memfd for the image: ") + strerror(errno));
+    }
+
+    mapping = (uint8_t*)address;
+    return image_fd;
+#else
+    error("Shared images need memfd and are only available on Linux.");
+    return -1;
+#endif
+}
+
+/// <summary>
+/// Sends the header with the memfd (if there is one), the BMP file (if there is no memfd) and the payload and
+/// receives the response
+/// </summary>
+/// <returns>The status of the response</returns>
+uint32_t DaemonClient::send_request(const DaemonRequest& request, int image_fd, const uint8_t* image, const uint8_t* payload, std::vector<uint8_t>& data)
+{
+#ifdef _WIN32
+    return DAEMON_ERROR;
+#else
+    bool sent = false;
+    if (image_fd >= 0)
+    {
+        // The descriptor travels with the first byte of the header
+        iovec vector = { (void*)&request, sizeof(request) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &image_fd, sizeof(int));
+
+        ssize_t count;
+        do
+        {
+            count = sendmsg(fd, &message, MSG_NOSIGNAL);
+        } while (count < 0 && errno == EINTR);
+
+        sent = count > 0 && write_exact(fd, (const uint8_t*)&request + count, sizeof(request) - count);
+    }
+    else
+    {
+        sent = write_exact(fd, &request, sizeof(request)) && write_exact(fd, image, request.image_size);
+    }
+
+    DaemonResponse response;
+    if (!sent || !write_exact(fd, payload, request.payload_size)
+        || !read_exact(fd, &response, sizeof(response)) || response.magic != DAEMON_RESPONSE_MAGIC)
+    {
+        error("The daemon closed the connection.");
+    }
+
+    data.resize(response.size);
+    if (!read_exact(fd, data.data(), data.size()))
+    {
+        error("The daemon closed the connection.");
+    }
+
+    return response.status;
+#endif
+}
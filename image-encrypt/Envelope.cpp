@@ -0,0 +1,415 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Envelope encryption for several recipients. The text is encrypted
+* once with a random AES data key. For every recipient the data key is
+* wrapped (AES key wrap, RFC 3394) with a key agreed by X25519 between
+* one ephemeral key pair and the public key of the recipient. The
+* recipient table is stored in front of the ciphertext.
+*
+**********************************************************************/
+
+/// <summary>
+/// Computes the 8-byte fingerprint of a public key, which identifies the recipient in the recipient table
+/// </summary>
+/// <param name="public_key">: The 32-byte X25519 public key</param>
+/// <param name="fingerprint">: Receives the first 8 bytes of the SHA-256 hash of the public key</param>
+static void key_fingerprint(const uint8_t* public_key, uint8_t* fingerprint)
+{
+    uint8_t hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_size;
+    if (EVP_Digest(public_key, X25519_KEY_SIZE, hash, &hash_size, crypto().sha256, NULL) != 1)
+    {
+        error("Error hashing the public key.");
+    }
+
+    memcpy(fingerprint, hash, 8);
+}
+
+/// <summary>
+/// Derives the key encryption key of a recipient with X25519 and HKDF-SHA256
+/// </summary>
+/// <param name="private_key">: The own 32-byte private key (ephemeral when wrapping, the one of the recipient when unwrapping)</param>
+/// <param name="peer_key">: The 32-byte public key of the other side</param>
+/// <param name="ephemeral_public">: The ephemeral public key of the envelope</param>
+/// <param name="recipient_public">: The public key of the recipient</param>
+/// <param name="kek">: Receives the 32-byte key encryption key</param>
+static void derive_kek(const uint8_t* private_key, const uint8_t* peer_key, const uint8_t* ephemeral_public, const uint8_t* recipient_public, uint8_t* kek)
+{
+    crypto();
+
+    EVP_PKEY* own = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, private_key, X25519_KEY_SIZE);
+    EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_key, X25519_KEY_SIZE);
+    EVP_PKEY_CTX* ctx = own ? EVP_PKEY_CTX_new(own, NULL) : NULL;
+
+    uint8_t shared[X25519_KEY_SIZE];
+    size_t shared_size = sizeof(shared);
+    bool ok = ctx && peer
+        && EVP_PKEY_derive_init(ctx) == 1
+        && EVP_PKEY_derive_set_peer(ctx, peer) == 1
+        && EVP_PKEY_derive(ctx, shared, &shared_size) == 1;
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    EVP_PKEY_free(own);
+
+    if (!ok)
+    {
+        error("Error agreeing on a key with X25519.");
+    }
+
+    // Both public keys go into the salt, so a wrapped key is bound to this envelope and this recipient
+    uint8_t salt[X25519_KEY_SIZE * 2];
+    memcpy(salt, ephemeral_public, X25519_KEY_SIZE);
+    memcpy(salt + X25519_KEY_SIZE, recipient_public, X25519_KEY_SIZE);
+
+    hkdf_sha256(shared, shared_size, salt, sizeof(salt), "image-encrypt key wrap", kek, AES_KEY_SIZE);
+    secure_zero(shared, sizeof(shared));
+}
+
+/// <summary>
+/// Wraps or unwraps a key with AES-256 key wrap (RFC 3394)
+/// </summary>
+/// <param name="kek">: The 32-byte key encryption key</param>
+/// <param name="in">: The key to wrap or the wrapped key</param>
+/// <param name="in_size">: The number of bytes in in</param>
+/// <param name="out">: Receives the result, 8 bytes more than in when wrapping and 8 bytes less when unwrapping</param>
+/// <param name="wrap">: True to wrap, false to unwrap</param>
+/// <returns>False if unwrapping failed, because the key was not wrapped with this key encryption key</returns>
+static bool aes_key_wrap(const uint8_t* kek, const uint8_t* in, size_t in_size, uint8_t* out, bool wrap)
+{
+    const EVP_CIPHER* cipher = crypto().aes_256_wrap;
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+    {
+        error("Error creating EVP cipher context.");
+    }
+
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+    int len = 0;
+    int final_len = 0;
+    bool ok = EVP_CipherInit_ex(ctx, cipher, NULL, kek, NULL, wrap ? 1 : 0) == 1
+        && EVP_CipherUpdate(ctx, out, &len, in, (int)in_size) == 1
+        && EVP_CipherFinal_ex(ctx, out + len, &final_len) == 1;
+
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+/// <summary>
+/// Reads a 32-byte X25519 key from a file
+/// </summary>
+/// <param name="fname">: The name of the key file</param>
+/// <param name="key">: Receives the key</param>
+static void read_x25519_key(std::string fname, uint8_t* key)
+{
+    std::ifstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the key file " + fname + ".");
+    }
+
+    file.read((char*)key, X25519_KEY_SIZE);
+    if (file.gcount() != X25519_KEY_SIZE)
+    {
+        error("The key file " + fname + " does not contain a 32-byte X25519 key.");
+    }
+}
+
+Envelope::~Envelope()
+{
+    secure_zero(identity, sizeof(identity));
+}
+
+/// <summary>
+/// Adds a recipient for whom the data key is wrapped
+/// </summary>
+/// <param name="public_key_fname">: The name of the file with the public key of the recipient</param>
+void Envelope::add_recipient(std::string public_key_fname)
+{
+    std::array<uint8_t, X25519_KEY_SIZE> public_key;
+    read_x25519_key(public_key_fname, public_key.data());
+    recipients.push_back(public_key);
+}
+
+/// <summary>
+/// Adds a recipient for whom the data key is wrapped
+/// </summary>
+/// <param name="public_key">: The 32-byte X25519 public key of the recipient</param>
+void Envelope::add_recipient(const uint8_t* public_key)
+{
+    std::array<uint8_t, X25519_KEY_SIZE> key;
+    memcpy(key.data(), public_key, X25519_KEY_SIZE);
+    recipients.push_back(key);
+}
+
+/// <summary>
+/// Sets the private key with which the data key is unwrapped
+/// </summary>
+/// <param name="private_key_fname">: The name of the file with the own private key</param>
+void Envelope::set_identity(std::string private_key_fname)
+{
+    read_x25519_key(private_key_fname, identity);
+    has_identity = true;
+}
+
+/// <summary>
+/// Sets the private key with which the data key is unwrapped
+/// </summary>
+/// <param name="private_key">: The own 32-byte X25519 private key</param>
+void Envelope::set_identity(const uint8_t* private_key)
+{
+    memcpy(identity, private_key, X25519_KEY_SIZE);
+    has_identity = true;
+}
+
+/// <summary>
+/// Wraps the data key for all recipients and builds the recipient table
+/// </summary>
+/// <param name="data_key">: The 32-byte AES data key</param>
+/// <param name="table">: Receives the envelope header followed by one entry for each recipient</param>
+void Envelope::wrap(const std::vector<uint8_t>& data_key, std::vector<uint8_t>& table)
+{
+    if (recipients.empty() || recipients.size() > 0xFFFF)
+    {
+        error("The envelope needs between 1 and 65535 recipients.");
+    }
+
+    // One ephemeral key pair for all recipients. Every recipient still gets its own key encryption key.
+    crypto();
+    EVP_PKEY* ephemeral = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+    uint8_t ephemeral_private[X25519_KEY_SIZE];
+    size_t private_size = sizeof(ephemeral_private);
+
+    EnvelopeHeader header;
+    header.recipient_count = (uint16_t)recipients.size();
+    size_t public_size = sizeof(header.ephemeral_public);
+
+    bool ok = ephemeral
+        && EVP_PKEY_get_raw_private_key(ephemeral, ephemeral_private, &private_size) == 1
+        && EVP_PKEY_get_raw_public_key(ephemeral, header.ephemeral_public, &public_size) == 1;
+    EVP_PKEY_free(ephemeral);
+
+    if (!ok)
+    {
+        error("Error generating the ephemeral X25519 key.");
+    }
+
+    table.resize(sizeof(header) + recipients.size() * sizeof(EnvelopeRecipient));
+    memcpy(table.data(), &header, sizeof(header));
+
+    for (size_t i = 0; i < recipients.size(); i++)
+    {
+        EnvelopeRecipient entry;
+        key_fingerprint(recipients[i].data(), entry.fingerprint);
+
+        uint8_t kek[AES_KEY_SIZE];
+        derive_kek(ephemeral_private, recipients[i].data(), header.ephemeral_public, recipients[i].data(), kek);
+
+        ok = aes_key_wrap(kek, data_key.data(), data_key.size(), entry.wrapped_key, true);
+        secure_zero(kek, sizeof(kek));
+
+        if (!ok)
+        {
+            error("Error wrapping the data key.");
+        }
+
+        memcpy(table.data() + sizeof(header) + i * sizeof(entry), &entry, sizeof(entry));
+    }
+
+    secure_zero(ephemeral_private, sizeof(ephemeral_private));
+}
+
+/// <summary>
+/// Finds the own entry in the recipient table and unwraps the data key
+/// </summary>
+/// <param name="data">: The text of the image, starting with the recipient table</param>
+/// <param name="size">: The number of bytes in data</param>
+/// <param name="data_key">: Receives the 32-byte AES data key</param>
+/// <returns>The size of the recipient table, which is followed by the ciphertext</returns>
+size_t Envelope::unwrap(const uint8_t* data, size_t size, std::vector<uint8_t>& data_key)
+{
+    if (!has_identity)
+    {
+        error("No private key was given.");
+    }
+
+    EnvelopeHeader header;
+    if (size < sizeof(header))
+    {
+        error("The image does not contain a recipient table.");
+    }
+
+    memcpy(&header, data, sizeof(header));
+    size_t table_size = sizeof(header) + header.recipient_count * sizeof(EnvelopeRecipient);
+
+    if (header.version != 1 || size < table_size)
+    {
+        error("The image does not contain a valid recipient table.");
+    }
+
+    // The own public key is derived from the private key
+    crypto();
+    uint8_t own_public[X25519_KEY_SIZE];
+    size_t public_size = sizeof(own_public);
+    EVP_PKEY* own = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, identity, X25519_KEY_SIZE);
+    bool ok = own && EVP_PKEY_get_raw_public_key(own, own_public, &public_size) == 1;
+    EVP_PKEY_free(own);
+
+    if (!ok)
+    {
+        error("The private key is not a valid X25519 key.");
+    }
+
+    uint8_t fingerprint[8];
+    key_fingerprint(own_public, fingerprint);
+
+    data_key.resize(AES_KEY_SIZE);
+
+    for (uint16_t i = 0; i < header.recipient_count; i++)
+    {
+        EnvelopeRecipient entry;
+        memcpy(&entry, data + sizeof(header) + i * sizeof(entry), sizeof(entry));
+
+        if (memcmp(entry.fingerprint, fingerprint, sizeof(fingerprint)) != 0)
+        {
+            continue;
+        }
+
+        uint8_t kek[AES_KEY_SIZE];
+        derive_kek(identity, header.ephemeral_public, header.ephemeral_public, own_public, kek);
+
+        // The key wrap has an integrity check, so a fingerprint collision just fails here and the search goes on
+        ok = aes_key_wrap(kek, entry.wrapped_key, sizeof(entry.wrapped_key), data_key.data(), false);
+        secure_zero(kek, sizeof(kek));
+
+        if (ok)
+        {
+            return table_size;
+        }
+    }
+
+    error("The image was not encrypted for this private key.");
+    return 0;
+}
+
+/// <summary>
+/// Creates the file of a private key, which only the owner may read. An existing file is never replaced, so a key
+/// that images were encrypted for cannot be lost by generating another one.
+/// </summary>
+/// <param name="fname">: The name of the key file</param>
+/// <param name="key">: The private key</param>
+/// <param name="size">: The size of the key in bytes</param>
+/// <param name="exists">: Set if the file already exists</param>
+/// <returns>False if the file could not be written</returns>
+static bool write_private_key(const std::string& fname, const uint8_t* key, size_t size, bool& exists)
+{
+    exists = false;
+
+#ifdef _WIN32
+    // Protected DACL that grants the owner full access and nobody else anything
+    SECURITY_ATTRIBUTES attributes = { sizeof(attributes), NULL, FALSE };
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA("D:P(A;;FA;;;OW)", SDDL_REVISION_1, &attributes.lpSecurityDescriptor, NULL))
+    {
+        return false;
+    }
+
+    HANDLE handle = CreateFileA(fname.c_str(), GENERIC_WRITE, 0, &attributes, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    LocalFree(attributes.lpSecurityDescriptor);
+
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        exists = GetLastError() == ERROR_FILE_EXISTS;
+        return false;
+    }
+
+    DWORD written = 0;
+    bool ok = WriteFile(handle, key, (DWORD)size, &written, NULL) && written == size;
+    CloseHandle(handle);
+#else
+    int fd = open(fname.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        exists = errno == EEXIST;
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t done = 0; ok && done < size;)
+    {
+        ssize_t count = ::write(fd, key + done, size - done);
+        if (count > 0)
+        {
+            done += (size_t)count;
+        }
+        else if (count < 0 && errno != EINTR)
+        {
+            ok = false;
+        }
+    }
+
+    ok = close(fd) == 0 && ok;
+#endif
+
+    // A partly written key is useless and would block the next attempt
+    if (!ok)
+    {
+        std::error_code ec;
+        std::filesystem::remove(fname, ec);
+    }
+
+    return ok;
+}
+
+/// <summary>
+/// Generates a X25519 key pair for a recipient and writes it to the files name.key (private) and name.pub (public)
+/// </summary>
+/// <param name="name">: The name of the key files without extension</param>
+void Envelope::generate_key_pair(std::string name)
+{
+    crypto();
+    EVP_PKEY* pkey = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+    uint8_t private_key[X25519_KEY_SIZE];
+    uint8_t public_key[X25519_KEY_SIZE];
+    size_t private_size = sizeof(private_key);
+    size_t public_size = sizeof(public_key);
+
+    bool ok = pkey
+        && EVP_PKEY_get_raw_private_key(pkey, private_key, &private_size) == 1
+        && EVP_PKEY_get_raw_public_key(pkey, public_key, &public_size) == 1;
+    EVP_PKEY_free(pkey);
+
+    if (!ok)
+    {
+        error("Error generating the X25519 key pair.");
+    }
+
+    bool exists = false;
+    bool written = write_private_key(name + ".key", private_key, sizeof(private_key), exists);
+    secure_zero(private_key, sizeof(private_key));
+
+    if (exists)
+    {
+        error("The key file " + name + ".key already exists.");
+    }
+
+    if (!written)
+    {
+        error("Unable to write the private key file " + name + ".key.");
+    }
+
+    std::ofstream public_file(name + ".pub", std::ios_base::binary);
+    public_file.write((const char*)public_key, sizeof(public_key));
+    if (!public_file)
+    {
+        error("Unable to write the public key file " + name + ".pub.");
+    }
+}
@@ -0,0 +1,608 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Batched whole-file I/O. On Linux a batch of files is read or written
+* through io_uring in three rounds: all files are opened (and their
+* sizes queried) together, then all contents are transferred into
+* buffers that are registered with the ring for the batch, then all
+* files are closed. Each round costs a few io_uring_enter calls for the
+* whole batch instead of several system calls per file. Without
+* io_uring (other systems, old kernels, io_uring disabled by seccomp)
+* the files are read and written one after another with streams.
+* The lists the rounds work with belong to the FileIO and keep their
+* memory, so after the first batches a batch allocates nothing.
+*
+* Requests marked direct are opened with O_DIRECT, so multi-GB images
+* are not copied through the page cache and do not evict the files
+* other processes work with. Direct transfers have to cover whole
+* blocks: a read asks for the file size rounded up to the block size
+* and the kernel stops at the end of the file, a write pads the buffer
+* to whole blocks and the file is truncated to its size afterwards. The
+* buffers are aligned to the block size by their allocator. File
+* systems without O_DIRECT (tmpfs) fall back to buffered I/O.
+*
+**********************************************************************/
+
+// Largest transfer of one read or write operation, longer files take several operations
+#define IO_MAX_TRANSFER (1u << 30)
+
+/// <summary>
+/// Rounds a size up to whole blocks for direct I/O
+/// </summary>
+static size_t round_to_blocks(size_t size)
+{
+    return (size + IO_BLOCK_SIZE - 1) / IO_BLOCK_SIZE * IO_BLOCK_SIZE;
+}
+
+/// <summary>
+/// Sets up the ring. If that is not possible, the synchronous calls are used.
+/// </summary>
+/// <param name="use_io_uring">: False to always use the synchronous calls</param>
+/// <param name="entries">: The number of operations that can be in flight at the same time</param>
+FileIO::FileIO(bool use_io_uring, unsigned entries)
+{
+#ifdef __linux__
+    if (use_io_uring && !setup(entries))
+    {
+        close_ring();
+    }
+#endif
+}
+
+FileIO::~FileIO()
+{
+#ifdef __linux__
+    close_ring();
+#endif
+}
+
+#ifdef __linux__
+
+/// <summary>
+/// Unmaps the queues and closes the ring
+/// </summary>
+void FileIO::close_ring()
+{
+    if (sqes)
+    {
+        munmap(sqes, entries * sizeof(io_uring_sqe));
+        sqes = nullptr;
+    }
+
+    if (cq_ring && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    cq_ring = nullptr;
+
+    if (sq_ring)
+    {
+        munmap(sq_ring, sq_ring_size);
+        sq_ring = nullptr;
+    }
+
+    if (ring_fd >= 0)
+    {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+#endif
+
+/// <summary>
+/// Returns whether the files are read and written with io_uring
+/// </summary>
+bool FileIO::uses_io_uring()
+{
+#ifdef __linux__
+    return ring_fd >= 0;
+#else
+    return false;
+#endif
+}
+
+/// <summary>
+/// Reads the whole content of every file. Failed files get an error code, the others their content.
+/// </summary>
+/// <param name="requests">: The files to read</param>
+void FileIO::read_files(const std::vector<FileRequest*>& requests)
+{
+#ifdef __linux__
+    if (ring_fd >= 0)
+    {
+        // Not more files than the ring has entries are open at the same time
+        for (size_t first = 0; first < requests.size(); first += entries)
+        {
+            batch.assign(requests.begin() + first, requests.begin() + std::min(requests.size(), first + entries));
+            fds.assign(batch.size(), -1);
+            stats.resize(batch.size());
+
+            // Every file is opened and its size queried at the same time
+            run(batch.size() * 2, [&](size_t i, io_uring_sqe* sqe) {
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uint64_t)batch[i / 2]->fname;
+
+                if (i % 2 == 0)
+                {
+                    sqe->opcode = IORING_OP_OPENAT;
+                    sqe->open_flags = O_RDONLY | O_CLOEXEC | (batch[i / 2]->direct ? O_DIRECT : 0);
+                }
+                else
+                {
+                    sqe->opcode = IORING_OP_STATX;
+                    sqe->len = STATX_SIZE;
+                    sqe->off = (uint64_t)&stats[i / 2];
+                }
+            }, [&](size_t i, int result) {
+                if (result == -EINTR || result == -EAGAIN)
+                {
+                    return true;
+                }
+
+                // The file system does not support direct I/O
+                if (result == -EINVAL && i % 2 == 0 && batch[i / 2]->direct)
+                {
+                    batch[i / 2]->direct = false;
+                    return true;
+                }
+
+                if (result < 0)
+                {
+                    batch[i / 2]->error = -result;
+                }
+                else if (i % 2 == 0)
+                {
+                    fds[i / 2] = result;
+                }
+
+                return false;
+            });
+
+            sizes.assign(batch.size(), 0);
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                batch[i]->data.clear();
+                if (fds[i] >= 0 && batch[i]->error == 0)
+                {
+                    sizes[i] = stats[i].stx_size;
+                    batch[i]->data.resize(batch[i]->direct ? round_to_blocks(sizes[i]) : sizes[i]);
+                }
+            }
+
+            transfer(batch, fds, sizes, false);
+            close_files(fds);
+
+            // Direct reads were rounded up to whole blocks
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                batch[i]->data.resize(std::min(batch[i]->data.size(), sizes[i]));
+            }
+        }
+
+        return;
+    }
+#endif
+
+    read_files_sync(requests);
+}
+
+/// <summary>
+/// Writes every file with its content, replacing existing files. Failed files get an error code.
+/// </summary>
+/// <param name="requests">: The files to write</param>
+void FileIO::write_files(const std::vector<FileRequest*>& requests)
+{
+#ifdef __linux__
+    if (ring_fd >= 0)
+    {
+        for (size_t first = 0; first < requests.size(); first += entries)
+        {
+            batch.assign(requests.begin() + first, requests.begin() + std::min(requests.size(), first + entries));
+            fds.assign(batch.size(), -1);
+
+            run(batch.size(), [&](size_t i, io_uring_sqe* sqe) {
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uint64_t)batch[i]->fname;
+                sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (batch[i]->direct ? O_DIRECT : 0);
+                sqe->len = 0666;
+            }, [&](size_t i, int result) {
+                if (result == -EINTR || result == -EAGAIN)
+                {
+                    return true;
+                }
+
+                if (result == -EINVAL && batch[i]->direct)
+                {
+                    batch[i]->direct = false;
+                    return true;
+                }
+
+                if (result < 0)
+                {
+                    batch[i]->error = -result;
+                }
+                else
+                {
+                    fds[i] = result;
+                }
+
+                return false;
+            });
+
+            // Direct writes are padded to whole blocks and the files truncated to their size afterwards
+            sizes.resize(batch.size());
+            transfer_sizes.resize(batch.size());
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                sizes[i] = batch[i]->data.size();
+                if (batch[i]->direct && fds[i] >= 0)
+                {
+                    batch[i]->data.resize(round_to_blocks(sizes[i]), 0);
+                }
+                transfer_sizes[i] = batch[i]->data.size();
+            }
+
+            transfer(batch, fds, transfer_sizes, true);
+
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                if (batch[i]->data.size() != sizes[i])
+                {
+                    if (batch[i]->error == 0 && ftruncate(fds[i], sizes[i]) != 0)
+                    {
+                        batch[i]->error = errno;
+                    }
+
+                    batch[i]->data.resize(sizes[i]);
+                }
+            }
+
+            close_files(fds);
+        }
+
+        return;
+    }
+#endif
+
+    write_files_sync(requests);
+}
+
+/// <summary>
+/// Reads the files one after another with streams
+/// </summary>
+void FileIO::read_files_sync(const std::vector<FileRequest*>& requests)
+{
+    for (FileRequest* request : requests)
+    {
+        std::ifstream file(request->fname, std::ios_base::binary);
+        if (!file)
+        {
+            request->error = errno != 0 ? errno : ENOENT;
+            continue;
+        }
+
+        file.seekg(0, file.end);
+        request->data.resize((size_t)file.tellg());
+        file.seekg(0, file.beg);
+
+        if (!file.read((char*)request->data.data(), request->data.size()))
+        {
+            request->error = EIO;
+        }
+    }
+}
+
+/// <summary>
+/// Writes the files one after another with streams
+/// </summary>
+void FileIO::write_files_sync(const std::vector<FileRequest*>& requests)
+{
+    for (FileRequest* request : requests)
+    {
+        std::ofstream file(request->fname, std::ios_base::binary);
+        if (!file || !file.write((const char*)request->data.data(), request->data.size()))
+        {
+            request->error = errno != 0 ? errno : EIO;
+        }
+    }
+}
+
+#ifdef __linux__
+
+/// <summary>
+/// Creates the ring, maps the submission and completion queues and checks that the kernel supports all needed operations
+/// </summary>
+/// <param name="entries">: The size of the submission queue</param>
+/// <returns>False if io_uring can not be used</returns>
+bool FileIO::setup(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+    {
+        return false;
+    }
+
+    this->entries = params.sq_entries;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // Newer kernels map both rings with one mapping
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+    {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        sq_ring = nullptr;
+        return false;
+    }
+
+    cq_ring = single_mmap ? sq_ring : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+    {
+        cq_ring = nullptr;
+        return false;
+    }
+
+    void* sqes_mapping = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    sqes = (io_uring_sqe*)sqes_mapping;
+
+    sq_head = (unsigned*)((uint8_t*)sq_ring + params.sq_off.head);
+    sq_tail = (unsigned*)((uint8_t*)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned*)((uint8_t*)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned*)((uint8_t*)sq_ring + params.sq_off.array);
+    cq_head = (unsigned*)((uint8_t*)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned*)((uint8_t*)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned*)((uint8_t*)cq_ring + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)((uint8_t*)cq_ring + params.cq_off.cqes);
+
+    // The kernel tells which operations it supports
+    std::vector<uint8_t> probe_buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = (io_uring_probe*)probe_buffer.data();
+
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+        return false;
+    }
+
+    auto supported = [probe](int op) {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+
+    if (!supported(IORING_OP_OPENAT) || !supported(IORING_OP_STATX) || !supported(IORING_OP_READ)
+        || !supported(IORING_OP_WRITE) || !supported(IORING_OP_CLOSE))
+    {
+        return false;
+    }
+
+    fixed_buffers = supported(IORING_OP_READ_FIXED) && supported(IORING_OP_WRITE_FIXED);
+    return true;
+}
+
+/// <summary>
+/// Runs a number of operations on the ring and waits until all of them have completed.
+/// As many operations as fit into the submission queue are submitted with one system call.
+/// </summary>
+/// <param name="count">: The number of operations</param>
+/// <param name="prepare">: Fills in the submission queue entry of an operation. It is called again when the operation is repeated.</param>
+/// <param name="complete">: Receives the result of an operation and returns true if the operation has to be repeated</param>
+template <typename Prepare, typename Complete>
+void FileIO::run(size_t count, const Prepare& prepare, const Complete& complete)
+{
+    // Operations wait in submission order, repeated operations are appended again
+    waiting.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        waiting.push_back(i);
+    }
+
+    size_t next = 0;
+
+    size_t in_flight = 0;
+    unsigned unsubmitted = 0;
+
+    while (next < waiting.size() || in_flight > 0)
+    {
+        // The ring is used by one thread only, so the tail can be read without synchronization
+        unsigned tail = *sq_tail;
+
+        while (next < waiting.size() && tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) < entries && in_flight < entries)
+        {
+            size_t i = waiting[next++];
+
+            unsigned index = tail & *sq_mask;
+            io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            prepare(i, sqe);
+            sqe->user_data = i;
+            sq_array[index] = index;
+
+            tail++;
+            unsubmitted++;
+            in_flight++;
+        }
+
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        long result = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                error("Error submitting file operations to io_uring.");
+            }
+        }
+        else
+        {
+            unsubmitted -= std::min<unsigned>(unsubmitted, (unsigned)result);
+        }
+
+        unsigned head = *cq_head;
+        unsigned completed = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != completed)
+        {
+            io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            size_t i = (size_t)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            in_flight--;
+
+            if (complete(i, res))
+            {
+                waiting.push_back(i);
+            }
+        }
+
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/// <summary>
+/// Reads or writes the contents of the opened files. The buffers are registered with the ring for the
+/// transfer if the kernel allows it, so it does not have to map them for every operation.
+/// </summary>
+/// <param name="requests">: The files</param>
+/// <param name="fds">: The file descriptors, -1 for files that could not be opened</param>
+/// <param name="sizes">: The number of bytes to transfer per file. A direct read asks for the whole buffer, which can
+/// be larger, and stops at the end of the file.</param>
+/// <param name="write">: True to write the buffers, false to read into them</param>
+void FileIO::transfer(const std::vector<FileRequest*>& requests, const std::vector<int>& fds, const std::vector<size_t>& sizes, bool write)
+{
+    files.clear();
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        if (fds[i] >= 0 && requests[i]->error == 0 && !requests[i]->data.empty())
+        {
+            files.push_back(i);
+        }
+    }
+
+    if (files.empty())
+    {
+        return;
+    }
+
+    bool registered = false;
+    if (fixed_buffers)
+    {
+        // Registered buffers are limited to 1 GiB each
+        buffers.clear();
+        bool fits = true;
+        for (size_t i : files)
+        {
+            buffers.push_back({ requests[i]->data.data(), requests[i]->data.size() });
+            fits = fits && requests[i]->data.size() <= IO_MAX_TRANSFER;
+        }
+
+        if (fits)
+        {
+            registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), (unsigned)buffers.size()) == 0;
+
+            // Without permission to lock the memory, the buffers are not registered for the rest of the run
+            fixed_buffers = registered;
+        }
+    }
+
+    done.assign(files.size(), 0);
+
+    run(files.size(), [&](size_t f, io_uring_sqe* sqe) {
+        FileRequest* request = requests[files[f]];
+        size_t remaining = request->data.size() - done[f];
+
+        if (registered)
+        {
+            sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = (uint16_t)f;
+        }
+        else
+        {
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+
+        sqe->fd = fds[files[f]];
+        sqe->addr = (uint64_t)(request->data.data() + done[f]);
+        sqe->len = (uint32_t)std::min<size_t>(remaining, IO_MAX_TRANSFER);
+        sqe->off = done[f];
+    }, [&](size_t f, int result) {
+        FileRequest* request = requests[files[f]];
+
+        if (result == -EINTR || result == -EAGAIN)
+        {
+            return true;
+        }
+
+        if (result < 0)
+        {
+            request->error = -result;
+            return false;
+        }
+
+        // The file became shorter since its size was queried
+        if (result == 0)
+        {
+            if (write)
+            {
+                request->error = EIO;
+            }
+            else
+            {
+                request->data.resize(done[f]);
+            }
+            return false;
+        }
+
+        done[f] += result;
+        return done[f] < sizes[files[f]];
+    });
+
+    if (registered)
+    {
+        syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    }
+}
+
+/// <summary>
+/// Closes the opened files
+/// </summary>
+/// <param name="fds">: The file descriptors, -1 for files that could not be opened</param>
+void FileIO::close_files(const std::vector<int>& fds)
+{
+    open_fds.clear();
+    for (int fd : fds)
+    {
+        if (fd >= 0)
+        {
+            open_fds.push_back(fd);
+        }
+    }
+
+    run(open_fds.size(), [&](size_t i, io_uring_sqe* sqe) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = open_fds[i];
+    }, [](size_t, int) {
+        return false;
+    });
+}
+
+#endif
@@ -0,0 +1,205 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Password based AES keys. The password is stretched with scrypt into
+* a master key once per master salt and kept in memory. The AES key of
+* every image is derived from the master key with HKDF-SHA256 and a
+* random per-file salt, which is cheap. Both salts and the scrypt
+* parameters are stored in the image in front of the ciphertext.
+* Since the parameters come from the image, only the cost the program
+* writes itself is accepted, and at most MASTER_KEY_CACHE_SIZE master
+* keys are kept.
+*
+**********************************************************************/
+
+// Number of master keys that are kept, a daemon sees the master salts of many clients
+#define MASTER_KEY_CACHE_SIZE 16
+
+/// <summary>
+/// Creates a password key with a new master salt for all images that are encrypted with it
+/// </summary>
+/// <param name="password">: The password</param>
+PasswordKey::PasswordKey(std::string password) : password(password)
+{
+    RNG::bytes(master_salt, sizeof(master_salt));
+}
+
+PasswordKey::~PasswordKey()
+{
+    secure_zero(&password[0], password.size());
+}
+
+/// <summary>
+/// Overwrites the key when the master key is dropped from the cache, or after the last thread that used it
+/// </summary>
+PasswordKey::MasterKey::~MasterKey()
+{
+    secure_zero(key.data(), key.size());
+}
+
+/// <summary>
+/// Fills a password header for a new image and derives its AES key
+/// </summary>
+/// <param name="header">: Receives the scrypt parameters, the master salt and a new file salt</param>
+/// <param name="key">: Receives the AES key of the image</param>
+void PasswordKey::new_file_key(PasswordHeader& header, std::vector<uint8_t>& key)
+{
+    header = PasswordHeader();
+    memcpy(header.master_salt, master_salt, sizeof(header.master_salt));
+    RNG::bytes(header.file_salt, sizeof(header.file_salt));
+
+    file_key(header, key);
+}
+
+/// <summary>
+/// Derives the AES key of an image from its password header
+/// </summary>
+/// <param name="header">: The password header stored in the image</param>
+/// <param name="key">: Receives the AES key of the image</param>
+void PasswordKey::file_key(const PasswordHeader& header, std::vector<uint8_t>& key)
+{
+    std::vector<uint8_t> master = master_key(header);
+    key.resize(AES_KEY_SIZE);
+
+    hkdf_sha256(master.data(), master.size(), header.file_salt, sizeof(header.file_salt), "image-encrypt file key", key.data(), key.size());
+    secure_zero(master.data(), master.size());
+}
+
+/// <summary>
+/// Returns the master key for the master salt and scrypt parameters of the header.
+/// It is derived only the first time a master salt is seen, afterwards the cached key is returned. The derivation
+/// runs without holding the lock of the cache, so keys of other master salts are not held up by it.
+/// </summary>
+/// <param name="header">: The password header stored in the image</param>
+/// <returns>The 256-bit master key</returns>
+std::vector<uint8_t> PasswordKey::master_key(const PasswordHeader& header)
+{
+    if (header.kdf != 1 || header.log2_n < 10 || header.log2_n > SCRYPT_MAX_LOG2_N || header.r == 0 || header.r > SCRYPT_MAX_R
+        || header.p == 0 || header.p > SCRYPT_MAX_P)
+    {
+        error("The image uses unsupported password key parameters.");
+    }
+
+    // The cache key is the part of the header that goes into scrypt
+    std::string id((const char*)&header, offsetof(PasswordHeader, file_salt));
+    std::shared_ptr<MasterKey> entry;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = master_keys.find(id);
+        if (it == master_keys.end())
+        {
+            if (master_keys.size() >= MASTER_KEY_CACHE_SIZE)
+            {
+                auto oldest = master_keys.begin();
+                for (auto known = master_keys.begin(); known != master_keys.end(); known++)
+                {
+                    if (known->second->last_use < oldest->second->last_use)
+                    {
+                        oldest = known;
+                    }
+                }
+
+                master_keys.erase(oldest);
+            }
+
+            it = master_keys.emplace(id, std::make_shared<MasterKey>()).first;
+        }
+
+        entry = it->second;
+        entry->last_use = ++use_count;
+    }
+
+    std::lock_guard<std::mutex> lock(entry->mutex);
+
+    // If the derivation fails, the next caller tries again
+    if (!entry->derived)
+    {
+        derive(header, entry->key);
+        entry->derived = true;
+    }
+
+    return entry->key;
+}
+
+/// <summary>
+/// Derives a master key from the password with scrypt
+/// </summary>
+/// <param name="header">: The password header with the scrypt parameters and the master salt</param>
+/// <param name="master">: Receives the 256-bit master key</param>
+void PasswordKey::derive(const PasswordHeader& header, std::vector<uint8_t>& master)
+{
+    master.resize(AES_KEY_SIZE);
+
+    EVP_KDF_CTX* ctx = EVP_KDF_CTX_new(crypto().scrypt);
+    if (!ctx)
+    {
+        error("Error creating the scrypt context.");
+    }
+
+    uint64_t n = (uint64_t)1 << header.log2_n;
+    uint32_t r = header.r;
+    uint32_t p = header.p;
+    uint64_t max_memory = 128 * r * (n + p + 2) + 1024 * 1024;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD, &password[0], password.size()),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, (void*)header.master_salt, sizeof(header.master_salt)),
+        OSSL_PARAM_construct_uint64(OSSL_KDF_PARAM_SCRYPT_N, &n),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_SCRYPT_R, &r),
+        OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_SCRYPT_P, &p),
+        OSSL_PARAM_construct_uint64(OSSL_KDF_PARAM_SCRYPT_MAXMEM, &max_memory),
+        OSSL_PARAM_construct_end()
+    };
+
+    int result = EVP_KDF_derive(ctx, master.data(), master.size(), params);
+    EVP_KDF_CTX_free(ctx);
+
+    if (result != 1)
+    {
+        error("Error deriving the master key from the password with scrypt.");
+    }
+}
+
+/// <summary>
+/// Derives a key with HKDF-SHA256 (RFC 5869)
+/// </summary>
+/// <param name="secret">: The input key material</param>
+/// <param name="secret_size">: The number of bytes in secret</param>
+/// <param name="salt">: The salt</param>
+/// <param name="salt_size">: The number of bytes in salt</param>
+/// <param name="info">: The context string that separates keys for different purposes</param>
+/// <param name="out">: Receives the derived key</param>
+/// <param name="out_size">: The number of bytes to derive</param>
+void hkdf_sha256(const uint8_t* secret, size_t secret_size, const uint8_t* salt, size_t salt_size, const char* info, uint8_t* out, size_t out_size)
+{
+    EVP_KDF_CTX* ctx = EVP_KDF_CTX_new(crypto().hkdf);
+    if (!ctx)
+    {
+        error("Error creating the HKDF context.");
+    }
+
+    char digest[] = "SHA256";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void*)secret, secret_size),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, (void*)salt, salt_size),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, (void*)info, strlen(info)),
+        OSSL_PARAM_construct_end()
+    };
+
+    int result = EVP_KDF_derive(ctx, out, out_size, params);
+    EVP_KDF_CTX_free(ctx);
+
+    if (result != 1)
+    {
+        error("Error deriving a key with HKDF.");
+    }
+}
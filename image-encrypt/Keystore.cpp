@@ -0,0 +1,331 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Keystore file holding all keys that were generated for images.
+* The file is a 16-byte header followed by fixed-size 48-byte records,
+* so it can be read in one go (or mapped) and every record is found by
+* its offset. Records are only ever appended, while the file is locked
+* against other processes, so several processes can add keys to the
+* same keystore at once. The header is written under the same lock by
+* whichever process finds the file empty, and a record that a crash cut
+* off is removed before the next one is appended, so it can not shift
+* the records behind it.
+*
+**********************************************************************/
+
+// Keystore file opened for appending and locked against other processes until it is closed
+struct KeystoreFile
+{
+    KeystoreFile(const std::string& fname);
+    ~KeystoreFile();
+    bool is_open();
+    uint64_t size();
+    bool resize(uint64_t size);
+    bool write(const void* data, size_t size, uint64_t offset);
+
+    private:
+#ifdef _WIN32
+        HANDLE handle{ INVALID_HANDLE_VALUE };
+#else
+        int fd{ -1 };
+#endif
+};
+
+/// <summary>
+/// Opens the keystore file, creates it if it does not exist and waits for the exclusive lock
+/// </summary>
+/// <param name="fname">: The name of the keystore file</param>
+KeystoreFile::KeystoreFile(const std::string& fname)
+{
+#ifdef _WIN32
+    handle = CreateFileA(fname.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    OVERLAPPED overlapped = {};
+    if (handle != INVALID_HANDLE_VALUE && !LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped))
+    {
+        CloseHandle(handle);
+        handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    // The keys are secret, so only the owner may read a new keystore
+    fd = open(fname.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    while (fd >= 0 && flock(fd, LOCK_EX) != 0)
+    {
+        if (errno != EINTR)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+#endif
+}
+
+/// <summary>
+/// Closes the file, which releases the lock
+/// </summary>
+KeystoreFile::~KeystoreFile()
+{
+#ifdef _WIN32
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(handle);
+    }
+#else
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+}
+
+/// <summary>
+/// Returns whether the file is open and locked
+/// </summary>
+bool KeystoreFile::is_open()
+{
+#ifdef _WIN32
+    return handle != INVALID_HANDLE_VALUE;
+#else
+    return fd >= 0;
+#endif
+}
+
+/// <summary>
+/// Returns the size of the file
+/// </summary>
+uint64_t KeystoreFile::size()
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    return GetFileSizeEx(handle, &size) ? (uint64_t)size.QuadPart : 0;
+#else
+    struct stat status;
+    return fstat(fd, &status) == 0 ? (uint64_t)status.st_size : 0;
+#endif
+}
+
+/// <summary>
+/// Cuts the file off at a size
+/// </summary>
+/// <param name="size">: The new size of the file</param>
+/// <returns>False if the size could not be changed</returns>
+bool KeystoreFile::resize(uint64_t size)
+{
+#ifdef _WIN32
+    LARGE_INTEGER position;
+    position.QuadPart = (LONGLONG)size;
+    return SetFilePointerEx(handle, position, NULL, FILE_BEGIN) && SetEndOfFile(handle);
+#else
+    return ftruncate(fd, (off_t)size) == 0;
+#endif
+}
+
+/// <summary>
+/// Writes data at an offset of the file
+/// </summary>
+/// <param name="data">: The data</param>
+/// <param name="size">: The number of bytes in data</param>
+/// <param name="offset">: The offset in the file</param>
+/// <returns>False if not all of the data was written</returns>
+bool KeystoreFile::write(const void* data, size_t size, uint64_t offset)
+{
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    DWORD written = 0;
+    return WriteFile(handle, data, (DWORD)size, &written, &overlapped) && written == size;
+#else
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, bytes, size, (off_t)offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+
+    return true;
+#endif
+}
+
+/// <summary>
+/// Opens the keystore and reads all records. A keystore that does not exist yet is created with the first added key.
+/// </summary>
+/// <param name="fname">: The name of the keystore file</param>
+Keystore::Keystore(std::string fname) : fname(fname)
+{
+    load();
+}
+
+/// <summary>
+/// Reads the records from the keystore file that are not known yet, for example because another process appended them
+/// </summary>
+void Keystore::load()
+{
+    std::ifstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        return;
+    }
+
+    file.seekg(0, file.end);
+    size_t length = file.tellg();
+    file.seekg(0, file.beg);
+
+    // A keystore that another process has just created, but not yet written its header to
+    if (length < sizeof(KeystoreHeader))
+    {
+        return;
+    }
+
+    KeystoreHeader header;
+    file.read((char*)&header, sizeof(header));
+
+    if (!file || memcmp(header.magic, KEYSTORE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error("The keystore file is damaged or not a keystore");
+    }
+
+    if (header.version != KEYSTORE_VERSION || header.record_size != sizeof(KeystoreRecord))
+    {
+        error("The keystore was written by an unsupported version of the program");
+    }
+
+    // A record that was cut off while it was written is ignored
+    size_t known = records.size();
+    size_t count = (length - sizeof(header)) / sizeof(KeystoreRecord);
+    if (count <= known)
+    {
+        return;
+    }
+
+    records.resize(count);
+    file.seekg(sizeof(header) + known * sizeof(KeystoreRecord), file.beg);
+    file.read((char*)(records.data() + known), (count - known) * sizeof(KeystoreRecord));
+    file.close();
+
+    index.reserve(records.size());
+    for (size_t i = known; i < records.size(); i++)
+    {
+        index[records[i].key_id] = i;
+    }
+}
+
+/// <summary>
+/// Generates a new key ID and appends the key to the keystore file
+/// </summary>
+/// <param name="type">: The encryption type the key is used for</param>
+/// <param name="key">: The key bytes</param>
+/// <param name="size">: The number of key bytes (at most 32)</param>
+/// <returns>The ID of the new key</returns>
+uint32_t Keystore::add(uint8_t type, const uint8_t* key, size_t size)
+{
+    if (size > sizeof(KeystoreRecord::key))
+    {
+        error("The key is too large for the keystore");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    KeystoreRecord record;
+    record.type = type;
+    record.length = (uint8_t)size;
+    record.created = (uint64_t)time(0);
+    memcpy(record.key, key, size);
+
+    // Other processes wait until the record is appended
+    KeystoreFile file(fname);
+    if (!file.is_open())
+    {
+        error("Unable to open the keystore file.");
+    }
+
+    // An empty file was just created (here or by another process that has not locked it yet) and gets its header
+    // first. Otherwise a record that was cut off is removed, so the new one starts at a record boundary.
+    uint64_t file_size = file.size();
+    uint64_t end = sizeof(KeystoreHeader);
+
+    if (file_size < sizeof(KeystoreHeader))
+    {
+        KeystoreHeader header;
+        if (!file.resize(0) || !file.write(&header, sizeof(header), 0))
+        {
+            error("Unable to write the keystore file.");
+        }
+    }
+    else
+    {
+        end += (file_size - sizeof(KeystoreHeader)) / sizeof(KeystoreRecord) * sizeof(KeystoreRecord);
+        if (end != file_size && !file.resize(end))
+        {
+            error("Unable to repair the keystore file.");
+        }
+    }
+
+    // Key IDs are random, so processes sharing a keystore do not need to agree on the next free ID. 0 means "no key ID".
+    load();
+    do
+    {
+        RNG::bytes((uint8_t*)&record.key_id, sizeof(record.key_id));
+    } while (record.key_id == 0 || index.count(record.key_id) != 0);
+
+    if (!file.write(&record, sizeof(record), end))
+    {
+        // A partial record would shift the records of the next keys
+        file.resize(end);
+        error("Unable to write the key to the keystore file.");
+    }
+
+    // Read the record back from the file, so the records stay in the same order as in the file
+    load();
+
+    secure_zero(record.key, sizeof(record.key));
+    return record.key_id;
+}
+
+/// <summary>
+/// Looks up a key by its ID
+/// </summary>
+/// <param name="key_id">: The ID of the key</param>
+/// <param name="record">: Receives a copy of the record of the key</param>
+/// <returns>False if the keystore has no key with this ID</returns>
+bool Keystore::find(uint32_t key_id, KeystoreRecord& record)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = index.find(key_id);
+    if (it == index.end())
+    {
+        // The key may have been added by another process after the keystore was read
+        load();
+        it = index.find(key_id);
+    }
+
+    if (it == index.end())
+    {
+        return false;
+    }
+
+    record = records[it->second];
+    return true;
+}
@@ -0,0 +1,374 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Memory budget for concurrent jobs. Before a job is submitted, its
+* peak memory is estimated from the image headers and the payload size
+* and reserved here. Jobs that do not fit wait until running jobs have
+* released enough memory, so many small images run side by side while
+* a few huge ones do not exhaust the RAM.
+*
+**********************************************************************/
+
+/// <summary>
+/// Creates a memory budget
+/// </summary>
+/// <param name="limit">: The number of bytes all admitted jobs may use together</param>
+MemoryBudget::MemoryBudget(uint64_t limit) : limit(limit)
+{
+}
+
+/// <summary>
+/// Sets the function that frees idle memory (the buffers kept by the buffer pools) when a job only fits without it
+/// </summary>
+/// <param name="reclaim">: Frees at least the given number of idle bytes if it can and returns the bytes it freed</param>
+void MemoryBudget::set_reclaim(std::function<uint64_t(uint64_t)> reclaim)
+{
+    this->reclaim = reclaim;
+}
+
+/// <summary>
+/// Waits until one of the waiting jobs fits into the budget and reserves its memory. The first job in the list
+/// that fits is taken, so the order of the list is kept as far as the memory allows. A job that is larger than the
+/// whole budget is admitted alone when nothing else is running. If a job only fits without the idle memory of the
+/// buffer pools, the pools free as much of it as the job needs.
+/// </summary>
+/// <param name="sizes">: The estimated memory of the waiting jobs</param>
+/// <returns>The position of the admitted job in sizes</returns>
+size_t MemoryBudget::admit(const std::vector<uint64_t>& sizes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true)
+    {
+        uint64_t shortfall = 0;
+
+        for (size_t i = 0; i < sizes.size(); i++)
+        {
+            if (used + sizes[i] <= limit || (running == 0 && i == 0))
+            {
+                used += sizes[i];
+                running++;
+                return i;
+            }
+
+            if (shortfall == 0 && used - idle + sizes[i] <= limit)
+            {
+                shortfall = used + sizes[i] - limit;
+            }
+        }
+
+        if (shortfall != 0 && reclaim)
+        {
+            // The pools call unhold, which takes the lock
+            lock.unlock();
+            uint64_t freed = reclaim(shortfall);
+            lock.lock();
+
+            if (freed != 0)
+            {
+                continue;
+            }
+        }
+
+        released.wait(lock);
+    }
+}
+
+/// <summary>
+/// Reserves memory without waiting, for data that is shared by all jobs and kept until the end
+/// </summary>
+/// <param name="size">: The number of bytes</param>
+void MemoryBudget::reserve(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    used += size;
+}
+
+/// <summary>
+/// Charges a buffer that a buffer pool keeps, so idle buffers count against the budget like the jobs
+/// </summary>
+/// <param name="size">: The capacity of the buffer</param>
+void MemoryBudget::hold(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    used += size;
+    idle += size;
+}
+
+/// <summary>
+/// Returns the charge of a pooled buffer that was handed to a job (whose estimate covers it) or freed
+/// </summary>
+/// <param name="size">: The capacity of the buffer</param>
+void MemoryBudget::unhold(uint64_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= std::min(used, size);
+        idle -= std::min(idle, size);
+    }
+    released.notify_all();
+}
+
+/// <summary>
+/// Releases the memory of a finished job
+/// </summary>
+/// <param name="size">: The number of bytes that were reserved for the job</param>
+void MemoryBudget::release(uint64_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= std::min(used, size);
+        running--;
+    }
+    released.notify_all();
+}
+
+/// <summary>
+/// Returns the size of the physical memory, or 0 if it is not known
+/// </summary>
+uint64_t MemoryBudget::physical_memory()
+{
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    return GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    return (pages > 0 && page_size > 0) ? (uint64_t)pages * page_size : 0;
+#endif
+}
+
+/**********************************************************************
+*
+* Buffer pool. The write stage returns the file buffers of finished
+* images and the read stage takes them for the next images, so after
+* the first images of a batch no buffers are allocated (and no pages
+* faulted in) anymore. The pool keeps at most limit bytes; buffers
+* beyond that are freed. The kept buffers are charged to the memory
+* budget, and when a waiting job needs their room they are freed, so
+* jobs and kept buffers together stay within the budget.
+*
+**********************************************************************/
+
+/// <summary>
+/// Creates an empty buffer pool
+/// </summary>
+/// <param name="limit">: The number of bytes the kept buffers may have together</param>
+/// <param name="budget">: The budget the kept buffers are charged to, nullptr if there is none</param>
+BufferPool::BufferPool(uint64_t limit, MemoryBudget* budget) : limit(limit), budget(budget)
+{
+}
+
+/// <summary>
+/// Takes the smallest kept buffer that can hold size bytes without growing. If none is large enough, the largest
+/// buffer is freed instead, so the pool follows the sizes of the images, and a new buffer is allocated.
+/// </summary>
+/// <param name="size">: The number of bytes the buffer will hold</param>
+/// <returns>An empty buffer with a capacity of at least size bytes</returns>
+AlignedBuffer BufferPool::take(size_t size)
+{
+    AlignedBuffer buffer;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t best = buffers.size();
+        size_t largest = buffers.size();
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            size_t capacity = buffers[i].capacity();
+            if (capacity >= size && (best == buffers.size() || capacity < buffers[best].capacity()))
+            {
+                best = i;
+            }
+
+            if (largest == buffers.size() || capacity > buffers[largest].capacity())
+            {
+                largest = i;
+            }
+        }
+
+        size_t taken = best != buffers.size() ? best : largest;
+        if (taken != buffers.size())
+        {
+            pooled -= buffers[taken].capacity();
+            if (budget)
+            {
+                budget->unhold(buffers[taken].capacity());
+            }
+
+            buffer = std::move(buffers[taken]);
+            std::swap(buffers[taken], buffers.back());
+            buffers.pop_back();
+        }
+    }
+
+    if (buffer.capacity() < size)
+    {
+        buffer = AlignedBuffer();
+        buffer.reserve(size);
+    }
+
+    return buffer;
+}
+
+/// <summary>
+/// Keeps a buffer for a later take, or frees it if the pool is full
+/// </summary>
+/// <param name="buffer">: The buffer, which is empty afterwards</param>
+void BufferPool::give(AlignedBuffer&& buffer)
+{
+    AlignedBuffer kept = std::move(buffer);
+    kept.clear();
+
+    if (kept.capacity() == 0)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pooled + kept.capacity() <= limit)
+        {
+            pooled += kept.capacity();
+            if (budget)
+            {
+                budget->hold(kept.capacity());
+            }
+
+            buffers.push_back(std::move(kept));
+            return;
+        }
+    }
+
+    // A buffer that does not fit is freed outside of the lock
+}
+
+/// <summary>
+/// Frees kept buffers, the largest first, until at least size bytes are freed or the pool is empty
+/// </summary>
+/// <param name="size">: The number of bytes to free</param>
+/// <returns>The number of bytes freed</returns>
+uint64_t BufferPool::trim(uint64_t size)
+{
+    std::vector<AlignedBuffer> freed;
+    uint64_t freed_size = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::sort(buffers.begin(), buffers.end(), [](const AlignedBuffer& a, const AlignedBuffer& b) {
+            return a.capacity() < b.capacity();
+        });
+
+        while (freed_size < size && !buffers.empty())
+        {
+            freed_size += buffers.back().capacity();
+            freed.push_back(std::move(buffers.back()));
+            buffers.pop_back();
+        }
+
+        pooled -= freed_size;
+        if (budget)
+        {
+            budget->unhold(freed_size);
+        }
+    }
+
+    // The buffers are freed outside of the lock
+    return freed_size;
+}
+
+/**********************************************************************
+*
+* Buffer memory. Small buffers come from the heap. Buffers for large
+* images are mapped directly and backed by 2 MiB pages: first from the
+* reserved huge pages (MAP_HUGETLB), and if there are none, as a 2 MiB
+* aligned mapping that is marked for transparent huge pages. Both are
+* freed with munmap, which is decided by the size alone, so switching
+* huge pages off later does not matter for buffers already allocated.
+*
+**********************************************************************/
+
+// Set to false by --no-huge-pages, large buffers then use 4 KiB pages
+bool use_huge_pages = true;
+
+// Set after MAP_HUGETLB failed once, because without reserved huge pages every later attempt fails as well
+static std::atomic<bool> hugetlb_unavailable{ false };
+
+/// <summary>
+/// Allocates a buffer that starts at a multiple of IO_BLOCK_SIZE
+/// </summary>
+/// <param name="size">: The size of the buffer</param>
+/// <returns>The buffer, freed with free_buffer and the same size</returns>
+void* allocate_buffer(size_t size)
+{
+#ifdef __linux__
+    if (size >= HUGE_PAGE_MIN_SIZE)
+    {
+        size_t mapped_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+        if (use_huge_pages && !hugetlb_unavailable)
+        {
+            void* pointer = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (pointer != MAP_FAILED)
+            {
+                return pointer;
+            }
+
+            hugetlb_unavailable = true;
+        }
+
+        // Transparent huge pages only back whole 2 MiB aligned ranges, so one more huge page is mapped and the
+        // parts before and after the aligned range are unmapped again
+        uint8_t* mapping = (uint8_t*)mmap(NULL, mapped_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned > mapping)
+        {
+            munmap(mapping, aligned - mapping);
+        }
+
+        size_t tail = mapping + HUGE_PAGE_SIZE - aligned;
+        if (tail > 0)
+        {
+            munmap(aligned + mapped_size, tail);
+        }
+
+        // Fails without transparent huge pages in the kernel, the buffer then simply keeps 4 KiB pages
+        madvise(aligned, mapped_size, use_huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+        return aligned;
+    }
+#endif
+
+    return ::operator new(size, std::align_val_t(IO_BLOCK_SIZE));
+}
+
+/// <summary>
+/// Frees a buffer of allocate_buffer
+/// </summary>
+/// <param name="pointer">: The buffer</param>
+/// <param name="size">: The size it was allocated with</param>
+void free_buffer(void* pointer, size_t size)
+{
+#ifdef __linux__
+    if (size >= HUGE_PAGE_MIN_SIZE)
+    {
+        munmap(pointer, (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+        return;
+    }
+#endif
+
+    ::operator delete(pointer, std::align_val_t(IO_BLOCK_SIZE));
+}
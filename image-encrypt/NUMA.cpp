@@ -0,0 +1,150 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* NUMA nodes. With --numa every node gets its own workers, which are
+* pinned to the processors of the node, and its own buffers. A pinned
+* thread also prefers the memory of its node, so the pages of a buffer
+* are placed on the node of the worker that first writes to them (the
+* read of the file) and are later reused by the same node only.
+*
+**********************************************************************/
+
+/// <summary>
+/// Parses a list of processors like "0-3,8-11"
+/// </summary>
+static std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+
+    for (size_t start = 0; start < list.size(); start = list.find(',', start) == std::string::npos ? list.size() : list.find(',', start) + 1)
+    {
+        int first, last;
+        int count = sscanf(list.c_str() + start, "%d-%d", &first, &last);
+        if (count < 1)
+        {
+            continue;
+        }
+
+        for (int cpu = first; cpu <= (count == 2 ? last : first); cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+/// <summary>
+/// Returns the NUMA nodes of the machine with their processors. Without NUMA information (or not on Linux)
+/// there is one node without processors, whose threads are not pinned.
+/// </summary>
+std::vector<NumaNode> numa_nodes()
+{
+    std::vector<NumaNode> nodes;
+
+#ifdef __linux__
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
+    {
+        // Node IDs can have gaps, so the directories are listed instead of counted
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, 4, "node") != 0 || name.size() == 4 || !isdigit((unsigned char)name[4]))
+        {
+            continue;
+        }
+
+        std::ifstream file(entry.path() / "cpulist");
+        std::string list;
+        std::getline(file, list);
+
+        NumaNode node;
+        node.id = atoi(name.c_str() + 4);
+        node.cpus = parse_cpu_list(list);
+
+        // Processors beyond CPU_SETSIZE cannot be pinned to, so they are left to the scheduler
+        node.cpus.erase(std::remove_if(node.cpus.begin(), node.cpus.end(), [](int cpu) { return cpu < 0 || cpu >= CPU_SETSIZE; }),
+            node.cpus.end());
+
+        // Nodes with memory but without processors get no workers
+        if (!node.cpus.empty() && node.id < 1024)
+        {
+            nodes.push_back(node);
+        }
+    }
+
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+#endif
+
+    if (nodes.empty())
+    {
+        nodes.push_back(NumaNode());
+    }
+
+    return nodes;
+}
+
+/// <summary>
+/// Pins the calling thread to the processors of a node and makes it prefer the memory of the node. If the system
+/// refuses, the thread runs without the binding and a warning is printed once.
+/// </summary>
+void bind_thread(const NumaNode& node)
+{
+#ifdef __linux__
+    if (node.cpus.empty())
+    {
+        return;
+    }
+
+    // A cpu_set_t has CPU_SETSIZE bits, setting one beyond them would write past it
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : node.cpus)
+    {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+
+    const char* failed = nullptr;
+    int failed_errno = 0;
+
+    if (CPU_COUNT(&cpus) == 0 || sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+    {
+        failed = "the processors";
+        failed_errno = CPU_COUNT(&cpus) == 0 ? EINVAL : errno;
+    }
+
+    // Pages are still taken from other nodes when the node runs out of memory. The kernel reads one bit less than
+    // maxnode, so it is passed one larger than the mask.
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {};
+    if (node.id < 0 || node.id >= (int)(8 * sizeof(mask)))
+    {
+        failed = failed ? failed : "the memory";
+        failed_errno = failed_errno ? failed_errno : EINVAL;
+    }
+    else
+    {
+        mask[node.id / (8 * sizeof(unsigned long))] |= 1UL << (node.id % (8 * sizeof(unsigned long)));
+        if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, mask, 8 * sizeof(mask) + 1) != 0 && !failed)
+        {
+            failed = "the memory";
+            failed_errno = errno;
+        }
+    }
+
+    static std::atomic<bool> warned{ false };
+    if (failed && !warned.exchange(true))
+    {
+        std::cerr << "warning: unable to bind threads to " << failed << " of NUMA node " << node.id << " ("
+            << strerror(failed_errno) << "), the threads are not bound to it" << "\n";
+    }
+#endif
+}
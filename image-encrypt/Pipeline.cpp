@@ -0,0 +1,502 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Staged pipeline for batch jobs. A job (an image) passes through the
+* stages in order, for example read, crypt, embed, checksum and write.
+* Every stage has its own threads and takes its jobs from a bounded
+* lock-free queue, so while one image is read from the disk others are
+* encrypted or checksummed. A full queue holds back the stage in front
+* of it. Threads that wait longer than a moment sleep until the queue
+* changes, so idle stages take no processor time. If tracing is
+* enabled, the time every job spends in every stage and the depth of
+* the queues are recorded and can be written as a Chrome trace (open
+* it in chrome://tracing or ui.perfetto.dev).
+*
+**********************************************************************/
+
+/// <summary>
+/// Creates an empty queue
+/// </summary>
+/// <param name="capacity">: The number of values the queue can hold, rounded up to a power of two</param>
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+
+    // The sequence of a cell tells which position may use it next: a producer if it equals the
+    // position, a consumer if it equals the position + 1
+    for (size_t i = 0; i < size; i++)
+    {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+/// <summary>
+/// Adds a value to the queue
+/// </summary>
+/// <returns>False if the queue is full</returns>
+template <typename T>
+bool BoundedQueue<T>::try_push(const T& value)
+{
+    size_t position = enqueue_position.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    while (true)
+    {
+        cell = &cells[position & mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0)
+        {
+            if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->value = value;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+/// <summary>
+/// Takes the oldest value from the queue
+/// </summary>
+/// <returns>False if the queue is empty</returns>
+template <typename T>
+bool BoundedQueue<T>::try_pop(T& value)
+{
+    size_t position = dequeue_position.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    while (true)
+    {
+        cell = &cells[position & mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+        if (difference == 0)
+        {
+            if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = dequeue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    value = cell->value;
+    cell->sequence.store(position + mask + 1, std::memory_order_release);
+    return true;
+}
+
+/// <summary>
+/// Returns the number of values the queue can hold
+/// </summary>
+template <typename T>
+size_t BoundedQueue<T>::capacity()
+{
+    return mask + 1;
+}
+
+/// <summary>
+/// Returns the number of values in the queue. It can be outdated as soon as it is returned.
+/// </summary>
+template <typename T>
+size_t BoundedQueue<T>::size()
+{
+    size_t dequeued = dequeue_position.load(std::memory_order_relaxed);
+    size_t enqueued = enqueue_position.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+/// <summary>
+/// Waits a little before an empty or full queue is tried again. It spins first and then yields,
+/// so a job that arrives soon is picked up right away.
+/// </summary>
+/// <param name="attempt">: The number of failed attempts so far</param>
+/// <returns>False once the wait takes longer, the thread should then sleep until the queue changes</returns>
+static bool backoff(unsigned attempt)
+{
+    if (attempt < 64)
+    {
+        return true;
+    }
+
+    if (attempt < 128)
+    {
+        std::this_thread::yield();
+        return true;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// Creates a pipeline without stages
+/// </summary>
+/// <param name="job_names">: The names of the jobs for the trace, one per job</param>
+/// <param name="queue_capacity">: The number of jobs that can wait in front of every stage</param>
+Pipeline::Pipeline(std::vector<std::string> job_names, size_t queue_capacity, const NumaNode* node)
+    : job_names(job_names), queue_capacity(queue_capacity), job_count(job_names.size()), node(node)
+{
+    epoch = std::chrono::steady_clock::now();
+    thread_names.push_back("admission");
+    trace.emplace_back();
+}
+
+/// <summary>
+/// Waits for the threads of the stages
+/// </summary>
+Pipeline::~Pipeline()
+{
+    wait();
+}
+
+/// <summary>
+/// Adds a stage after the existing stages
+/// </summary>
+/// <param name="name">: The name of the stage</param>
+/// <param name="thread_count">: The number of threads of the stage</param>
+/// <param name="process">: The function that processes a job in this stage</param>
+void Pipeline::add_stage(std::string name, unsigned thread_count, std::function<void(size_t)> process)
+{
+    add_batch_stage(name, thread_count, 1, [process](const std::vector<size_t>& jobs) {
+        process(jobs[0]);
+    });
+}
+
+/// <summary>
+/// Adds a stage that processes several jobs at once, for example to read several files with one request to the kernel.
+/// A thread of the stage takes all waiting jobs up to the batch size, but does not wait for more.
+/// </summary>
+/// <param name="name">: The name of the stage</param>
+/// <param name="thread_count">: The number of threads of the stage</param>
+/// <param name="batch_size">: The largest number of jobs processed at once</param>
+/// <param name="process">: The function that processes the jobs in this stage</param>
+void Pipeline::add_batch_stage(std::string name, unsigned thread_count, size_t batch_size, std::function<void(const std::vector<size_t>&)> process)
+{
+    auto stage = std::make_unique<Stage>();
+    stage->name = name;
+    stage->thread_count = std::max(1u, thread_count);
+    stage->batch_size = std::max<size_t>(1, batch_size);
+    stage->process = process;
+    stage->queue = std::make_unique<BoundedQueue<size_t>>(queue_capacity);
+
+    stages.push_back(std::move(stage));
+}
+
+/// <summary>
+/// Records the stage times and queue depths for write_trace. Must be called before start; without it nothing is
+/// recorded, so long batches do not collect events nobody reads.
+/// </summary>
+void Pipeline::enable_trace()
+{
+    tracing = true;
+}
+
+/// <summary>
+/// Starts the threads of all stages
+/// </summary>
+void Pipeline::start()
+{
+    // All trace lists are created before the first thread starts, so no thread resizes them later
+    for (const auto& stage : stages)
+    {
+        for (unsigned i = 0; i < stage->thread_count; i++)
+        {
+            thread_names.push_back(stage->name + " " + std::to_string(i));
+            trace.emplace_back();
+        }
+    }
+
+    int thread = 1;
+    for (size_t stage = 0; stage < stages.size(); stage++)
+    {
+        for (unsigned i = 0; i < stages[stage]->thread_count; i++)
+        {
+            threads.emplace_back(&Pipeline::stage_loop, this, stage, thread++);
+        }
+    }
+}
+
+/// <summary>
+/// Queues a job for the first stage. It blocks while the queue of the first stage is full.
+/// Every job has to be pushed exactly once.
+/// </summary>
+/// <param name="job">: The index of the job</param>
+void Pipeline::push(size_t job)
+{
+    pushed++;
+    enqueue(0, job, 0);
+}
+
+/// <summary>
+/// Tells the pipeline that no more jobs are pushed, for pipelines that get only some of the jobs. The stage
+/// threads end after the jobs pushed so far.
+/// </summary>
+void Pipeline::close()
+{
+    job_count = pushed.load();
+
+    for (const auto& stage : stages)
+    {
+        notify(stage->queued, *stage, true);
+    }
+}
+
+/// <summary>
+/// Blocks until every job has passed the last stage
+/// </summary>
+void Pipeline::wait()
+{
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    threads.clear();
+}
+
+/// <summary>
+/// Returns the time since the pipeline was created in microseconds
+/// </summary>
+int64_t Pipeline::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+/// <summary>
+/// Queues a job for a stage and records the new depth of the queue
+/// </summary>
+/// <param name="stage">: The index of the stage</param>
+/// <param name="job">: The index of the job</param>
+/// <param name="thread">: The trace thread of the caller</param>
+void Pipeline::enqueue(size_t stage, size_t job, int thread)
+{
+    Stage& next = *stages[stage];
+    BoundedQueue<size_t>& queue = *next.queue;
+
+    for (unsigned attempt = 0; !queue.try_push(job); attempt++)
+    {
+        if (!backoff(attempt))
+        {
+            std::unique_lock<std::mutex> lock(next.sleep_mutex);
+            next.dequeued.wait(lock, [&queue] { return queue.size() < queue.capacity(); });
+        }
+    }
+
+    notify(next.queued, next, false);
+
+    if (tracing)
+    {
+        trace[thread].push_back({ 'C', thread, stage, now(), 0, queue.size(), 0 });
+    }
+}
+
+/// <summary>
+/// Wakes threads that sleep on a queue. The mutex is taken first, so a thread that has just found the
+/// queue unchanged and is about to sleep does not miss the change.
+/// </summary>
+/// <param name="condition">: The condition of the stage the threads wait for</param>
+/// <param name="stage">: The stage</param>
+/// <param name="all">: True to wake all threads, false to wake one</param>
+void Pipeline::notify(std::condition_variable& condition, Stage& stage, bool all)
+{
+    {
+        std::lock_guard<std::mutex> lock(stage.sleep_mutex);
+    }
+
+    if (all)
+    {
+        condition.notify_all();
+    }
+    else
+    {
+        condition.notify_one();
+    }
+}
+
+/// <summary>
+/// Main loop of a stage thread. It takes jobs from the queue of the stage, processes them and queues
+/// them for the next stage, until the stage has taken all jobs.
+/// </summary>
+/// <param name="stage">: The index of the stage</param>
+/// <param name="thread">: The trace thread</param>
+void Pipeline::stage_loop(size_t stage, int thread)
+{
+    Stage& current = *stages[stage];
+
+    if (node)
+    {
+        bind_thread(*node);
+    }
+
+    // The jobs of a batch, kept for the next batch so taking jobs does not allocate
+    std::vector<size_t> jobs;
+    jobs.reserve(current.batch_size);
+
+    while (current.taken < job_count)
+    {
+        size_t job;
+        if (!current.queue->try_pop(job))
+        {
+            for (unsigned attempt = 0; current.taken < job_count && !current.queue->try_pop(job); attempt++)
+            {
+                if (!backoff(attempt))
+                {
+                    std::unique_lock<std::mutex> lock(current.sleep_mutex);
+                    current.queued.wait(lock, [&] { return current.queue->size() > 0 || current.taken >= job_count; });
+                }
+            }
+
+            if (current.taken >= job_count)
+            {
+                return;
+            }
+        }
+
+        jobs.assign(1, job);
+        while (jobs.size() < current.batch_size && current.queue->try_pop(job))
+        {
+            jobs.push_back(job);
+        }
+
+        notify(current.dequeued, current, true);
+
+        // The other threads of the stage end once the stage has taken all jobs
+        if ((current.taken += jobs.size()) >= job_count)
+        {
+            notify(current.queued, current, true);
+        }
+
+        if (tracing)
+        {
+            trace[thread].push_back({ 'C', thread, stage, now(), 0, current.queue->size(), 0 });
+
+            int64_t start = now();
+            current.process(jobs);
+            trace[thread].push_back({ 'X', thread, stage, start, now() - start, jobs[0], jobs.size() });
+        }
+        else
+        {
+            current.process(jobs);
+        }
+
+        if (stage + 1 < stages.size())
+        {
+            for (size_t next_job : jobs)
+            {
+                enqueue(stage + 1, next_job, thread);
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Escapes a string for JSON
+/// </summary>
+static std::string json_string(const std::string& text)
+{
+    std::string escaped = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            escaped += buffer;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+
+    return escaped + "\"";
+}
+
+/// <summary>
+/// Writes the recorded stage times and queue depths in the Chrome trace event format. Every stage
+/// thread is a row with one slice per job (or batch of jobs), every queue a counter track.
+/// </summary>
+/// <param name="fname">: The name of the trace file</param>
+void Pipeline::write_trace(std::string fname)
+{
+    std::ofstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        error("Unable to open the trace file.");
+    }
+
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+    bool first = true;
+    auto separator = [&]() -> std::ofstream& {
+        file << (first ? "" : ",\n");
+        first = false;
+        return file;
+    };
+
+    for (size_t thread = 0; thread < thread_names.size(); thread++)
+    {
+        separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+            << ",\"args\":{\"name\":" << json_string(thread_names[thread]) << "}}";
+    }
+
+    for (const auto& events : trace)
+    {
+        for (const auto& event : events)
+        {
+            if (event.phase == 'X')
+            {
+                separator() << "{\"name\":" << json_string(stages[event.stage]->name) << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+                    << ",\"ts\":" << event.start << ",\"dur\":" << event.duration
+                    << ",\"args\":{\"job\":" << json_string(job_names[event.value]) << ",\"jobs\":" << event.count << "}}";
+            }
+            else
+            {
+                separator() << "{\"name\":" << json_string("queue " + stages[event.stage]->name) << ",\"ph\":\"C\",\"pid\":1"
+                    << ",\"ts\":" << event.start << ",\"args\":{\"depth\":" << event.value << "}}";
+            }
+        }
+    }
+
+    file << "\n]}\n";
+}
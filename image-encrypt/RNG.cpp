@@ -0,0 +1,166 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Buffered random number generator for fill bits, keys and nonces.
+* Every thread expands a 256-bit seed from the operating system with
+* the ChaCha20 block function into its own buffer. After every refill
+* the first 32 bytes of the new keystream replace the ChaCha20 key, so
+* already served bytes can not be reconstructed from the state. The
+* generator does not use OpenSSL, so it does not initialize libcrypto.
+*
+**********************************************************************/
+
+// Size of the per-thread buffer (64 ChaCha20 blocks)
+#define RNG_BUFFER_SIZE 4096
+
+// The seed is replaced with fresh bytes from the operating system after this many generated bytes
+#define RNG_RESEED_INTERVAL (16 * 1024 * 1024)
+
+struct RNGState
+{
+    uint32_t key[8];
+    uint8_t buffer[RNG_BUFFER_SIZE];
+    size_t position{ RNG_BUFFER_SIZE };
+    size_t generated{ 0 };
+    bool seeded{ false };
+};
+
+static thread_local RNGState rng_state;
+
+static inline uint32_t rotl32(uint32_t value, int count)
+{
+    return (value << count) | (value >> (32 - count));
+}
+
+#define CHACHA_QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = rotl32(d, 16);   \
+    c += d; b ^= c; b = rotl32(b, 12);   \
+    a += b; d ^= a; d = rotl32(d, 8);    \
+    c += d; b ^= c; b = rotl32(b, 7);
+
+/// <summary>
+/// Computes one 64-byte ChaCha20 block (RFC 8439) with a zero nonce
+/// </summary>
+/// <param name="key">: The 256-bit key as eight little endian words</param>
+/// <param name="counter">: The block counter</param>
+/// <param name="out">: The 64 bytes of keystream</param>
+static void chacha20_block(const uint32_t key[8], uint32_t counter, uint8_t out[64])
+{
+    uint32_t input[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+        counter, 0, 0, 0
+    };
+
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        CHACHA_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        uint32_t word = x[i] + input[i];
+        out[i * 4 + 0] = word & 0xFF;
+        out[i * 4 + 1] = (word >> 8) & 0xFF;
+        out[i * 4 + 2] = (word >> 16) & 0xFF;
+        out[i * 4 + 3] = (word >> 24) & 0xFF;
+    }
+}
+
+/// <summary>
+/// Replaces the ChaCha20 key of the calling thread with 32 bytes from the operating system
+/// </summary>
+static void rng_seed(RNGState& state)
+{
+    uint8_t seed[32];
+    os_random_bytes(seed, sizeof(seed));
+
+    for (int i = 0; i < 8; i++)
+    {
+        state.key[i] = seed[i * 4] | (seed[i * 4 + 1] << 8) | (seed[i * 4 + 2] << 16) | ((uint32_t)seed[i * 4 + 3] << 24);
+    }
+
+    secure_zero(seed, sizeof(seed));
+    state.generated = 0;
+    state.seeded = true;
+}
+
+/// <summary>
+/// Fills the buffer of the calling thread with new keystream and rekeys the generator with its first 32 bytes
+/// </summary>
+static void rng_refill(RNGState& state)
+{
+    if (!state.seeded || state.generated >= RNG_RESEED_INTERVAL)
+    {
+        rng_seed(state);
+    }
+
+    for (uint32_t block = 0; block < RNG_BUFFER_SIZE / 64; block++)
+    {
+        chacha20_block(state.key, block, state.buffer + block * 64);
+    }
+
+    memcpy(state.key, state.buffer, sizeof(state.key));
+    secure_zero(state.buffer, sizeof(state.key));
+
+    state.position = sizeof(state.key);
+    state.generated += RNG_BUFFER_SIZE;
+}
+
+/// <summary>
+/// Fills out with random bytes
+/// </summary>
+/// <param name="out">: The buffer to fill</param>
+/// <param name="size">: The number of bytes to write</param>
+void RNG::bytes(uint8_t* out, size_t size)
+{
+    RNGState& state = rng_state;
+
+    while (size > 0)
+    {
+        if (state.position == RNG_BUFFER_SIZE)
+        {
+            rng_refill(state);
+        }
+
+        size_t count = std::min(size, (size_t)(RNG_BUFFER_SIZE - state.position));
+        memcpy(out, state.buffer + state.position, count);
+
+        // Served bytes are removed from the buffer
+        memset(state.buffer + state.position, 0, count);
+
+        state.position += count;
+        out += count;
+        size -= count;
+    }
+}
+
+/// <summary>
+/// Returns 64 random bits, for example to fill 64 pixel bytes at once
+/// </summary>
+uint64_t RNG::next_u64()
+{
+    uint8_t bytes[8];
+    RNG::bytes(bytes, sizeof(bytes));
+
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
@@ -0,0 +1,258 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Scan index. The scan command probes every image (BMP::probe reads
+* only the BMP headers and the first row) and keeps the results in an
+* index file, so a later scan only probes the images whose modification
+* time or size changed. The file is a 16-byte header followed by one
+* record per image, each followed by the path of the image. It is
+* rewritten as a whole and replaces the old index only when complete.
+*
+**********************************************************************/
+
+// Number of images probed by one task of the thread pool
+#define SCAN_CHUNK_SIZE 64
+
+/// <summary>
+/// Opens the scan index and reads all records. An index that does not exist yet is created by save.
+/// </summary>
+/// <param name="fname">: The name of the index file</param>
+ScanIndex::ScanIndex(std::string fname) : fname(fname)
+{
+    load();
+}
+
+/// <summary>
+/// Reads the records from the index file
+/// </summary>
+void ScanIndex::load()
+{
+    std::ifstream file(fname, std::ios_base::binary);
+    if (!file)
+    {
+        return;
+    }
+
+    ScanIndexHeader header;
+    file.read((char*)&header, sizeof(header));
+
+    if (!file || memcmp(header.magic, SCAN_INDEX_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error("The scan index file is damaged or not a scan index");
+    }
+
+    if (header.version != SCAN_INDEX_VERSION || header.record_size != sizeof(ScanRecord))
+    {
+        error("The scan index was written by an unsupported version of the program");
+    }
+
+    // A record that was cut off is ignored, its image is probed again
+    ScanRecord record;
+    std::string path;
+    while (file.read((char*)&record, sizeof(record)))
+    {
+        path.resize(record.path_size);
+        if (!file.read(&path[0], path.size()))
+        {
+            break;
+        }
+
+        records[path] = record;
+    }
+}
+
+/// <summary>
+/// Probes the images that are not in the index or that changed since they were probed, on the thread pool. Images
+/// in the index that no longer exist are removed from it.
+/// </summary>
+/// <param name="images">: The paths of the images</param>
+/// <param name="thread_pool">: The thread pool the images are probed on</param>
+/// <returns>The number of images that were probed</returns>
+size_t ScanIndex::scan(const std::vector<std::string>& images, ThreadPool& thread_pool)
+{
+    std::vector<std::pair<std::string, ScanRecord>> changed;
+
+    for (const auto& image : images)
+    {
+        ScanRecord record;
+        std::error_code size_ec, time_ec;
+        uint64_t file_size = std::filesystem::file_size(image, size_ec);
+        auto mtime = std::filesystem::last_write_time(image, time_ec);
+        bool stated = !size_ec && !time_ec;
+
+        record.file_size = stated ? file_size : 0;
+        record.mtime = stated ? (int64_t)mtime.time_since_epoch().count() : 0;
+
+        auto known = records.find(image);
+        if (stated && known != records.end() && known->second.mtime == record.mtime && known->second.file_size == record.file_size)
+        {
+            continue;
+        }
+
+        changed.push_back({ image, record });
+    }
+
+    size_t chunk_count = (changed.size() + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE;
+    thread_pool.parallel_for(chunk_count, [&](size_t chunk) {
+        size_t end = std::min(changed.size(), (chunk + 1) * SCAN_CHUNK_SIZE);
+
+        for (size_t i = chunk * SCAN_CHUNK_SIZE; i < end; i++)
+        {
+            ScanRecord& record = changed[i].second;
+            EmbedHeader header;
+
+            if (BMP::probe(changed[i].first, header, record.capacity))
+            {
+                record.has_payload = 1;
+                record.version = header.version;
+                record.cipher = header.cipher;
+                record.key_id = header.key_id;
+                record.text_size = header.text_size;
+            }
+        }
+    });
+
+    for (auto& image : changed)
+    {
+        image.second.path_size = (uint16_t)std::min<size_t>(image.first.size(), UINT16_MAX);
+        records[image.first] = image.second;
+    }
+
+    for (auto record = records.begin(); record != records.end();)
+    {
+        std::error_code ec;
+        record = std::filesystem::exists(record->first, ec) ? std::next(record) : records.erase(record);
+    }
+
+    return changed.size();
+}
+
+/// <summary>
+/// Looks up the record of an image
+/// </summary>
+/// <param name="path">: The path of the image, as it was given to scan</param>
+/// <param name="record">: Receives the record</param>
+/// <returns>False if the image is not in the index</returns>
+bool ScanIndex::find(const std::string& path, ScanRecord& record)
+{
+    auto found = records.find(path);
+    if (found == records.end())
+    {
+        return false;
+    }
+
+    record = found->second;
+    return true;
+}
+
+/// <summary>
+/// Writes all records to a temporary file, which then replaces the index file
+/// </summary>
+void ScanIndex::save()
+{
+    std::string temp_fname = fname + ".tmp";
+    std::ofstream file(temp_fname, std::ios_base::binary | std::ios_base::trunc);
+    if (!file)
+    {
+        error("Unable to write the scan index file.");
+    }
+
+    ScanIndexHeader header;
+    header.record_size = sizeof(ScanRecord);
+    file.write((const char*)&header, sizeof(header));
+
+    for (const auto& record : records)
+    {
+        // Paths longer than a record can describe are not kept, those images are probed on every scan
+        if (record.first.size() > UINT16_MAX)
+        {
+            continue;
+        }
+
+        file.write((const char*)&record.second, sizeof(record.second));
+        file.write(record.first.data(), record.first.size());
+    }
+
+    file.close();
+    if (!file)
+    {
+        error("Unable to write the scan index file.");
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_fname, fname, ec);
+    if (ec)
+    {
+        error("Unable to replace the scan index file: " + ec.message());
+    }
+}
+
+/**********************************************************************
+*
+* Carrier pool. The images of a scan that hold no payload, ordered by
+* capacity. A payload is given the smallest carrier it fits into, which
+* is found with one lookup in the ordered set, and the carrier is then
+* taken out of the pool so it is not given to another payload.
+*
+**********************************************************************/
+
+/// <summary>
+/// Fills the pool with the images that hold no payload according to the scan index
+/// </summary>
+/// <param name="scan_index">: The scan index, after the images were scanned</param>
+/// <param name="images">: The paths of the images</param>
+CarrierPool::CarrierPool(ScanIndex& scan_index, const std::vector<std::string>& images)
+{
+    for (const auto& image : images)
+    {
+        ScanRecord record;
+        if (scan_index.find(image, record) && !record.has_payload && record.capacity > 0)
+        {
+            add(image, record.capacity);
+        }
+    }
+}
+
+/// <summary>
+/// Adds a carrier to the pool
+/// </summary>
+/// <param name="path">: The path of the image</param>
+/// <param name="capacity">: The number of bytes that fit into it</param>
+void CarrierPool::add(const std::string& path, uint64_t capacity)
+{
+    carriers.insert({ capacity, path });
+}
+
+/// <summary>
+/// Takes the carrier with the smallest capacity that fits a text out of the pool
+/// </summary>
+/// <param name="size">: The size of the text, after encryption</param>
+/// <param name="path">: Receives the path of the carrier</param>
+/// <returns>False if no carrier is large enough</returns>
+bool CarrierPool::take(uint64_t size, std::string& path)
+{
+    auto carrier = carriers.lower_bound({ size, std::string() });
+    if (carrier == carriers.end())
+    {
+        return false;
+    }
+
+    path = carrier->second;
+    carriers.erase(carrier);
+    return true;
+}
+
+/// <summary>
+/// Returns the number of carriers left in the pool
+/// </summary>
+size_t CarrierPool::size()
+{
+    return carriers.size();
+}
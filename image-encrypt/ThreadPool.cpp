@@ -0,0 +1,328 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+#include "image-encrypt.h"
+
+/**********************************************************************
+*
+* Work-stealing thread pool. Every worker has its own deque: tasks it
+* submits itself (the row ranges of a large image) are pushed to the
+* back and taken from the back again, so they run while their data is
+* still in the cache. Tasks from other threads (whole images) go into
+* a shared queue in submission order. A worker without own tasks takes
+* the next task from the shared queue and then steals the oldest task
+* of another worker. A worker that waits for its own row ranges runs
+* other tasks in the meantime, so no core idles while one image is
+* split and others are still waiting.
+*
+**********************************************************************/
+
+// Index of the worker the calling thread is, or -1 for threads that are not part of a pool
+static thread_local int worker_index = -1;
+static thread_local ThreadPool* worker_pool = nullptr;
+
+/// <summary>
+/// Starts the worker threads
+/// </summary>
+/// <param name="thread_count">: The number of worker threads, 0 for one per logical processor (of the node)</param>
+/// <param name="node">: The NUMA node the workers are pinned to, nullptr to let them run anywhere</param>
+ThreadPool::ThreadPool(unsigned thread_count, const NumaNode* node) : node(node)
+{
+    if (thread_count == 0)
+    {
+        thread_count = node && !node->cpus.empty() ? (unsigned)node->cpus.size() : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (unsigned i = 0; i < thread_count; i++)
+    {
+        workers.push_back(std::make_unique<Worker>());
+    }
+
+    for (unsigned i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(&ThreadPool::worker_loop, this, (int)i);
+    }
+}
+
+/// <summary>
+/// Waits for all submitted tasks and stops the worker threads
+/// </summary>
+ThreadPool::~ThreadPool()
+{
+    wait();
+
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stop = true;
+    }
+    wake.notify_all();
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+/// <summary>
+/// Returns the number of worker threads
+/// </summary>
+unsigned ThreadPool::size()
+{
+    return (unsigned)workers.size();
+}
+
+/// <summary>
+/// Queues a task. Tasks submitted by a worker of this pool go into its own deque, all others into the shared queue.
+/// </summary>
+/// <param name="task">: The task</param>
+void ThreadPool::submit(std::function<void()> task)
+{
+    pending++;
+
+    if (worker_pool == this)
+    {
+        Worker& worker = *workers[worker_index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        shared_tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+/// <summary>
+/// Blocks until every submitted task has finished
+/// </summary>
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    done.wait(lock, [this] { return pending == 0; });
+}
+
+/// <summary>
+/// Runs body(0) to body(count - 1) on the pool and returns when all of them have finished.
+/// The calling thread runs one part itself and, if it is a worker, other tasks while it waits. Other
+/// callers sleep until the last part is done. If parts fail, the first exception is passed on to the
+/// caller, but only after every part has finished, since the parts use the frame of the caller.
+/// </summary>
+/// <param name="count">: The number of parts</param>
+/// <param name="body">: The function that processes one part</param>
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& body)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    struct Latch
+    {
+        size_t remaining;
+        std::exception_ptr exception;
+        std::mutex mutex;
+        std::condition_variable finished;
+    } latch;
+
+    latch.remaining = count - 1;
+
+    auto run = [&body, &latch](size_t i) {
+        try
+        {
+            body(i);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(latch.mutex);
+            if (!latch.exception)
+            {
+                latch.exception = std::current_exception();
+            }
+        }
+    };
+
+    for (size_t i = 1; i < count; i++)
+    {
+        submit([&run, &latch, i] {
+            run(i);
+
+            std::lock_guard<std::mutex> lock(latch.mutex);
+            if (--latch.remaining == 0)
+            {
+                latch.finished.notify_all();
+            }
+        });
+    }
+
+    run(0);
+
+    // A worker helps with the queued tasks (its own parts first). Once there is nothing left to take,
+    // the remaining parts run on other threads and it sleeps like any other caller.
+    if (worker_pool == this)
+    {
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(latch.mutex);
+                if (latch.remaining == 0)
+                {
+                    break;
+                }
+            }
+
+            if (!run_one(worker_index))
+            {
+                break;
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(latch.mutex);
+    latch.finished.wait(lock, [&latch] { return latch.remaining == 0; });
+
+    if (latch.exception)
+    {
+        std::exception_ptr exception = latch.exception;
+        lock.unlock();
+
+        // A caller that does not throw on errors (the main thread of the CLI) reports it like its own errors
+        if (throw_on_error)
+        {
+            std::rethrow_exception(exception);
+        }
+
+        try
+        {
+            std::rethrow_exception(exception);
+        }
+        catch (const std::exception& e)
+        {
+            error(e.what());
+        }
+    }
+}
+
+/// <summary>
+/// Takes the next task for a worker: the newest task of its own deque, the oldest task of the shared queue
+/// or the oldest task of another worker, in this order
+/// </summary>
+/// <param name="self">: The index of the worker</param>
+/// <param name="task">: Receives the task</param>
+/// <returns>False if there is no task at all</returns>
+bool ThreadPool::take(int self, std::function<void()>& task)
+{
+    {
+        Worker& worker = *workers[self];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.tasks.empty())
+        {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            return true;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        if (!shared_tasks.empty())
+        {
+            task = std::move(shared_tasks.front());
+            shared_tasks.pop_front();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        Worker& victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// <summary>
+/// Runs one task if there is one
+/// </summary>
+/// <param name="self">: The index of the worker</param>
+/// <returns>False if there was no task</returns>
+bool ThreadPool::run_one(int self)
+{
+    std::function<void()> task;
+    if (!take(self, task))
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        queued--;
+    }
+
+    // Tasks pass their errors on themselves (parallel_for hands them to its caller), anything else that is
+    // thrown must not end the worker
+    try
+    {
+        task();
+    }
+    catch (...)
+    {
+    }
+
+    if (--pending == 0)
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        done.notify_all();
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Main loop of a worker thread. It sleeps while no task is queued.
+/// </summary>
+/// <param name="self">: The index of the worker</param>
+void ThreadPool::worker_loop(int self)
+{
+    worker_index = self;
+    worker_pool = this;
+
+    // Errors in a task fail only that task and are passed on to whoever waits for it
+    throw_on_error = true;
+
+    if (node)
+    {
+        bind_thread(*node);
+    }
+
+    while (true)
+    {
+        if (run_one(self))
+        {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stop || queued > 0; });
+
+        if (stop)
+        {
+            return;
+        }
+    }
+}
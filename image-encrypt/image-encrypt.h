@@ -6,20 +6,84 @@
 
 #pragma once
 
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <bcrypt.h>
+#include <sddl.h>
+#pragma comment(lib, "bcrypt.lib")
+#pragma comment(lib, "advapi32.lib")
+#else
+#include <sys/random.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#endif
+
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <cstdlib>
 #include <random>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <array>
+#include <cstddef>
+#include <thread>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <condition_variable>
+#include <future>
+#include <new>
+#include <stdexcept>
+#include <exception>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #include <openssl/aes.h>
 #include <openssl/rand.h>
 #include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/params.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/provider.h>
 
 #define AES_KEY_SIZE 32
+#define X25519_KEY_SIZE 32
 
 #pragma pack(push, 1)
 
@@ -49,18 +113,619 @@ struct BMPInfoHeader
     uint32_t colors_important{ 0 };             // No. of colors used for displaying the bitmap. If 0 all colors are required
 };
 
+// Container header embedded in the lowest bits of the image data in front of the text (BMP.cpp). It describes
+// the text, so a reader knows from the first row how to decrypt it. Images of version 1 have no header but only
+// a 32-bit length of the text, images of version 2 only the magic number, the version and a 64-bit length.
+#define EMBED_MAGIC 0x434E4549                  // "IENC"
+#define EMBED_VERSION 3
+#define EMBED_BITS_PER_CHANNEL 1
+
+struct EmbedHeader
+{
+    uint32_t magic{ EMBED_MAGIC };
+    uint8_t version{ EMBED_VERSION };           // Version of the embedded layout
+    uint8_t flags{ 0 };                         // No flags are defined yet, readers reject headers with unknown flags
+    uint8_t cipher{ 0 };                        // Encryption type of the text (1-6), 0 if unknown
+    uint8_t bits_per_channel{ EMBED_BITS_PER_CHANNEL }; // No. of lowest bits of every color byte that carry the text
+    uint32_t key_id{ 0 };                       // ID of the key in the keystore, 0 if the key is not in a keystore
+    uint64_t text_size{ 0 };                    // No. of bytes of the text that follows the header
+    uint8_t nonce[16]{ 0 };                     // Random value of the image, the first counter block of AES-CTR (type 6)
+    uint32_t header_crc{ 0 };                   // CRC32 checksum of the fields before it
+};
+
+// Keystore file (Keystore.cpp)
+#define KEYSTORE_MAGIC "IEKS"
+#define KEYSTORE_VERSION 1
+
+struct KeystoreRecord
+{
+    uint32_t key_id{ 0 };                       // Random ID of the key, stored in the reserved fields of the image file header
+    uint8_t type{ 0 };                          // Encryption type the key is used for (1: AES, 2: XOR)
+    uint8_t length{ 0 };                        // No. of used bytes in key
+    uint16_t reserved{ 0 };                     // Reserved, always 0
+    uint64_t created{ 0 };                      // Time the key was generated (seconds since 1970)
+    uint8_t key[32]{ 0 };                       // The key bytes
+};
+
+struct KeystoreHeader
+{
+    char magic[4]{ 'I', 'E', 'K', 'S' };        // Always IEKS
+    uint16_t version{ KEYSTORE_VERSION };       // Version of the keystore format
+    uint16_t record_size{ sizeof(KeystoreRecord) }; // Size of each record (in bytes)
+    uint32_t reserved1{ 0 };                    // Reserved, always 0
+    uint32_t reserved2{ 0 };                    // Reserved, always 0
+};
+
+// Scan index file (Scan.cpp)
+#define SCAN_INDEX_MAGIC "IESI"
+#define SCAN_INDEX_VERSION 1
+
+struct ScanIndexHeader
+{
+    char magic[4]{ 'I', 'E', 'S', 'I' };        // Always IESI
+    uint16_t version{ SCAN_INDEX_VERSION };     // Version of the scan index format
+    uint16_t record_size{ 0 };                  // Size of each record without its path (in bytes)
+    uint64_t reserved{ 0 };                     // Reserved, always 0
+};
+
+struct ScanRecord
+{
+    int64_t mtime{ 0 };                         // Modification time of the file when it was probed
+    uint64_t file_size{ 0 };                    // Size of the file when it was probed
+    uint64_t capacity{ 0 };                     // No. of bytes of text that fit into the image, 0 if it is no BMP file the program reads
+    uint64_t text_size{ 0 };                    // Size of the embedded text, 0 without payload
+    uint32_t key_id{ 0 };                       // ID of the key in the keystore, 0 without payload or key ID
+    uint8_t has_payload{ 0 };                   // 1 if the first row holds a valid embedded header (the checksum is not checked)
+    uint8_t version{ 0 };                       // Version of the embedded layout
+    uint8_t cipher{ 0 };                        // Encryption type from the embedded header, 0 if unknown
+    uint8_t reserved{ 0 };                      // Reserved, always 0
+    uint16_t path_size{ 0 };                    // No. of bytes of the path that follows the record
+};
+
+// Archive of several files that is embedded as one payload (Archive.cpp). The table of contents follows the
+// header at the start of the text, so a reader finds a file from the first bytes and decrypts only that file.
+#define ARCHIVE_MAGIC "IEAR"
+#define ARCHIVE_VERSION 1
+
+struct ArchiveEntry
+{
+    uint64_t offset{ 0 };                       // Position of the file in the archive (bytes from the archive header)
+    uint64_t size{ 0 };                         // Size of the file
+    uint32_t crc{ 0 };                          // CRC32 checksum of the file
+    uint16_t name_size{ 0 };                    // No. of bytes of the name that follows the entry
+};
+
+struct ArchiveHeader
+{
+    char magic[4]{ 'I', 'E', 'A', 'R' };        // Always IEAR
+    uint16_t version{ ARCHIVE_VERSION };        // Version of the archive format
+    uint16_t entry_size{ sizeof(ArchiveEntry) }; // Size of each entry without its name (in bytes)
+    uint32_t entry_count{ 0 };                  // No. of files in the archive
+    uint32_t toc_size{ 0 };                     // No. of bytes of all entries with their names, which follow the header
+};
+
+// Password header stored in front of the ciphertext of images encrypted with a password (KDF.cpp)
+struct PasswordHeader
+{
+    uint8_t kdf{ 1 };                           // Function deriving the master key from the password, always 1 (scrypt)
+    uint8_t log2_n{ 16 };                       // scrypt cost parameter N as power of two
+    uint8_t r{ 8 };                             // scrypt block size parameter
+    uint8_t p{ 1 };                             // scrypt parallelization parameter
+    uint8_t master_salt[16]{ 0 };               // Salt of the master key, the same for all images of a batch
+    uint8_t file_salt[16]{ 0 };                 // HKDF salt of the AES key of this image
+};
+
+// Largest scrypt parameters accepted from an image, the ones the program writes itself (64 MiB per derivation).
+// The header comes from the image, so larger values would let any image make a derivation take gigabytes and minutes.
+#define SCRYPT_MAX_LOG2_N 16
+#define SCRYPT_MAX_R 8
+#define SCRYPT_MAX_P 1
+
+// Recipient table stored in front of the ciphertext of images encrypted for several recipients (Envelope.cpp)
+struct EnvelopeHeader
+{
+    uint8_t version{ 1 };                       // Version of the recipient table, always 1
+    uint16_t recipient_count{ 0 };              // No. of recipient entries that follow
+    uint8_t ephemeral_public[32]{ 0 };          // Ephemeral X25519 public key for the key agreement with all recipients
+};
+
+struct EnvelopeRecipient
+{
+    uint8_t fingerprint[8]{ 0 };                // First 8 bytes of the SHA-256 hash of the public key of the recipient
+    uint8_t wrapped_key[40]{ 0 };               // The data key wrapped with the key encryption key of the recipient
+};
+
+// Requests to the daemon and its responses, each followed by its data (Daemon.cpp)
+#define DAEMON_REQUEST_MAGIC 0x51444549         // "IEDQ"
+#define DAEMON_RESPONSE_MAGIC 0x52444549        // "IEDR"
+#define DAEMON_ENCRYPT 1
+#define DAEMON_DECRYPT 2
+#define DAEMON_VERIFY 3
+#define DAEMON_CAPACITY 4
+#define DAEMON_OK 0
+#define DAEMON_CHECKSUM_FAILED 1
+#define DAEMON_ERROR 2
+
+// The BMP file is not sent after the header but passed as a memfd (SCM_RIGHTS) that is sealed against shrinking.
+// The daemon works on the shared mapping and encrypt writes the result back into it.
+#define DAEMON_FLAG_SHARED 1
+
+struct DaemonRequest
+{
+    uint32_t magic{ DAEMON_REQUEST_MAGIC };
+    uint8_t command{ 0 };                       // DAEMON_ENCRYPT, DAEMON_DECRYPT, DAEMON_VERIFY or DAEMON_CAPACITY
+    uint8_t encryption_type{ 0 };               // Encryption type of encrypt and decrypt (1-6)
+    uint16_t flags{ 0 };                        // DAEMON_FLAG_SHARED or 0
+    uint64_t image_size{ 0 };                   // Size of the BMP file that follows the header (or of the memfd)
+    uint64_t payload_size{ 0 };                 // Size of the payload that follows the BMP file (encrypt only)
+};
+
+struct DaemonResponse
+{
+    uint32_t magic{ DAEMON_RESPONSE_MAGIC };
+    uint32_t status{ DAEMON_OK };               // DAEMON_OK, DAEMON_CHECKSUM_FAILED or DAEMON_ERROR
+    uint64_t size{ 0 };                         // Size of the data that follows: the encrypted BMP file (not for a memfd),
+                                                // the decrypted payload, the capacity (8 bytes) or the error message
+};
+
 #pragma pack(pop)
 
+extern bool wait_on_error;
+extern thread_local bool throw_on_error;
+void error(const std::string& message);
+
+// OpenSSL algorithms that are fetched once when the first cipher is needed (Crypto.cpp)
+struct CryptoAlgorithms
+{
+    EVP_CIPHER* aes_256_ecb{ nullptr };
+    EVP_CIPHER* aes_256_ctr{ nullptr };
+    EVP_CIPHER* aes_256_wrap{ nullptr };
+    EVP_MD* sha256{ nullptr };
+    EVP_KDF* hkdf{ nullptr };
+    EVP_KDF* scrypt{ nullptr };
+};
+
+const CryptoAlgorithms& crypto();
+bool crypto_is_initialized();
+void os_random_bytes(uint8_t* out, size_t size);
+void secure_zero(void* data, size_t size);
+EVP_CIPHER_CTX* cipher_context();
+
+// Buffered cryptographically secure random number generator with one buffer per thread (RNG.cpp)
+struct RNG
+{
+    static void bytes(uint8_t* out, size_t size);
+    static uint64_t next_u64();
+};
+
+// NUMA node with the logical processors that belong to it (NUMA.cpp)
+struct NumaNode
+{
+    int id{ 0 };
+    std::vector<int> cpus;                      // Empty if the processors are not known, threads are then not pinned
+};
+
+std::vector<NumaNode> numa_nodes();
+void bind_thread(const NumaNode& node);
+
+// Work-stealing thread pool for batch jobs and the row ranges of large images (ThreadPool.cpp)
+struct ThreadPool
+{
+    ThreadPool(unsigned thread_count = 0, const NumaNode* node = nullptr);
+    ~ThreadPool();
+    unsigned size();
+    void submit(std::function<void()> task);
+    void wait();
+    void parallel_for(size_t count, const std::function<void(size_t)>& body);
+
+    private:
+        struct Worker
+        {
+            std::deque<std::function<void()>> tasks;
+            std::mutex mutex;
+        };
+
+        bool take(int self, std::function<void()>& task);
+        bool run_one(int self);
+        void worker_loop(int self);
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+
+        // Node the workers are pinned to, nullptr if they can run anywhere
+        const NumaNode* node;
+
+        // Tasks submitted from threads outside the pool, in submission order
+        std::deque<std::function<void()>> shared_tasks;
+        std::mutex shared_mutex;
+
+        // Number of queued tasks (guarded by sleep_mutex) and of tasks that have not finished yet
+        int64_t queued{ 0 };
+        std::atomic<size_t> pending{ 0 };
+        bool stop{ false };
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+};
+
+// Buffers for direct I/O have to start at a multiple of the block size and have a length that is a multiple of it
+#define IO_BLOCK_SIZE 4096
+
+// Buffers of at least HUGE_PAGE_MIN_SIZE are mapped directly and backed by 2 MiB pages where the system allows it,
+// so walking the pixels of a large image does not miss the TLB on every 4 KiB page (Memory.cpp)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_PAGE_MIN_SIZE (4 * 1024 * 1024)
+
+extern bool use_huge_pages;
+void* allocate_buffer(size_t size);
+void free_buffer(void* pointer, size_t size);
+
+template <typename T>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t count) { return (T*)allocate_buffer(count * sizeof(T)); }
+    void deallocate(T* pointer, size_t count) { free_buffer(pointer, count * sizeof(T)); }
+
+    // Bytes added by resize are not zeroed, because the buffers are overwritten by a read or a copy anyway.
+    // Values that are given explicitly (resize(size, 0), assign) are still written.
+    template <typename U> void construct(U* pointer) { ::new ((void*)pointer) U; }
+    template <typename U, typename... Args> void construct(U* pointer, Args&&... args) { ::new ((void*)pointer) U(std::forward<Args>(args)...); }
+
+    template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+typedef std::vector<uint8_t, AlignedAllocator<uint8_t>> AlignedBuffer;
+
+// Bytes inside a buffer that is owned by someone else
+struct ByteSpan
+{
+    uint8_t* pointer{ nullptr };
+    size_t length{ 0 };
+
+    uint8_t* data() const { return pointer; }
+    size_t size() const { return length; }
+    uint8_t& operator[](size_t i) const { return pointer[i]; }
+};
+
+// Whole-file reads and writes in batches, with io_uring on Linux and synchronous calls elsewhere (IO.cpp)
+struct FileRequest
+{
+    const char* fname{ nullptr };               // Not copied, it has to stay valid until the request is done
+    AlignedBuffer data;                         // Receives the content when reading, holds it when writing
+    bool direct{ false };                       // Bypass the page cache with O_DIRECT (io_uring only)
+    int error{ 0 };                             // errno of the failed operation, 0 if it succeeded
+};
+
+struct FileIO
+{
+    FileIO(bool use_io_uring = true, unsigned entries = 64);
+    ~FileIO();
+    bool uses_io_uring();
+    void read_files(const std::vector<FileRequest*>& requests);
+    void write_files(const std::vector<FileRequest*>& requests);
+
+    private:
+        void read_files_sync(const std::vector<FileRequest*>& requests);
+        void write_files_sync(const std::vector<FileRequest*>& requests);
+
+#ifdef __linux__
+        bool setup(unsigned entries);
+        void close_ring();
+        template <typename Prepare, typename Complete>
+        void run(size_t count, const Prepare& prepare, const Complete& complete);
+        void transfer(const std::vector<FileRequest*>& requests, const std::vector<int>& fds, const std::vector<size_t>& sizes, bool write);
+        void close_files(const std::vector<int>& fds);
+
+        int ring_fd{ -1 };
+        unsigned entries{ 0 };
+        bool fixed_buffers{ true };
+
+        // Submission and completion rings shared with the kernel
+        void* sq_ring{ nullptr };
+        void* cq_ring{ nullptr };
+        size_t sq_ring_size{ 0 };
+        size_t cq_ring_size{ 0 };
+        io_uring_sqe* sqes{ nullptr };
+        unsigned* sq_head{ nullptr };
+        unsigned* sq_tail{ nullptr };
+        unsigned* sq_mask{ nullptr };
+        unsigned* sq_array{ nullptr };
+        unsigned* cq_head{ nullptr };
+        unsigned* cq_tail{ nullptr };
+        unsigned* cq_mask{ nullptr };
+        io_uring_cqe* cqes{ nullptr };
+
+        // Lists of the current batch, kept so their memory is reused by the next batch
+        std::vector<FileRequest*> batch;
+        std::vector<int> fds;
+        std::vector<struct statx> stats;
+        std::vector<size_t> sizes;
+        std::vector<size_t> transfer_sizes;
+        std::vector<size_t> files;
+        std::vector<size_t> done;
+        std::vector<iovec> buffers;
+        std::vector<int> open_fds;
+        std::vector<size_t> waiting;
+#endif
+};
+
+// Limit for the memory of the jobs that run at the same time (Memory.cpp)
+struct MemoryBudget
+{
+    MemoryBudget(uint64_t limit);
+    void set_reclaim(std::function<uint64_t(uint64_t)> reclaim);
+    size_t admit(const std::vector<uint64_t>& sizes);
+    void reserve(uint64_t size);
+    void hold(uint64_t size);
+    void unhold(uint64_t size);
+    void release(uint64_t size);
+    static uint64_t physical_memory();
+
+    private:
+        uint64_t limit;
+        uint64_t used{ 0 };
+
+        // Part of used that idle buffers in buffer pools hold and that reclaim can free
+        uint64_t idle{ 0 };
+        size_t running{ 0 };
+        std::function<uint64_t(uint64_t)> reclaim;
+        std::mutex mutex;
+        std::condition_variable released;
+};
+
+// Buffers of finished jobs that are kept for the next jobs, so a batch stops allocating after the first images (Memory.cpp)
+struct BufferPool
+{
+    BufferPool(uint64_t limit, MemoryBudget* budget = nullptr);
+    AlignedBuffer take(size_t size);
+    void give(AlignedBuffer&& buffer);
+    uint64_t trim(uint64_t size);
+
+    private:
+        uint64_t limit;
+        MemoryBudget* budget;
+        uint64_t pooled{ 0 };
+        std::vector<AlignedBuffer> buffers;
+        std::mutex mutex;
+};
+
+// Bounded lock-free queue for several producers and consumers (Pipeline.cpp)
+template <typename T>
+struct BoundedQueue
+{
+    BoundedQueue(size_t capacity);
+    bool try_push(const T& value);
+    bool try_pop(T& value);
+    size_t size();
+    size_t capacity();
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        size_t mask;
+
+        // Producers and consumers use their own cache line
+        alignas(64) std::atomic<size_t> enqueue_position{ 0 };
+        alignas(64) std::atomic<size_t> dequeue_position{ 0 };
+};
+
+// Staged pipeline in which every stage has its own threads (Pipeline.cpp)
+struct Pipeline
+{
+    Pipeline(std::vector<std::string> job_names, size_t queue_capacity, const NumaNode* node = nullptr);
+    ~Pipeline();
+    void add_stage(std::string name, unsigned thread_count, std::function<void(size_t)> process);
+    void add_batch_stage(std::string name, unsigned thread_count, size_t batch_size, std::function<void(const std::vector<size_t>&)> process);
+    void enable_trace();
+    void start();
+    void push(size_t job);
+    void close();
+    void wait();
+    void write_trace(std::string fname);
+
+    private:
+        struct TraceEvent
+        {
+            char phase;                         // 'X' for a job in a stage, 'C' for a queue depth
+            int thread;
+            size_t stage;
+            int64_t start;                      // Microseconds since the pipeline was created
+            int64_t duration;
+            size_t value;                       // First job for 'X', queue depth for 'C'
+            size_t count;                       // Number of jobs processed together for 'X'
+        };
+
+        struct Stage
+        {
+            std::string name;
+            unsigned thread_count;
+            size_t batch_size;
+            std::function<void(const std::vector<size_t>&)> process;
+            std::unique_ptr<BoundedQueue<size_t>> queue;
+            std::atomic<size_t> taken{ 0 };
+
+            // Threads that waited too long for a job, or for room in the queue, sleep here
+            std::mutex sleep_mutex;
+            std::condition_variable queued;
+            std::condition_variable dequeued;
+        };
+
+        void stage_loop(size_t stage, int thread);
+        void enqueue(size_t stage, size_t job, int thread);
+        void notify(std::condition_variable& condition, Stage& stage, bool all);
+        int64_t now();
+
+        std::vector<std::string> job_names;
+        size_t queue_capacity;
+
+        // Number of jobs that pass the pipeline: all jobs, or the jobs pushed until close
+        std::atomic<size_t> job_count;
+        std::atomic<size_t> pushed{ 0 };
+
+        // Node the stage threads are pinned to, nullptr if they can run anywhere
+        const NumaNode* node;
+        std::vector<std::unique_ptr<Stage>> stages;
+        std::vector<std::thread> threads;
+        std::chrono::steady_clock::time_point epoch;
+
+        // Every thread records its trace events in its own list, thread 0 is the thread that pushes the jobs
+        bool tracing{ false };
+        std::vector<std::string> thread_names;
+        std::vector<std::vector<TraceEvent>> trace;
+};
+
+struct Keystore
+{
+    Keystore(std::string fname);
+    uint32_t add(uint8_t type, const uint8_t* key, size_t size);
+    bool find(uint32_t key_id, KeystoreRecord& record);
+
+    private:
+        void load();
+
+        std::string fname;
+        std::vector<KeystoreRecord> records;
+        std::unordered_map<uint32_t, size_t> index;
+        std::mutex mutex;
+};
+
+// Results of probing images, kept in a file so unchanged images are not probed again (Scan.cpp)
+struct ScanIndex
+{
+    ScanIndex(std::string fname);
+    size_t scan(const std::vector<std::string>& images, ThreadPool& thread_pool);
+    bool find(const std::string& path, ScanRecord& record);
+    void save();
+
+    private:
+        void load();
+
+        std::string fname;
+        std::map<std::string, ScanRecord> records;
+};
+
+// Carriers without payload ordered by capacity, so the smallest one that fits a payload is found in O(log n) (Scan.cpp)
+struct CarrierPool
+{
+    CarrierPool(ScanIndex& scan_index, const std::vector<std::string>& images);
+    void add(const std::string& path, uint64_t capacity);
+    bool take(uint64_t size, std::string& path);
+    size_t size();
+
+    private:
+        std::set<std::pair<uint64_t, std::string>> carriers;
+};
+
+struct PasswordKey
+{
+    PasswordKey(std::string password);
+    ~PasswordKey();
+    void new_file_key(PasswordHeader& header, std::vector<uint8_t>& key);
+    void file_key(const PasswordHeader& header, std::vector<uint8_t>& key);
+
+    private:
+        // Master key of one master salt. The first thread that needs it derives it, others with the same salt wait.
+        struct MasterKey
+        {
+            ~MasterKey();
+            std::mutex mutex;
+            bool derived{ false };
+            std::vector<uint8_t> key;
+            uint64_t last_use{ 0 };                 // Guarded by the mutex of the PasswordKey
+        };
+
+        std::vector<uint8_t> master_key(const PasswordHeader& header);
+        void derive(const PasswordHeader& header, std::vector<uint8_t>& master);
+
+        std::string password;
+        uint8_t master_salt[16];
+
+        // Master keys that were already derived, by scrypt parameters and master salt. The least recently used
+        // keys are dropped when there are too many.
+        std::map<std::string, std::shared_ptr<MasterKey>> master_keys;
+        uint64_t use_count{ 0 };
+        std::mutex mutex;
+};
+
+void hkdf_sha256(const uint8_t* secret, size_t secret_size, const uint8_t* salt, size_t salt_size, const char* info, uint8_t* out, size_t out_size);
+
+struct Envelope
+{
+    ~Envelope();
+    void add_recipient(std::string public_key_fname);
+    void add_recipient(const uint8_t* public_key);
+    void set_identity(std::string private_key_fname);
+    void set_identity(const uint8_t* private_key);
+    void wrap(const std::vector<uint8_t>& data_key, std::vector<uint8_t>& table);
+    size_t unwrap(const uint8_t* data, size_t size, std::vector<uint8_t>& data_key);
+    static void generate_key_pair(std::string name);
+
+    private:
+        // Public keys of the recipients
+        std::vector<std::array<uint8_t, X25519_KEY_SIZE>> recipients;
+
+        // Own private key
+        uint8_t identity[X25519_KEY_SIZE]{ 0 };
+        bool has_identity{ false };
+};
+
 struct BMP
 {
+    BMP();
     BMP(std::string fname);
-    void encrypt(std::string fname, int encryption_type);
+    BMP(AlignedBuffer&& file_data);
+    BMP(uint8_t* pixels, uint32_t width, uint32_t height, uint32_t byte_count);
+    BMP(ByteSpan file_data);
+    BMP(const BMP&) = delete;
+    BMP& operator=(const BMP&) = delete;
+    void set_keystore(Keystore* keystore);
+    void set_password_key(PasswordKey* password_key);
+    void set_envelope(Envelope* envelope);
+    void set_thread_pool(ThreadPool* thread_pool);
+    void set_buffer_pool(BufferPool* buffer_pool);
+    void set_key(const uint8_t* key, size_t size);
+    void load(AlignedBuffer&& file_data);
+    void reset();
+    static uint64_t estimate_memory(std::string fname, uint64_t text_size);
+    static bool probe(std::string fname, EmbedHeader& header, uint64_t& capacity);
+    static bool file_capacity(std::string fname, uint64_t& capacity);
+    static uint64_t encrypted_size(int encryption_type, uint64_t text_size, size_t recipient_count);
+    void encrypt(std::string fname, int encryption_type, std::string out_fname = "encrypted.bmp");
     void decrypt(std::string fname, int encryption_type);
+    void encrypt_text(int encryption_type);
+    void decrypt_text(int encryption_type);
+    void apply_encryption(int encryption_type);
+    void apply_decryption(int encryption_type);
+    void set_text(const std::vector<uint8_t>& text);
+    const std::vector<uint8_t>& get_text();
+    bool verify();
+    uint64_t capacity();
+    static uint64_t capacity(uint64_t data_size);
     void read_text_from_file(std::string fname);
     void write_text_out(std::string fname);
     void write_text_to_img_data();
+    void embed_text();
+    void write_checksum();
     void read_text_from_img_data();
+    void extract_text();
+    void open_text(std::string fname, int encryption_type);
+    uint64_t plain_text_size();
+    void read_text_range(uint64_t offset, uint64_t size);
     void write_image_out(std::string fname);
+    void save(AlignedBuffer& file_data);
+    void save(ByteSpan file_data);
+    void release_file_data(AlignedBuffer& file_data);
     void generate_key();
     void read_key();
     void encrypt_decrypt_data();
@@ -68,18 +733,155 @@ struct BMP
     void read_aes_key();
     void aes_encrypt();
     void aes_decrypt();
+    void ctr_crypt();
+    void password_encrypt();
+    void password_decrypt();
+    void envelope_encrypt();
+    void envelope_decrypt();
 
     private:
+        size_t read_headers(const uint8_t* file_data, size_t size);
+        void copy_rows(const uint8_t* file_data, size_t size);
+        uint32_t get_key_id();
+        void set_key_id(uint32_t key_id);
+        void for_each_range(size_t count, const std::function<void(size_t)>& body);
+        size_t row_ranges(std::vector<std::pair<size_t, size_t>>& ranges);
+        uint32_t checksum();
+        void embed_range(size_t begin, size_t end);
+        void read_image_data(uint64_t position, uint8_t* data, size_t count);
+        void read_cipher_text(uint64_t offset, uint8_t* bytes, size_t count);
+        void ctr_crypt_range(uint64_t offset, uint8_t* data, size_t size);
+        void recycle(AlignedBuffer& buffer);
+
         // Data from the BMP file
         BMPFileHeader file_header;
         BMPInfoHeader info_header;
-        std::vector<uint8_t> img_data;
-        uint8_t padding;
+        uint8_t padding{ 0 };
+
+        // Content of the BMP file. If its rows have no padding, the pixel data is used where it is in the file,
+        // otherwise the buffer holds a copy of the rows without padding. It is empty for a file owned by the caller.
+        AlignedBuffer buffer;
+
+        // Pixel data of all rows without padding
+        ByteSpan img_data;
 
         // Text to encrypt/decrypt
         std::vector<uint8_t> text;
 
+        // Header that embed_text writes in front of the text, or that extract_text read
+        EmbedHeader embed_header;
+
+        // Encryption type of the text: of apply_encryption, or from the header read by extract_text (0 if unknown)
+        uint8_t cipher{ 0 };
+
+        // BMP file opened by open_text, from which read_text_range reads only the rows that hold the requested bytes
+        std::ifstream text_file;
+
+        // Set by open_text: the byte of the image data at which the text starts, the size of the password header
+        // or recipient table in front of the ciphertext and the size of the decrypted text
+        uint64_t text_start{ 0 };
+        uint64_t cipher_start{ 0 };
+        uint64_t plain_size{ 0 };
+
+        // Buffers that are reused for every image loaded into this object: the output of the ciphers and the
+        // recipient table, the row ranges and their checksums
+        std::vector<uint8_t> scratch;
+        std::vector<std::pair<size_t, size_t>> ranges;
+        std::vector<uint32_t> range_crcs;
+
         // Keys for encryption/decryption
         uint64_t key;
         std::vector<uint8_t> aes_key;
-};
\ No newline at end of file
+
+        // Keystore for new keys and keys with an ID. Without keystore the key and aes_key files are used.
+        Keystore* keystore{ nullptr };
+
+        // Key given by the caller, which is used instead of the keystore and the key files if it is set
+        std::vector<uint8_t> caller_key;
+
+        // Password the AES keys are derived from (encryption type 4)
+        PasswordKey* password_key{ nullptr };
+
+        // Recipients or own private key (encryption type 5)
+        Envelope* envelope{ nullptr };
+
+        // Pool for the row ranges of large images, nullptr to process them on the calling thread
+        ThreadPool* thread_pool{ nullptr };
+
+        // Pool the file and row buffers are taken from and returned to, nullptr to allocate and free them
+        BufferPool* buffer_pool{ nullptr };
+};
+
+// File of an archive, from its entry in the table of contents
+struct ArchiveMember
+{
+    std::string name;
+    uint64_t offset{ 0 };
+    uint64_t size{ 0 };
+    uint32_t crc{ 0 };
+};
+
+// Archive payload with a table of contents, created from files and directories or read from an image (Archive.cpp)
+struct Archive
+{
+    void add(std::string input);
+    void write(std::string fname);
+    bool read(BMP& bmp);
+    bool find(const std::string& name, ArchiveMember& member);
+    void extract(BMP& bmp, const ArchiveMember& member, std::string out_fname);
+
+    // Files in the order of the table of contents
+    std::vector<ArchiveMember> members;
+
+    private:
+        // Files the added members are read from
+        std::vector<std::string> sources;
+};
+
+// Resident daemon that processes requests from a Unix domain socket with warm keys (Daemon.cpp)
+struct Daemon
+{
+    Daemon(std::string socket_path, Keystore* keystore, PasswordKey* password_key, Envelope* envelope);
+    int run(std::function<void()> on_listening = nullptr);
+    static void stop();
+
+    private:
+        void serve(int client);
+        void process(const DaemonRequest& request, int image_fd, AlignedBuffer& image, std::vector<uint8_t>& payload, DaemonResponse& response, AlignedBuffer& data);
+
+        std::string socket_path;
+        Keystore* keystore;
+        PasswordKey* password_key;
+        Envelope* envelope;
+
+        // Sockets of the open connections, which are shut down when the daemon stops
+        std::vector<int> clients;
+        std::mutex mutex;
+        std::condition_variable closed;
+};
+
+// Connection to a daemon (Daemon.cpp)
+struct DaemonClient
+{
+    DaemonClient(std::string socket_path);
+    ~DaemonClient();
+    uint32_t call(uint8_t command, uint8_t encryption_type, const uint8_t* image, size_t image_size, const uint8_t* payload, size_t payload_size, std::vector<uint8_t>& data);
+    uint32_t call_shared(uint8_t command, uint8_t encryption_type, int image_fd, size_t image_size, const uint8_t* payload, size_t payload_size, std::vector<uint8_t>& data);
+    static int create_shared_image(size_t size, uint8_t*& mapping);
+
+    private:
+        uint32_t send_request(const DaemonRequest& request, int image_fd, const uint8_t* image, const uint8_t* payload, std::vector<uint8_t>& data);
+
+        int fd{ -1 };
+};
+
+// Startup and daemon benchmarks (Bench.cpp)
+void make_bench_image(int width, int height, std::vector<uint8_t>& file_data);
+void write_bench_image(std::string fname, int width, int height);
+int startup_probe(int encryption_type);
+void bench_startup(std::string program);
+void bench_daemon(std::string socket_path, int encryption_type, size_t request_count, unsigned connection_count, int image_side, bool shared);
+void bench_huge_pages(size_t image_size, int runs);
+
+// Command line mode (CLI.cpp)
+int run_cli(int argc, char* argv[]);
@@ -0,0 +1,351 @@
+/*
+	Copyright (c) 2024 Mark Narain Enzinger
+
+	MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+// In the library error() throws instead of ending the process
+#define IMAGE_ENCRYPT_LIBRARY
+
+#include "image-encrypt.h"
+#include "libimage-encrypt.h"
+#include "BMP.cpp"
+#include "RNG.cpp"
+#include "ThreadPool.cpp"
+#include "Memory.cpp"
+#include "NUMA.cpp"
+#include "Pipeline.cpp"
+#include "IO.cpp"
+#include "Keystore.cpp"
+#include "KDF.cpp"
+#include "Envelope.cpp"
+#include "Crypto.cpp"
+
+/**********************************************************************
+*
+* Library interface (libimage-encrypt.h). Every function checks its
+* arguments, wraps the pixels of the caller in a BMP without a file
+* and converts the errors of the BMP functions to status codes. Keys
+* come from the caller and are never read from or written to files.
+*
+**********************************************************************/
+
+// Message of the last error of every thread, returned by ie_last_error
+static thread_local std::string last_error;
+
+/// <summary>
+/// Records the message of an error and returns its status code
+/// </summary>
+static ie_status fail(ie_status status, const std::string& message)
+{
+    last_error = message;
+    return status;
+}
+
+/// <summary>
+/// Runs the body of an API function and converts the exceptions thrown by error() and by allocations to status codes
+/// </summary>
+static ie_status call(const std::function<ie_status()>& body)
+{
+    try
+    {
+        return body();
+    }
+    catch (const std::bad_alloc&)
+    {
+        return fail(IE_ERROR_MEMORY, "Out of memory");
+    }
+    catch (const std::exception& e)
+    {
+        return fail(IE_ERROR_FAILED, e.what());
+    }
+}
+
+/// <summary>
+/// Checks the description of the pixels of the caller
+/// </summary>
+static ie_status check_image(const ie_image* image)
+{
+    if (!image || !image->pixels || image->width == 0 || image->height == 0)
+    {
+        return fail(IE_ERROR_ARGUMENT, "The image has no pixels.");
+    }
+
+    if (image->format != IE_PIXEL_BGR24 && image->format != IE_PIXEL_BGRA32)
+    {
+        return fail(IE_ERROR_ARGUMENT, "The pixel format is not supported.");
+    }
+
+    size_t row_size = (size_t)image->width * image->format;
+    if ((size_t)std::abs(image->stride) < row_size)
+    {
+        return fail(IE_ERROR_ARGUMENT, "The stride is smaller than a row of the image.");
+    }
+
+    if (image->height > SIZE_MAX / row_size)
+    {
+        return fail(IE_ERROR_ARGUMENT, "The image is too large.");
+    }
+
+    return IE_OK;
+}
+
+/// <summary>
+/// Returns the pixels of the caller as image data. Rows that follow each other without gaps are used in place,
+/// other rows are copied into a buffer without gaps.
+/// </summary>
+/// <param name="image">: The pixels of the caller</param>
+/// <param name="copy">: Receives the copied rows, stays empty if the pixels are used in place</param>
+static uint8_t* pack_rows(const ie_image& image, AlignedBuffer& copy)
+{
+    size_t row_size = (size_t)image.width * image.format;
+    if (image.stride == (ptrdiff_t)row_size)
+    {
+        return image.pixels;
+    }
+
+    copy.resize(row_size * image.height);
+    for (size_t i = 0; i < image.height; i++)
+    {
+        memcpy(copy.data() + row_size * i, image.pixels + image.stride * (ptrdiff_t)i, row_size);
+    }
+
+    return copy.data();
+}
+
+/// <summary>
+/// Copies the rows changed in the buffer of pack_rows back to the pixels of the caller
+/// </summary>
+static void unpack_rows(const ie_image& image, const AlignedBuffer& copy)
+{
+    if (copy.empty())
+    {
+        return;
+    }
+
+    size_t row_size = (size_t)image.width * image.format;
+    for (size_t i = 0; i < image.height; i++)
+    {
+        memcpy(image.pixels + image.stride * (ptrdiff_t)i, copy.data() + row_size * i, row_size);
+    }
+}
+
+/// <summary>
+/// Gives the key of the caller to the image
+/// </summary>
+/// <param name="bmp">: The image</param>
+/// <param name="key">: The key of the caller</param>
+/// <param name="embedding">: True when embedding (public keys of the recipients), false when extracting (own private key)</param>
+/// <param name="password_key">: Receives the password key for IE_ENCRYPTION_PASSWORD</param>
+/// <param name="envelope">: Receives the recipients or the private key for IE_ENCRYPTION_ENVELOPE</param>
+static ie_status set_key(BMP& bmp, const ie_key& key, bool embedding, std::unique_ptr<PasswordKey>& password_key, Envelope& envelope)
+{
+    switch (key.type)
+    {
+    case IE_ENCRYPTION_AES:
+    case IE_ENCRYPTION_XOR:
+    case IE_ENCRYPTION_CTR:
+        if (!key.key || key.key_size != (key.type == IE_ENCRYPTION_XOR ? 8 : AES_KEY_SIZE))
+        {
+            return fail(IE_ERROR_KEY, key.type == IE_ENCRYPTION_XOR ? "The XOR key must be 8 bytes long." : "The AES key must be 32 bytes long.");
+        }
+
+        bmp.set_key(key.key, key.key_size);
+        return IE_OK;
+    case IE_ENCRYPTION_NONE:
+        return IE_OK;
+    case IE_ENCRYPTION_PASSWORD:
+        if (!key.password)
+        {
+            return fail(IE_ERROR_KEY, "No password was given.");
+        }
+
+        password_key = std::make_unique<PasswordKey>(key.password);
+        bmp.set_password_key(password_key.get());
+        return IE_OK;
+    case IE_ENCRYPTION_ENVELOPE:
+        if (!key.key || key.key_size == 0 || key.key_size % X25519_KEY_SIZE != 0 || (!embedding && key.key_size != X25519_KEY_SIZE))
+        {
+            return fail(IE_ERROR_KEY, embedding ? "The public keys of the recipients must be 32 bytes each." : "The private key must be 32 bytes long.");
+        }
+
+        for (size_t i = 0; embedding && i < key.key_size; i += X25519_KEY_SIZE)
+        {
+            envelope.add_recipient(key.key + i);
+        }
+
+        if (!embedding)
+        {
+            envelope.set_identity(key.key);
+        }
+
+        bmp.set_envelope(&envelope);
+        return IE_OK;
+    default:
+        return fail(IE_ERROR_ARGUMENT, "Invalid encryption type.");
+    }
+}
+
+/// <summary>
+/// Returns how many bytes fit into the image
+/// </summary>
+ie_status ie_capacity(const ie_image* image, uint64_t* capacity)
+{
+    return call([&]() {
+        ie_status status = check_image(image);
+        if (status != IE_OK)
+        {
+            return status;
+        }
+
+        if (!capacity)
+        {
+            return fail(IE_ERROR_ARGUMENT, "No capacity was given.");
+        }
+
+        *capacity = BMP::capacity((uint64_t)image->width * image->height * image->format);
+        return IE_OK;
+    });
+}
+
+/// <summary>
+/// Encrypts the payload and embeds it into the pixels of the caller
+/// </summary>
+ie_status ie_embed(const ie_image* image, const uint8_t* payload, size_t payload_size, const ie_key* key)
+{
+    return call([&]() {
+        ie_status status = check_image(image);
+        if (status != IE_OK)
+        {
+            return status;
+        }
+
+        if (!key || (!payload && payload_size != 0))
+        {
+            return fail(IE_ERROR_ARGUMENT, "No payload or key was given.");
+        }
+
+        AlignedBuffer copy;
+        BMP bmp(pack_rows(*image, copy), image->width, image->height, image->format);
+
+        // Checked before the encryption as well, so a payload that can not fit is not encrypted first
+        if (payload_size > bmp.capacity())
+        {
+            return fail(IE_ERROR_CAPACITY, "The payload is too large for the image.");
+        }
+
+        std::unique_ptr<PasswordKey> password_key;
+        Envelope envelope;
+        status = set_key(bmp, *key, true, password_key, envelope);
+        if (status != IE_OK)
+        {
+            return status;
+        }
+
+        bmp.set_text(std::vector<uint8_t>(payload, payload + payload_size));
+        bmp.apply_encryption(key->type);
+
+        if (bmp.get_text().size() > bmp.capacity())
+        {
+            return fail(IE_ERROR_CAPACITY, "The encrypted payload is too large for the image.");
+        }
+
+        bmp.embed_text();
+        bmp.write_checksum();
+        unpack_rows(*image, copy);
+        return IE_OK;
+    });
+}
+
+/// <summary>
+/// Checks the checksum of the pixels of the caller and decrypts the payload
+/// </summary>
+ie_status ie_extract(const ie_image* image, const ie_key* key, uint8_t** payload, size_t* payload_size)
+{
+    return call([&]() {
+        ie_status status = check_image(image);
+        if (status != IE_OK)
+        {
+            return status;
+        }
+
+        if (!key || !payload || !payload_size)
+        {
+            return fail(IE_ERROR_ARGUMENT, "No key or output was given.");
+        }
+
+        *payload = nullptr;
+        *payload_size = 0;
+
+        AlignedBuffer copy;
+        BMP bmp(pack_rows(*image, copy), image->width, image->height, image->format);
+
+        if (!bmp.verify())
+        {
+            return fail(IE_ERROR_CHECKSUM, "The image holds no payload or was changed.");
+        }
+
+        std::unique_ptr<PasswordKey> password_key;
+        Envelope envelope;
+        status = set_key(bmp, *key, false, password_key, envelope);
+        if (status != IE_OK)
+        {
+            return status;
+        }
+
+        bmp.extract_text();
+        bmp.apply_decryption(key->type);
+
+        const std::vector<uint8_t>& text = bmp.get_text();
+        uint8_t* data = (uint8_t*)malloc(std::max<size_t>(1, text.size()));
+        if (!data)
+        {
+            return fail(IE_ERROR_MEMORY, "Out of memory");
+        }
+
+        memcpy(data, text.data(), text.size());
+        *payload = data;
+        *payload_size = text.size();
+        return IE_OK;
+    });
+}
+
+/// <summary>
+/// Checks the checksum of the pixels of the caller
+/// </summary>
+ie_status ie_verify(const ie_image* image)
+{
+    return call([&]() {
+        ie_status status = check_image(image);
+        if (status != IE_OK)
+        {
+            return status;
+        }
+
+        AlignedBuffer copy;
+        BMP bmp(pack_rows(*image, copy), image->width, image->height, image->format);
+
+        if (!bmp.verify())
+        {
+            return fail(IE_ERROR_CHECKSUM, "The image holds no payload or was changed.");
+        }
+
+        return IE_OK;
+    });
+}
+
+/// <summary>
+/// Frees a payload returned by ie_extract
+/// </summary>
+void ie_free(void* data)
+{
+    free(data);
+}
+
+/// <summary>
+/// Returns the message of the last error of the calling thread
+/// </summary>
+const char* ie_last_error(void)
+{
+    return last_error.c_str();
+}
@@ -0,0 +1,156 @@
+/*
+    Copyright (c) 2024 Mark Narain Enzinger
+
+    MIT License (https://github.com/marknarain/image-encrypt/blob/main/LICENSE)
+*/
+
+/**********************************************************************
+*
+* Public interface of the image-encrypt library (libimage-encrypt.cpp).
+* It embeds, extracts and verifies payloads in pixel buffers of the
+* caller, without files, key files or prompts, and reports errors with
+* status codes instead of ending the process. The functions can be
+* called from several threads at the same time.
+*
+* The pixels of an image are given as a pointer to the first row, the
+* distance between the rows in bytes (negative for rows that go up in
+* memory) and the pixel format. Every byte of a pixel carries one bit,
+* like in a BMP file. Row 0 is the first row of the embedded data, so
+* an image matches the BMP file of the command line tool if row 0 is
+* the bottom row.
+*
+**********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ie_status
+{
+    IE_OK = 0,
+    IE_ERROR_ARGUMENT,                          // Invalid image, key or payload arguments
+    IE_ERROR_CAPACITY,                          // The payload does not fit into the image
+    IE_ERROR_CHECKSUM,                          // The image holds no payload or was changed since it was embedded
+    IE_ERROR_KEY,                               // The key has the wrong size for the encryption type
+    IE_ERROR_MEMORY,                            // Out of memory
+    IE_ERROR_FAILED                             // Encryption or decryption failed, see ie_last_error
+} ie_status;
+
+typedef enum ie_pixel_format
+{
+    IE_PIXEL_BGR24 = 3,                         // 3 bytes per pixel
+    IE_PIXEL_BGRA32 = 4                         // 4 bytes per pixel
+} ie_pixel_format;
+
+// Encryption types, the same numbers as in the command line tool
+typedef enum ie_encryption_type
+{
+    IE_ENCRYPTION_AES = 1,
+    IE_ENCRYPTION_XOR = 2,
+    IE_ENCRYPTION_NONE = 3,
+    IE_ENCRYPTION_PASSWORD = 4,
+    IE_ENCRYPTION_ENVELOPE = 5,
+    IE_ENCRYPTION_CTR = 6                       // AES in counter mode, the text is not padded
+} ie_encryption_type;
+
+typedef struct ie_image
+{
+    uint8_t* pixels;                            // First byte of row 0
+    uint32_t width;                             // Width in pixels
+    uint32_t height;                            // Height in pixels
+    ptrdiff_t stride;                           // Bytes from the start of one row to the start of the next
+    ie_pixel_format format;
+} ie_image;
+
+typedef struct ie_key
+{
+    ie_encryption_type type;
+    const uint8_t* key;                         // AES and CTR: 32 bytes, XOR: 8 bytes, envelope: the 32-byte X25519 public keys
+                                                // of all recipients when embedding, the own private key when extracting
+    size_t key_size;                            // No. of bytes in key
+    const char* password;                       // Password for IE_ENCRYPTION_PASSWORD
+} ie_key;
+
+// Number of payload bytes that fit into the image, before encryption adds its headers and padding
+ie_status ie_capacity(const ie_image* image, uint64_t* capacity);
+
+// Encrypts the payload and embeds it into the pixels, followed by random bits and the checksum
+ie_status ie_embed(const ie_image* image, const uint8_t* payload, size_t payload_size, const ie_key* key);
+
+// Checks the checksum and decrypts the payload. The payload is allocated by the library and freed with ie_free.
+ie_status ie_extract(const ie_image* image, const ie_key* key, uint8_t** payload, size_t* payload_size);
+
+// Checks the checksum without decrypting the payload. Returns IE_ERROR_CHECKSUM if it does not match.
+ie_status ie_verify(const ie_image* image);
+
+// Frees a payload returned by ie_extract
+void ie_free(void* data);
+
+// Message of the last error of the calling thread
+const char* ie_last_error(void);
+
+#ifdef __cplusplus
+}
+
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// C++ interface that throws image_encrypt::Error instead of returning status codes
+namespace image_encrypt
+{
+    struct Error : std::runtime_error
+    {
+        Error(ie_status status) : std::runtime_error(ie_last_error()), status(status) {}
+        ie_status status;
+    };
+
+    inline void check(ie_status status)
+    {
+        if (status != IE_OK)
+        {
+            throw Error(status);
+        }
+    }
+
+    inline uint64_t capacity(const ie_image& image)
+    {
+        uint64_t capacity;
+        check(ie_capacity(&image, &capacity));
+        return capacity;
+    }
+
+    inline void embed(const ie_image& image, const std::vector<uint8_t>& payload, const ie_key& key)
+    {
+        check(ie_embed(&image, payload.data(), payload.size(), &key));
+    }
+
+    inline std::vector<uint8_t> extract(const ie_image& image, const ie_key& key)
+    {
+        uint8_t* data;
+        size_t size;
+        check(ie_extract(&image, &key, &data, &size));
+
+        std::unique_ptr<uint8_t, void (*)(void*)> owner(data, ie_free);
+        return std::vector<uint8_t>(data, data + size);
+    }
+
+    // Returns false if the checksum does not match
+    inline bool verify(const ie_image& image)
+    {
+        ie_status status = ie_verify(&image);
+        if (status == IE_ERROR_CHECKSUM)
+        {
+            return false;
+        }
+
+        check(status);
+        return true;
+    }
+}
+#endif
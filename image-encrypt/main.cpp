@@ -6,9 +6,30 @@
 
 #include "image-encrypt.h"
 #include "BMP.cpp"
-
-int main()
+#include "RNG.cpp"
+#include "ThreadPool.cpp"
+#include "Memory.cpp"
+#include "NUMA.cpp"
+#include "Pipeline.cpp"
+#include "IO.cpp"
+#include "Keystore.cpp"
+#include "Scan.cpp"
+#include "Archive.cpp"
+#include "KDF.cpp"
+#include "Envelope.cpp"
+#include "Crypto.cpp"
+#include "Daemon.cpp"
+#include "Bench.cpp"
+#include "CLI.cpp"
+
+int main(int argc, char* argv[])
 {
+	// With arguments the program runs without menu (see image-encrypt --help)
+	if (argc >= 2)
+	{
+		return run_cli(argc, argv);
+	}
+
 	std::string pictureName = "input-image.bmp";
 	std::string fileName = "input-text.txt";
 	std::string outputName = "output-text.txt";
@@ -19,13 +40,18 @@ int main()
 	std::cout << "Choose a option from the following menu: " << "\n"; 
 	std::cout << "1: Encrypt" << "\n";
 	std::cout << "2: Decrypt" << "\n";
-	std::cout << "3: Guide" << "\n";
-	std::cout << "4: Exit" << "\n\n";
+	std::cout << "3: Create recipient key pair" << "\n";
+	std::cout << "4: Guide" << "\n";
+	std::cout << "5: Exit" << "\n\n";
 
 	std::cin >> choice;
 	int encryption_type;
 
-	system("cls");
+	// All keys are stored in one keystore file instead of the key and aes_key files
+	Keystore keystore("keystore");
+
+	// Clear the screen with an escape sequence instead of starting a shell for cls
+	std::cout << "\033[2J\033[H";
 	switch (choice)
 	{
 		case 1:
@@ -33,6 +59,7 @@ int main()
 			std::cin >> pictureName;
 			{
 				BMP bmp(pictureName);
+				bmp.set_keystore(&keystore);
 				std::cout << "Enter the name of the file you want to encrypt: ";
 				std::cin >> fileName;
 
@@ -40,9 +67,39 @@ int main()
 				std::cout << "1: AES" << "\n";
 				std::cout << "2: XOR" << "\n";
 				std::cout << "3: None" << "\n";
+				std::cout << "4: AES with password" << "\n";
+				std::cout << "5: AES for several recipients" << "\n";
+				std::cout << "6: AES in counter mode" << "\n";
 
 				std::cin >> encryption_type;
 
+				std::string password;
+				if (encryption_type == 4)
+				{
+					std::cout << "Enter the password: ";
+					std::cin >> password;
+				}
+
+				PasswordKey password_key(password);
+				bmp.set_password_key(&password_key);
+
+				Envelope envelope;
+				if (encryption_type == 5)
+				{
+					int recipient_count;
+					std::cout << "For how many recipients: ";
+					std::cin >> recipient_count;
+
+					for (int i = 0; i < recipient_count; i++)
+					{
+						std::string public_key_name;
+						std::cout << "Enter the name of the public key file of recipient " << i + 1 << ": ";
+						std::cin >> public_key_name;
+						envelope.add_recipient(public_key_name);
+					}
+				}
+				bmp.set_envelope(&envelope);
+
 				bmp.encrypt(fileName, encryption_type);
 			}
 			break;
@@ -52,6 +109,7 @@ int main()
 			std::cin >> pictureName;
 			{
 				BMP bmp(pictureName);
+				bmp.set_keystore(&keystore);
 				std::cout << "How should the output be named: ";
 				std::cin >> fileName;
 
@@ -59,21 +117,54 @@ int main()
 				std::cout << "1: AES" << "\n";
 				std::cout << "2: XOR" << "\n";
 				std::cout << "3: None" << "\n";
+				std::cout << "4: AES with password" << "\n";
+				std::cout << "5: AES for several recipients" << "\n";
+				std::cout << "6: AES in counter mode" << "\n";
 
 				std::cin >> encryption_type;
 
+				std::string password;
+				if (encryption_type == 4)
+				{
+					std::cout << "Enter the password: ";
+					std::cin >> password;
+				}
+
+				PasswordKey password_key(password);
+				bmp.set_password_key(&password_key);
+
+				Envelope envelope;
+				if (encryption_type == 5)
+				{
+					std::string private_key_name;
+					std::cout << "Enter the name of your private key file: ";
+					std::cin >> private_key_name;
+					envelope.set_identity(private_key_name);
+				}
+				bmp.set_envelope(&envelope);
+
 				bmp.decrypt(fileName, encryption_type);
 			}
 			break;
 
 		case 3:
+			std::cout << "Enter the name of the key pair: ";
+			std::cin >> fileName;
+			Envelope::generate_key_pair(fileName);
+			std::cout << "The private key was written to " << fileName << ".key and the public key to " << fileName << ".pub" << "\n";
+			break;
+
+		case 4:
 			std::cout << "\033[1m\033[4m" << "Guide" << "\033[0m\033[24m" << "\n";
 			std::cout << "To encrypt a file into a picture, place the image and the file in the same dirctory with this program." << "\n";
-			std::cout << "To decrypt an image, place the image and the key file in the same directory with this program." << "\n";
-			std::cout << "The key file is generated when you encrypt a file." << "\n";
+			std::cout << "To decrypt an image, place the image and the keystore file in the same directory with this program." << "\n";
+			std::cout << "The key is added to the keystore file when you encrypt a file. The image remembers the ID of its key." << "\n";
+			std::cout << "Images encrypted by older versions still use the key or aes_key file." << "\n";
+			std::cout << "To encrypt a file for several recipients, everyone creates a key pair and hands out the .pub file." << "\n";
+			std::cout << "Each recipient decrypts the image with the own .key file." << "\n";
 			break; 
 
-		case 4:
+		case 5:
 			std::cout << "Exiting program ..." << "\n";
 			break;
 